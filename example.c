@@ -28,21 +28,21 @@ static void init_flash_driver(void)
             FLASH_SECTOR_SIZE);
 }
 
-static int op_sector_erase(struct ringfs_flash_partition *flash, int address)
+static int op_sector_erase(struct ringfs_flash_partition *flash, ringfs_addr_t address)
 {
     (void) flash;
     flashsim_sector_erase(sim, address);
     return 0;
 }
 
-static int op_program(struct ringfs_flash_partition *flash, int address, const void *data, int size)
+static int op_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
 {
     (void) flash;
     flashsim_program(sim, address, data, size);
     return size;
 }
 
-static int op_read(struct ringfs_flash_partition *flash, int address, void *data, int size)
+static int op_read(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int size)
 {
     (void) flash;
     flashsim_read(sim, address, data, size);
@@ -22,6 +22,218 @@
 #include "ringfs.h"
 
 /**
+ * @defgroup stats
+ * @{
+ */
+
+#ifdef RINGFS_STATS
+/**
+ * Count the flash operations that follow against a public call. Only
+ * written with statistics attached, which RINGFS_SPSC rules out: its two
+ * tasks would race on the current call.
+ */
+#define STATS_CALL(fs, call)    do { if ((fs)->stats) (fs)->stats_call = RINGFS_CALL_##call; } while (0)
+/** Count the erases that follow as done inline while appending, or stop. */
+#define STATS_APPENDING(fs, on) do { if ((fs)->stats) (fs)->stats_appending = (on); } while (0)
+#define STATS_ADD(fs, field, n) do { if ((fs)->stats) (fs)->stats->field += (uint32_t)(n); } while (0)
+#define STATS_BEGIN(fs)         _stats_begin(fs)
+#define STATS_END(fs, op, t)    _stats_end(fs, RINGFS_OP_##op, t)
+
+static uint32_t _stats_begin(ringfs_t * const fs)
+{
+    return (fs->stats && fs->stats->timestamp) ? fs->stats->timestamp() : 0;
+}
+
+static void _stats_end(ringfs_t * const fs, enum ringfs_stats_op op, uint32_t start)
+{
+    struct ringfs_stats * const stats = fs->stats;
+
+    if (!stats)
+    {
+        return;
+    }
+
+    stats->ops[fs->stats_call][op]++;
+    if (fs->stats_appending && op == RINGFS_OP_ERASE)
+    {
+        stats->append_erases++;
+    }
+
+    if (stats->timestamp)
+    {
+        const uint32_t ticks = stats->timestamp() - start;
+        int32_t bucket = 0;
+        while (bucket < RINGFS_STATS_BUCKETS - 1 && ticks >= (1u << bucket))
+        {
+            bucket++;
+        }
+        stats->latency[op][bucket]++;
+        if (ticks > stats->latency_max[op])
+        {
+            stats->latency_max[op] = ticks;
+        }
+    }
+}
+#else
+#define STATS_CALL(fs, call)    ((void) 0)
+#define STATS_APPENDING(fs, on) ((void) 0)
+#define STATS_ADD(fs, field, n) ((void) 0)
+#define STATS_BEGIN(fs)         0
+#define STATS_END(fs, op, t)    ((void) (t))
+#endif
+
+/**
+ * @}
+ * @defgroup flash
+ * @{
+ */
+
+static void _erase_wait(ringfs_t * const fs);
+static int32_t _erase_poll(ringfs_t * const fs);
+static int32_t _erase_begin(ringfs_t * const fs, const int32_t sector);
+
+/** Let the flash accept other commands while a background erase is running. */
+static void _flash_suspend(ringfs_t * const fs)
+{
+    if (fs->erase.sector >= 0 && !fs->erase.suspended && fs->flash->erase_suspend)
+    {
+        fs->flash->erase_suspend(fs->flash);
+        fs->erase.suspended = true;
+    }
+}
+
+static void _flash_resume(ringfs_t * const fs)
+{
+    if (fs->erase.suspended)
+    {
+        fs->flash->erase_resume(fs->flash);
+        fs->erase.suspended = false;
+    }
+}
+
+static int32_t _flash_read(ringfs_t * const fs, ringfs_addr_t address, void *data, int32_t size)
+{
+    _flash_suspend(fs);
+    const uint32_t start = STATS_BEGIN(fs);
+    const int32_t res = fs->flash->read(fs->flash, address, data, size);
+    STATS_END(fs, READ, start);
+    _flash_resume(fs);
+
+    return res;
+}
+
+/** Offset of an address within its program page. Requires a page size. */
+static int32_t _page_offset(ringfs_t * const fs, ringfs_addr_t address)
+{
+    const int32_t page_size = fs->flash->page_size;
+
+    /* Pages are a power of two in practice: mask rather than divide, which
+     * parts without a hardware divider do in software. */
+    if ((page_size & (page_size - 1)) == 0)
+    {
+        return (int32_t)(address & (page_size - 1));
+    }
+
+    return (int32_t)(address % page_size);
+}
+
+/** Program a range, split so that no single program crosses a page boundary. */
+static int32_t _flash_program(ringfs_t * const fs, ringfs_addr_t address, const void *data, int32_t size)
+{
+    const int32_t page_size = fs->flash->page_size;
+    const uint8_t *bytes    = data;
+    int32_t done = 0;
+
+    while (done < size)
+    {
+        int32_t chunk = size - done;
+        if (page_size > 0 && chunk > page_size - _page_offset(fs, address + done))
+        {
+            chunk = page_size - _page_offset(fs, address + done);
+        }
+
+        _flash_suspend(fs);
+        const uint32_t start = STATS_BEGIN(fs);
+        const int32_t res = fs->flash->program(fs->flash, address + done, bytes + done, chunk);
+        STATS_END(fs, PROGRAM, start);
+        _flash_resume(fs);
+        if (res < 0)
+        {
+            return -1;
+        }
+        done += chunk;
+    }
+
+    return size;
+}
+
+/** Check whether a range fits within one program page. */
+static bool _flash_in_page(ringfs_t * const fs, ringfs_addr_t address, int32_t size)
+{
+    const int32_t page_size = fs->flash->page_size;
+
+    return page_size == 0 || _page_offset(fs, address) + size <= page_size;
+}
+
+/** Program several ranges, in order, in one driver call if it can take them. */
+static int32_t _flash_programv(ringfs_t * const fs, const struct ringfs_iovec *iov, int32_t count)
+{
+    bool scalar = !fs->flash->programv;
+
+    /* Ranges crossing a page go the scalar way, which splits them. */
+    for (int32_t i = 0; i < count && !scalar; i++)
+    {
+        scalar = !_flash_in_page(fs, iov[i].address, iov[i].size);
+    }
+
+    if (scalar)
+    {
+        for (int32_t i = 0; i < count; i++)
+        {
+            if (_flash_program(fs, iov[i].address, iov[i].data, iov[i].size) < 0)
+            {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    _flash_suspend(fs);
+    const uint32_t start = STATS_BEGIN(fs);
+    const int32_t res = fs->flash->programv(fs->flash, iov, count);
+    STATS_END(fs, PROGRAM, start);
+    _flash_resume(fs);
+
+    return res;
+}
+
+/** Read several ranges in one driver call. Only used if the driver has readv. */
+static int32_t _flash_readv(ringfs_t * const fs, const struct ringfs_read_iovec *iov, int32_t count)
+{
+    _flash_suspend(fs);
+    const uint32_t start = STATS_BEGIN(fs);
+    const int32_t res = fs->flash->readv(fs->flash, iov, count);
+    STATS_END(fs, READ, start);
+    _flash_resume(fs);
+
+    return res;
+}
+
+static int32_t _flash_erase(ringfs_t * const fs, ringfs_addr_t address)
+{
+    /* One erase at a time. */
+    _erase_wait(fs);
+
+    const uint32_t start = STATS_BEGIN(fs);
+    const int32_t res = fs->flash->sector_erase(fs->flash, address);
+    STATS_END(fs, ERASE, start);
+
+    return res;
+}
+
+/**
+ * @}
  * @defgroup sector
  * @{
  */
@@ -31,8 +243,10 @@ enum sector_status
     SECTOR_ERASED     = 0xFFFFFFFF, /**< Default state after NOR flash erase. */
     SECTOR_FREE       = 0xFFFFFF00, /**< Sector erased. */
     SECTOR_IN_USE     = 0xFFFF0000, /**< Sector contains valid data. */
+    SECTOR_CONSUMED   = 0xFFF00000, /**< All data in the sector has been discarded. Unknown to 0.2.0 and older. */
     SECTOR_ERASING    = 0xFF000000, /**< Sector should be erased. */
     SECTOR_FORMATTING = 0x00000000, /**< The entire partition is being formatted. */
+    SECTOR_UNKNOWN    = 0x5A5A5A5A, /**< Sector table only: header not read yet. */
 };
 
 struct sector_header
@@ -41,73 +255,312 @@ struct sector_header
     uint32_t version;
 };
 
+/** Tells RINGFS_SLOT_BITMAP partitions apart from the header layout. */
+#define SECTOR_VERSION_BITMAP 0xB1B10000
+#define SECTOR_VERSION_PAGED  0x9A9E0000
+#define SECTOR_VERSION_SEQUENCE 0x5EC00000
+#define SECTOR_VERSION_KEYS     0x4B590000
+#define SECTOR_VERSION_GROUPS   0x67500000
+#define SECTOR_VERSION_VARIABLE 0x7A410000
+
+/** Group state, next to the header of a group's first sector. */
+enum group_status
+{
+    GROUP_FILLING     = 0xFFFFFFFF, /**< The write head hasn't left the group yet. */
+    GROUP_FULL        = 0xFFFF0000, /**< The write head has moved on to the next group. */
+};
+
 // local prototypes
-static int32_t  _sector_address(ringfs_t * const fs, int32_t sector_offset);
+static ringfs_addr_t _sector_address(ringfs_t * const fs, int32_t sector_offset);
 static int32_t  _sector_get_status(ringfs_t * const fs, int32_t sector, uint32_t * const status);
 static int32_t  _sector_set_status(ringfs_t * const fs, int32_t sector, uint32_t status);
 static int32_t  _sector_free(ringfs_t * const fs, int32_t sector);
+static int32_t  _sector_reclaim(ringfs_t * const fs, int32_t sector);
 
-static int32_t  _slot_address(ringfs_t * const fs, struct ringfs_loc * const loc);
+static ringfs_addr_t _slot_address(ringfs_t * const fs, struct ringfs_loc * const loc);
 static int32_t  _slot_get_status(ringfs_t * const fs, struct ringfs_loc * const loc, uint32_t * const status);
 static int32_t  _slot_set_status(ringfs_t * const fs, struct ringfs_loc * const loc, uint32_t status);
 
+static uint8_t *_readahead_slot(ringfs_t * const fs, struct ringfs_loc * const loc);
+static void     _readahead_update(ringfs_t * const fs, struct ringfs_loc * const loc, uint32_t status);
+static void     _readahead_invalidate(ringfs_t * const fs, int32_t sector);
+
+static void     _count_reset(ringfs_t * const fs, bool valid);
+static void     _count_add(ringfs_t * const fs, int32_t sector, int32_t delta);
+static void     _count_reclaim(ringfs_t * const fs, int32_t sector);
+static void     _count_forget(ringfs_t * const fs, int32_t sector);
+
+static int32_t  _checkpoint_write(ringfs_t * const fs);
+static int32_t  _scan_checkpoint(ringfs_t * const fs);
+
 static bool _loc_equal(struct ringfs_loc * const a, struct ringfs_loc * const b);
 static void _loc_advance_sector(ringfs_t * const fs, struct ringfs_loc * const loc);
 static void _loc_advance_slot(ringfs_t * const fs, struct ringfs_loc * const loc);
+static void _loc_advance_bytes(ringfs_t * const fs, struct ringfs_loc * const loc, int32_t bytes);
+
+static int32_t _spsc_reclaim(ringfs_t * const fs, int32_t sector);
+static void _cursors_reclaim(ringfs_t * const fs, int32_t sector);
+
+static int32_t _wbuf_flush(ringfs_t * const fs);
+static void _append_commit(ringfs_t * const fs, int32_t count);
+static int32_t _append_var(ringfs_t * const fs, const void * const object, int32_t size);
+static int32_t _fetch_var(ringfs_t * const fs, struct ringfs_loc * const loc, void * const object, int32_t size);
+static void _fetch_done(ringfs_t * const fs, struct ringfs_loc * const loc);
+
+static ringfs_addr_t _sector_address(ringfs_t * const fs, int32_t sector_offset)
+{
+    return ((ringfs_addr_t)fs->flash->sector_offset + sector_offset) * fs->flash->sector_size;
+}
+
+/** The sector some way (up to a full lap) after another, without a modulo. */
+static int32_t _sector_after(ringfs_t * const fs, int32_t sector, int32_t ahead)
+{
+    sector += ahead;
+    if (sector >= fs->flash->sector_count)
+    {
+        sector -= fs->flash->sector_count;
+    }
+
+    return sector;
+}
+
+/** Number of sectors from one sector forward to another. */
+static int32_t _sector_distance(ringfs_t * const fs, int32_t from, int32_t to)
+{
+    const int32_t distance = to - from;
+
+    return distance < 0 ? distance + fs->flash->sector_count : distance;
+}
+
+/** Version word stored on flash, tagged with the slot layout. */
+static uint32_t _sector_version(ringfs_t * const fs)
+{
+    uint32_t version = (fs->flags & RINGFS_SEQUENCE) ?
+                       fs->version ^ SECTOR_VERSION_SEQUENCE : fs->version;
+
+    if (fs->flags & RINGFS_KEY_RANGE)
+    {
+        version ^= SECTOR_VERSION_KEYS;
+    }
+    if (fs->flags & RINGFS_SECTOR_GROUPS)
+    {
+        version ^= SECTOR_VERSION_GROUPS;
+    }
+    if (fs->flags & RINGFS_VARIABLE)
+    {
+        version ^= SECTOR_VERSION_VARIABLE;
+    }
+
+    if (fs->flags & RINGFS_SLOT_BITMAP)
+    {
+        return version ^ SECTOR_VERSION_BITMAP;
+    }
+    if (fs->flags & RINGFS_PAGE_ALIGN)
+    {
+        /* The layout depends on the page size: refuse to mount another one. */
+        return version ^ SECTOR_VERSION_PAGED ^ (uint32_t)fs->flash->page_size;
+    }
+
+    return version;
+}
+
+/** Bytes at the end of a sector that aren't slots: the header, the sequence
+ * number of the first slot with RINGFS_SEQUENCE, the key range with
+ * RINGFS_KEY_RANGE and the group state with RINGFS_SECTOR_GROUPS, in
+ * reverse order. */
+static int32_t _sector_trailer_size(ringfs_t * const fs)
+{
+    return (int32_t)sizeof(struct sector_header) +
+           ((fs->flags & RINGFS_SEQUENCE) ? (int32_t)sizeof(uint32_t) : 0) +
+           ((fs->flags & RINGFS_KEY_RANGE) ? 2 * (int32_t)sizeof(uint32_t) : 0) +
+           ((fs->flags & RINGFS_SECTOR_GROUPS) ? (int32_t)sizeof(uint32_t) : 0);
+}
+
+/** Offset of the key range in a sector. */
+static int32_t _sector_keys_offset(ringfs_t * const fs)
+{
+    return fs->flash->sector_size - (int32_t)sizeof(struct sector_header) -
+           ((fs->flags & RINGFS_SEQUENCE) ? (int32_t)sizeof(uint32_t) : 0) - 2 * (int32_t)sizeof(uint32_t);
+}
+
+/** Sequence number of a sector's first slot, erased until the sector is used. */
+static int32_t _sector_get_seq(ringfs_t * const fs, int32_t sector, uint32_t * const seq)
+{
+    const int32_t offs = fs->flash->sector_size - (int32_t)sizeof(struct sector_header) - (int32_t)sizeof(*seq);
+
+    return _flash_read(fs, _sector_address(fs, sector) + offs, seq, sizeof(*seq)) < 0 ? -1 : 0;
+}
+
+static int32_t _sector_set_seq(ringfs_t * const fs, int32_t sector, uint32_t seq)
+{
+    const int32_t offs = fs->flash->sector_size - (int32_t)sizeof(struct sector_header) - (int32_t)sizeof(seq);
+
+    return _flash_program(fs, _sector_address(fs, sector) + offs, &seq, sizeof(seq)) < 0 ? -1 : 0;
+}
+
+/** Smallest and largest key in a sector, erased until the sector is summarized. */
+static int32_t _sector_get_keys(ringfs_t * const fs, int32_t sector, uint32_t keys[2])
+{
+    const int32_t offs = _sector_keys_offset(fs);
+
+    return _flash_read(fs, _sector_address(fs, sector) + offs, keys, 2 * sizeof(keys[0])) < 0 ? -1 : 0;
+}
+
+static int32_t _sector_set_keys(ringfs_t * const fs, int32_t sector, const uint32_t keys[2])
+{
+    const int32_t offs = _sector_keys_offset(fs);
+
+    return _flash_program(fs, _sector_address(fs, sector) + offs, keys, 2 * sizeof(keys[0])) < 0 ? -1 : 0;
+}
+
+/** First sector of the group after the one a sector is in. */
+static int32_t _group_next(ringfs_t * const fs, int32_t sector)
+{
+    const int32_t next = sector - sector % fs->group_size + fs->group_size;
+
+    return next < fs->flash->sector_count ? next : 0;
+}
+
+/** State of the group led by a sector; meaningless unless the sector is in use. */
+static int32_t _group_get_status(ringfs_t * const fs, int32_t leader, uint32_t * const status)
+{
+    const int32_t offs = fs->flash->sector_size - _sector_trailer_size(fs);
+
+    return _flash_read(fs, _sector_address(fs, leader) + offs, status, sizeof(*status)) < 0 ? -1 : 0;
+}
+
+/** Mark the group led by a sector full, if it's in use and not marked yet. */
+static void _group_close(ringfs_t * const fs, int32_t leader)
+{
+    const int32_t offs = fs->flash->sector_size - _sector_trailer_size(fs);
+    const uint32_t full = GROUP_FULL;
+    uint32_t status;
+
+    _sector_get_status(fs, leader, &status);
+    if (status != SECTOR_IN_USE && status != SECTOR_CONSUMED)
+    {
+        return;
+    }
+
+    _group_get_status(fs, leader, &status);
+    if (status == GROUP_FILLING)
+    {
+        _flash_program(fs, _sector_address(fs, leader) + offs, &full, sizeof(full));
+    }
+}
 
-static int32_t _sector_address(ringfs_t * const fs, int32_t sector_offset)
+/** Complete a sector erase: write the version and mark the sector FREE. */
+static void _sector_erase_finish(ringfs_t * const fs, int32_t sector)
 {
-    return (fs->flash->sector_offset + sector_offset) * fs->flash->sector_size;
+    const ringfs_addr_t sector_addr = _sector_address(fs, sector);
+    const int32_t       sector_size = fs->flash->sector_size;
+    const int32_t       offs        = sector_size - (int32_t)sizeof(struct sector_header) + (int32_t)offsetof(struct sector_header, version);
+
+    const uint32_t      version     = _sector_version(fs);
+
+    _readahead_invalidate(fs, sector);
+    _count_forget(fs, sector);
+    if (fs->bitmap_sector == sector)
+    {
+        fs->bitmap_sector = -1;
+    }
+    if (fs->var_loc.sector == sector)
+    {
+        fs->var_loc.sector = -1;
+    }
+    if (fs->sector_table)
+    {
+        fs->sector_table[sector] = SECTOR_ERASED;
+    }
+    _flash_program(fs, sector_addr + offs, &version, sizeof(version));
+    _sector_set_status(fs, sector, SECTOR_FREE);
 }
 
 static int32_t _sector_free(ringfs_t * const fs, int32_t sector)
 {
-    const int32_t sector_addr = _sector_address(fs, sector);
-    const int32_t sector_size = fs->flash->sector_size;
-    const int32_t offs        = sector_size - (int32_t)sizeof(struct sector_header) + (int32_t)offsetof(struct sector_header, version);
+    /* Already being erased in the background: just wait for it. */
+    if (sector == fs->erase.sector)
+    {
+        _erase_wait(fs);
+        return 0;
+    }
 
     _sector_set_status(fs, sector, SECTOR_ERASING);
-    fs->flash->sector_erase(fs->flash, sector_addr);
-    fs->flash->program(
-    		            fs->flash,
-                        sector_addr + offs,
-                        &fs->version,
-					    sizeof(fs->version)
-					   );
-    _sector_set_status(fs, sector, SECTOR_FREE);
+    _flash_erase(fs, _sector_address(fs, sector));
+    _sector_erase_finish(fs, sector);
+    return 0;
+}
+
+/** Move the read & cursor heads out of a sector that's about to be erased. */
+static int32_t _sector_reclaim(ringfs_t * const fs, int32_t sector)
+{
+    /* The consumer moves its own heads. */
+    if (fs->flags & RINGFS_SPSC)
+    {
+        return _spsc_reclaim(fs, sector);
+    }
+
+    _count_reclaim(fs, sector);
+
+    if (fs->read.sector == sector)
+    {
+        _loc_advance_sector(fs, &fs->read);
+    }
+
+    if (fs->cursor.sector == sector)
+    {
+        _loc_advance_sector(fs, &fs->cursor);
+    }
+
+    _cursors_reclaim(fs, sector);
+
     return 0;
 }
 
 static int32_t _sector_get_status(ringfs_t * const fs, int32_t sector, uint32_t * const status)
 {
-    const int32_t sector_addr = _sector_address(fs, sector);
-    const int32_t sector_size = fs->flash->sector_size;
-    const int32_t offs        = sector_size - (int32_t)sizeof(struct sector_header) + (int32_t)offsetof(struct sector_header, status);
+    /* Don't read a sector while it's being erased. */
+    if (sector == fs->erase.sector)
+    {
+        *status = SECTOR_ERASING;
+        return (int32_t)sizeof(*status);
+    }
+
+    if (fs->sector_table && fs->sector_table[sector] != SECTOR_UNKNOWN)
+    {
+        *status = fs->sector_table[sector];
+        return (int32_t)sizeof(*status);
+    }
+
+    const ringfs_addr_t sector_addr = _sector_address(fs, sector);
+    const int32_t       sector_size = fs->flash->sector_size;
+    const int32_t       offs        = sector_size - (int32_t)sizeof(struct sector_header) + (int32_t)offsetof(struct sector_header, status);
 	int32_t       res;
 
-    res = fs->flash->read(
-    		              fs->flash,
-                          sector_addr + offs,
-                          status,
-						  (uint32_t)sizeof(int32_t)
-						 );
+    res = _flash_read(fs, sector_addr + offs, status, (int32_t)sizeof(*status));
+
+    if (fs->sector_table)
+    {
+        fs->sector_table[sector] = *status;
+    }
 
     return res;
 }
 
 static int32_t _sector_set_status(ringfs_t * const fs, int32_t sector, uint32_t status)
 {
-    const int32_t sector_addr = _sector_address(fs, sector);
-    const int32_t sector_size = fs->flash->sector_size;
-    const int32_t offs        = sector_size - (int32_t)sizeof(struct sector_header) + (int32_t)offsetof(struct sector_header, status);
+    const ringfs_addr_t sector_addr = _sector_address(fs, sector);
+    const int32_t       sector_size = fs->flash->sector_size;
+    const int32_t       offs        = sector_size - (int32_t)sizeof(struct sector_header) + (int32_t)offsetof(struct sector_header, status);
 	int32_t       res;
 
-    res = fs->flash->program(
-    		                 fs->flash,
-		                     sector_addr + offs,
-                             &status,
-							 sizeof(status)
-							);
+    res = _flash_program(fs, sector_addr + offs, &status, sizeof(status));
+
+    /* Mirror NOR semantics: programming can only clear bits. */
+    if (fs->sector_table && fs->sector_table[sector] != SECTOR_UNKNOWN)
+    {
+        fs->sector_table[sector] &= status;
+    }
 
     return res;
 }
@@ -131,440 +584,3577 @@ struct slot_header
     uint32_t status;
 };
 
-static int32_t _slot_address(ringfs_t * const fs, struct ringfs_loc * const loc)
+/**
+ * RINGFS_SLOT_BITMAP layout: slots hold payload only, and their states are
+ * kept as 2-bit entries in a bitmap right before the sector header. Appends
+ * don't reserve slots; a torn write shows as an ERASED slot with a
+ * programmed payload, which ringfs_scan() marks as RESERVED.
+ */
+enum slot_bits
 {
-	const int32_t slot_offs = ((int32_t)sizeof(struct slot_header) + fs->object_size) * loc->slot;
+    SLOT_BITS_ERASED   = 3, /**< 11: default state after NOR flash erase. */
+    SLOT_BITS_VALID    = 2, /**< 10: write committed. */
+    SLOT_BITS_RESERVED = 1, /**< 01: torn write found by ringfs_scan(). */
+    SLOT_BITS_GARBAGE  = 0, /**< 00: discarded. */
+};
 
-    return _sector_address(fs, loc->sector) + slot_offs;
-}
+#define SLOT_BITS_PER_WORD 16
 
-static int32_t _slot_get_status(ringfs_t * const fs, struct ringfs_loc *const loc, uint32_t * const status)
+/**
+ * RINGFS_VARIABLE layout: records are packed back-to-back, each one a header
+ * followed by the payload padded to a multiple of 4 bytes. Locations hold
+ * byte offsets into the sector instead of slot indices, and records never
+ * span sectors: the tail of a sector that didn't fit the next record is
+ * left erased.
+ */
+struct var_header
 {
-	const int32_t offs      = offsetof(struct slot_header, status);
-	const int32_t slot_addr = _slot_address(fs, loc);
-
-    return fs->flash->read(fs->flash,
-            slot_addr + offs,
-            status, sizeof(*status));
-}
+    uint16_t status;
+    uint16_t length;
+};
 
-static int32_t _slot_set_status(ringfs_t * const fs, struct ringfs_loc * const loc, uint32_t status)
+enum var_status
 {
-	const int32_t offs      = offsetof(struct slot_header, status);
-	const int32_t slot_addr = _slot_address(fs, loc);
+    VAR_ERASED   = 0xFFFF,
+    VAR_RESERVED = 0xFFF0,
+    VAR_VALID    = 0xFF00,
+    VAR_GARBAGE  = 0xF000,
+};
 
-    return fs->flash->program(fs->flash, 
-            slot_addr + offs,
-            &status, sizeof(status));
-}
+/** Smallest possible record: a header and one padded byte of payload. */
+#define VAR_RECORD_MIN ((int32_t)sizeof(struct var_header) + 4)
 
-/**
- * @}
- * @defgroup loc
- * @{
- */
+static int32_t _var_record_size(int32_t length)
+{
+    return (int32_t)sizeof(struct var_header) + (length + 3) / 4 * 4;
+}
 
-static bool _loc_equal(struct ringfs_loc * const a, struct ringfs_loc * const b)
+/** Size of a RINGFS_SLOT_BITMAP status bitmap, padded to whole words. */
+static int32_t _slot_bitmap_size(int32_t slots)
 {
-    return (a->sector == b->sector) && (a->slot == b->slot);
+    return (slots + SLOT_BITS_PER_WORD - 1) / SLOT_BITS_PER_WORD * 4;
 }
 
-/** Advance a location to the beginning of the next sector. */
-static void _loc_advance_sector(ringfs_t * const fs, struct ringfs_loc * const loc)
+static ringfs_addr_t _slot_address(ringfs_t * const fs, struct ringfs_loc * const loc)
 {
-    loc->slot = 0;
-    loc->sector++;
-    if (loc->sector >= fs->flash->sector_count)
+    if (fs->flags & RINGFS_VARIABLE)
     {
-        loc->sector = 0;
+        return _sector_address(fs, loc->sector) + loc->slot;
     }
 
-    return;
-}
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
 
-/** Advance a location to the next slot, advancing the sector too if needed. */
-static void _loc_advance_slot(ringfs_t * const fs, struct ringfs_loc * const loc)
+    if (fs->flags & RINGFS_PAGE_ALIGN)
+    {
+        /* Slots come in groups of page_slots, each starting on a page. */
+        const int32_t slot_offs = loc->slot / fs->page_slots * fs->page_stride +
+                                  loc->slot % fs->page_slots * slot_size;
+
+        return _sector_address(fs, loc->sector) + slot_offs;
+    }
+
+	const int32_t slot_offs = slot_size * loc->slot;
+
+    return _sector_address(fs, loc->sector) + slot_offs;
+}
+
+/** Number of slots laid out back-to-back from a location, itself included. */
+static int32_t _slot_run(ringfs_t * const fs, struct ringfs_loc * const loc)
 {
-    loc->slot++;
-    if (loc->slot >= fs->slots_per_sector)
+    int32_t run = fs->slots_per_sector - loc->slot;
+
+    if ((fs->flags & RINGFS_PAGE_ALIGN) && run > fs->page_slots - loc->slot % fs->page_slots)
     {
-        _loc_advance_sector(fs, loc);
+        run = fs->page_slots - loc->slot % fs->page_slots;
     }
 
-    return;
+    return run;
+}
+
+/** Address of the bitmap word holding the state of a slot. */
+static ringfs_addr_t _slot_bitmap_address(ringfs_t * const fs, struct ringfs_loc * const loc)
+{
+    const int32_t bitmap_offs = fs->flash->sector_size - _sector_trailer_size(fs) -
+                                _slot_bitmap_size(fs->slots_per_sector);
+
+    return _sector_address(fs, loc->sector) + bitmap_offs + loc->slot / SLOT_BITS_PER_WORD * 4;
+}
+
+static int32_t _slot_get_status(ringfs_t * const fs, struct ringfs_loc *const loc, uint32_t * const status)
+{
+    if (fs->flags & RINGFS_VARIABLE)
+    {
+        /* The last header read is kept: advancing needs its length. */
+        if (!_loc_equal(loc, &fs->var_loc))
+        {
+            struct var_header header;
+            _flash_read(fs, _slot_address(fs, loc), &header, sizeof(header));
+            fs->var_loc = *loc;
+            fs->var_status = header.status;
+            fs->var_length = header.length;
+        }
+
+        switch (fs->var_status)
+        {
+            case VAR_ERASED:   *status = SLOT_ERASED;   break;
+            case VAR_RESERVED: *status = SLOT_RESERVED; break;
+            case VAR_VALID:    *status = SLOT_VALID;    break;
+            default:           *status = SLOT_GARBAGE;  break;
+        }
+
+        return (int32_t)sizeof(*status);
+    }
+
+    if (fs->slot_header_size == 0)
+    {
+        const int32_t word = loc->slot / SLOT_BITS_PER_WORD;
+
+        /* One read serves the states of a whole word's worth of slots. */
+        if (fs->bitmap_sector != loc->sector || fs->bitmap_word != word)
+        {
+            _flash_read(fs, _slot_bitmap_address(fs, loc), fs->bitmap_cache, sizeof(fs->bitmap_cache));
+            fs->bitmap_sector = loc->sector;
+            fs->bitmap_word = word;
+        }
+
+        const int32_t bit = (loc->slot % SLOT_BITS_PER_WORD) * 2;
+        switch ((fs->bitmap_cache[bit / 8] >> (bit % 8)) & 3)
+        {
+            case SLOT_BITS_ERASED:   *status = SLOT_ERASED;   break;
+            case SLOT_BITS_VALID:    *status = SLOT_VALID;    break;
+            case SLOT_BITS_RESERVED: *status = SLOT_RESERVED; break;
+            default:                 *status = SLOT_GARBAGE;  break;
+        }
+
+        return (int32_t)sizeof(*status);
+    }
+
+	const int32_t offs      = offsetof(struct slot_header, status);
+	const ringfs_addr_t slot_addr = _slot_address(fs, loc);
+
+    return _flash_read(fs, slot_addr + offs,
+            status, sizeof(*status));
+}
+
+/** Program the 2-bit state of a slot, leaving the other slots' bits at 1. */
+static int32_t _slot_set_bits(ringfs_t * const fs, struct ringfs_loc * const loc, uint8_t bits)
+{
+    const int32_t bit = (loc->slot % SLOT_BITS_PER_WORD) * 2;
+    uint8_t word[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+
+    word[bit / 8] &= (uint8_t)~((~bits & 3) << (bit % 8));
+
+    if (fs->bitmap_sector == loc->sector && fs->bitmap_word == loc->slot / SLOT_BITS_PER_WORD)
+    {
+        fs->bitmap_cache[bit / 8] &= word[bit / 8];
+    }
+
+    STATS_ADD(fs, header_bytes, sizeof(word));
+    return _flash_program(fs, _slot_bitmap_address(fs, loc), word, sizeof(word));
+}
+
+/** Keep RAM state in step with a slot status program. */
+static void _slot_status_changed(ringfs_t * const fs, struct ringfs_loc * const loc, uint32_t status)
+{
+    _readahead_update(fs, loc, status);
+    if (status == SLOT_VALID)
+    {
+        _count_add(fs, loc->sector, 1);
+    }
+}
+
+static int32_t _slot_set_status(ringfs_t * const fs, struct ringfs_loc * const loc, uint32_t status)
+{
+	const int32_t offs      = offsetof(struct slot_header, status);
+	const ringfs_addr_t slot_addr = _slot_address(fs, loc);
+
+    _slot_status_changed(fs, loc, status);
+
+    if (fs->flags & RINGFS_VARIABLE)
+    {
+        struct var_header header = { VAR_GARBAGE, 0xFFFF };
+
+        switch (status)
+        {
+            case SLOT_RESERVED: header.status = VAR_RESERVED; break;
+            case SLOT_VALID:    header.status = VAR_VALID;    break;
+            default:                                          break;
+        }
+
+        if (_loc_equal(loc, &fs->var_loc))
+        {
+            fs->var_status &= header.status;
+        }
+
+        STATS_ADD(fs, header_bytes, sizeof(header));
+        return _flash_program(fs, slot_addr, &header, sizeof(header));
+    }
+
+    if (fs->slot_header_size == 0)
+    {
+        switch (status)
+        {
+            case SLOT_RESERVED: return 0;
+            case SLOT_VALID:    return _slot_set_bits(fs, loc, SLOT_BITS_VALID);
+            default:            return _slot_set_bits(fs, loc, SLOT_BITS_GARBAGE);
+        }
+    }
+
+    STATS_ADD(fs, header_bytes, sizeof(status));
+    return _flash_program(fs, slot_addr + offs,
+            &status, sizeof(status));
 }
 
 /**
  * @}
+ * @defgroup readahead
+ * @{
  */
 
-/* And here we go. */
+/**
+ * Get the buffered image of a slot, reading a run of slots from the sector
+ * into the read-ahead buffer if needed. The run never extends past the write
+ * head, so appends can't make the buffer stale.
+ *
+ * @returns Pointer to the slot header (payload in the bitmap layout),
+ *          or NULL if there's no buffer.
+ */
+static uint8_t *_readahead_slot(ringfs_t * const fs, struct ringfs_loc * const loc)
+{
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
 
-int32_t ringfs_init(ringfs_t * const fs, struct ringfs_flash_partition * const flash, uint32_t version, int32_t object_size)
+    /* Variable-size records only use the buffer for ringfs_peek(). */
+    if (!fs->readahead || (fs->flags & RINGFS_VARIABLE))
+    {
+        return NULL;
+    }
+
+    if (fs->readahead_count == 0 ||
+        loc->sector != fs->readahead_loc.sector ||
+        loc->slot < fs->readahead_loc.slot ||
+        loc->slot >= fs->readahead_loc.slot + fs->readahead_count)
+    {
+        int32_t count = fs->readahead_size / slot_size;
+        if (count > _slot_run(fs, loc))
+        {
+            count = _slot_run(fs, loc);
+        }
+        if (loc->sector == fs->write.sector && count > fs->write.slot - loc->slot)
+        {
+            count = fs->write.slot - loc->slot;
+        }
+        if (count <= 0)
+        {
+            return NULL;
+        }
+
+        _flash_read(fs, _slot_address(fs, loc), fs->readahead, count * slot_size);
+        fs->readahead_loc   = *loc;
+        fs->readahead_count = count;
+    }
+
+    return fs->readahead + (loc->slot - fs->readahead_loc.slot) * slot_size;
+}
+
+/** Keep a buffered slot header in sync with a status program. */
+static void _readahead_update(ringfs_t * const fs, struct ringfs_loc * const loc, uint32_t status)
 {
-    /* Copy arguments to instance. */
-    fs->flash = flash;
-    fs->version = version;
-    fs->object_size = object_size;
+    if (fs->readahead_count == 0 || fs->slot_header_size == 0 ||
+        loc->sector != fs->readahead_loc.sector ||
+        loc->slot < fs->readahead_loc.slot ||
+        loc->slot >= fs->readahead_loc.slot + fs->readahead_count)
+    {
+        return;
+    }
 
-    /* Precalculate commonly used values. */
-    fs->slots_per_sector = (fs->flash->sector_size - (int32_t)sizeof(struct sector_header)) /
-                           ((int32_t)sizeof(struct slot_header) + fs->object_size);
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
+    uint8_t *slot = fs->readahead + (loc->slot - fs->readahead_loc.slot) * slot_size;
+    uint32_t buffered;
 
-    fs->cache_filling_level = 0;
-    memset(fs->cache, 0, sizeof(fs->cache));
+    memcpy(&buffered, slot + offsetof(struct slot_header, status), sizeof(buffered));
+    buffered &= status;
+    memcpy(slot + offsetof(struct slot_header, status), &buffered, sizeof(buffered));
+}
+
+/** Drop the buffered run if it belongs to the given sector (or any, if -1). */
+static void _readahead_invalidate(ringfs_t * const fs, int32_t sector)
+{
+    if (sector < 0 || sector == fs->readahead_loc.sector)
+    {
+        fs->readahead_count = 0;
+    }
+}
+
+/**
+ * @}
+ * @defgroup count
+ * @{
+ */
+
+/**
+ * Clear the valid-object counters. If not valid, they're rebuilt from flash
+ * by the next ringfs_count_exact().
+ */
+static void _count_reset(ringfs_t * const fs, bool valid)
+{
+    if (!fs->count_table)
+    {
+        return;
+    }
+
+    memset(fs->count_table, 0, (size_t)fs->flash->sector_count * sizeof(*fs->count_table));
+    fs->count_total = 0;
+    fs->count_cursor = 0;
+    fs->count_valid = valid;
+}
+
+/** Count the VALID slots between the read and write heads. */
+static void _count_rebuild(ringfs_t * const fs)
+{
+    struct ringfs_loc loc = fs->read;
+    bool before_cursor = true;
+
+    _count_reset(fs, true);
+    while (!_loc_equal(&loc, &fs->write))
+    {
+        uint32_t status;
+
+        if (_loc_equal(&loc, &fs->cursor))
+        {
+            before_cursor = false;
+        }
+
+        _slot_get_status(fs, &loc, &status);
+        if (status == SLOT_VALID)
+        {
+            fs->count_table[loc.sector]++;
+            fs->count_total++;
+            if (before_cursor)
+            {
+                fs->count_cursor++;
+            }
+        }
+
+        _loc_advance_slot(fs, &loc);
+    }
+}
+
+/** Account for objects committed to (or removed from) a sector. */
+static void _count_add(ringfs_t * const fs, int32_t sector, int32_t delta)
+{
+    if (fs->count_table && fs->count_valid)
+    {
+        fs->count_table[sector] += delta;
+        fs->count_total += delta;
+    }
+}
+
+/** Account for the read & cursor heads leaving a sector about to be erased. */
+static void _count_reclaim(ringfs_t * const fs, int32_t sector)
+{
+    if (!fs->count_table || !fs->count_valid)
+    {
+        return;
+    }
+
+    if (fs->cursor.sector == sector)
+    {
+        if (fs->read.sector != sector)
+        {
+            /* Objects between the heads are lost: start over. */
+            fs->count_valid = false;
+            return;
+        }
+        fs->count_cursor = 0;
+    }
+    else if (fs->read.sector == sector)
+    {
+        fs->count_cursor -= fs->count_table[sector];
+    }
+
+    _count_add(fs, sector, -fs->count_table[sector]);
+}
+
+/** Account for the objects in [read, cursor) being discarded. */
+static void _count_discard(ringfs_t * const fs)
+{
+    if (!fs->count_table || !fs->count_valid)
+    {
+        return;
+    }
+
+    /* Whatever isn't in a fully consumed sector is in the cursor's one. */
+    int32_t remaining = fs->count_cursor;
+    for (int32_t sector = fs->read.sector; sector != fs->cursor.sector;
+         sector = _sector_after(fs, sector, 1))
+    {
+        remaining -= fs->count_table[sector];
+        fs->count_table[sector] = 0;
+    }
+    fs->count_table[fs->cursor.sector] -= remaining;
+    fs->count_total -= fs->count_cursor;
+    fs->count_cursor = 0;
+}
+
+/** Erasing a sector behind the heads' back: whatever it held is unknown. */
+static void _count_forget(ringfs_t * const fs, int32_t sector)
+{
+    if (fs->count_table && fs->count_table[sector] != 0)
+    {
+        fs->count_valid = false;
+    }
+}
+
+/**
+ * @}
+ * @defgroup checkpoint
+ * @{
+ */
+
+#define CHECKPOINT_VALID   0x00000000 /**< Record has been written. */
+#define CHECKPOINT_MAX_LAG 2          /**< Sectors the write head may have moved past a checkpoint. */
+
+struct checkpoint_record
+{
+    uint32_t status;
+    uint32_t version;
+    struct ringfs_loc read;
+    struct ringfs_loc write;
+    uint32_t check;
+};
+
+static uint32_t _checkpoint_check(const struct checkpoint_record * const record)
+{
+    const uint32_t *word = (const uint32_t *)record;
+    uint32_t check = 0x52494E47;
+
+    for (size_t i = 0; i < offsetof(struct checkpoint_record, check) / sizeof(uint32_t); i++)
+    {
+        check = ((check << 5) | (check >> 27)) ^ word[i];
+    }
+
+    return check;
+}
+
+static ringfs_addr_t _checkpoint_address(ringfs_t * const fs, int32_t index)
+{
+    return (ringfs_addr_t)fs->checkpoint_sector * fs->flash->sector_size + index * (int32_t)sizeof(struct checkpoint_record);
+}
+
+/** Find the first unused record. Records are written in order, so bisect. */
+static int32_t _checkpoint_find_next(ringfs_t * const fs)
+{
+    int32_t lo = 0;
+    int32_t hi = fs->flash->sector_size / (int32_t)sizeof(struct checkpoint_record);
+
+    while (lo < hi)
+    {
+        const int32_t mid = lo + (hi - lo) / 2;
+        uint32_t status;
+
+        _flash_read(fs, _checkpoint_address(fs, mid), &status, sizeof(status));
+        if (status == SECTOR_ERASED)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    return lo;
+}
+
+/** Record the current head positions. Does nothing without a checkpoint sector. */
+static int32_t _checkpoint_write(ringfs_t * const fs)
+{
+    if (fs->checkpoint_sector < 0)
+    {
+        return 0;
+    }
+
+    /* Start over once the sector is full. */
+    if (fs->checkpoint_next >= fs->flash->sector_size / (int32_t)sizeof(struct checkpoint_record))
+    {
+        _flash_erase(fs, _checkpoint_address(fs, 0));
+        fs->checkpoint_next = 0;
+    }
+
+    struct checkpoint_record record = {
+        .status = CHECKPOINT_VALID,
+        .version = _sector_version(fs),
+        .read = fs->read,
+        .write = fs->write,
+    };
+    record.check = _checkpoint_check(&record);
+
+    _flash_program(fs, _checkpoint_address(fs, fs->checkpoint_next), &record, sizeof(record));
+    fs->checkpoint_next++;
+
+    return 0;
+}
+
+/**
+ * @}
+ * @defgroup loc
+ * @{
+ */
+
+static bool _loc_equal(struct ringfs_loc * const a, struct ringfs_loc * const b)
+{
+    return (a->sector == b->sector) && (a->slot == b->slot);
+}
+
+/** Advance a location to the beginning of the next sector. */
+static void _loc_advance_sector(ringfs_t * const fs, struct ringfs_loc * const loc)
+{
+    loc->slot = 0;
+    loc->sector++;
+    if (loc->sector >= fs->flash->sector_count)
+    {
+        loc->sector = 0;
+    }
+
+    return;
+}
+
+/** Move a location forward by a number of bytes (RINGFS_VARIABLE). */
+static void _loc_advance_bytes(ringfs_t * const fs, struct ringfs_loc * const loc, int32_t bytes)
+{
+    loc->slot += bytes;
+    if (loc->slot + VAR_RECORD_MIN > fs->slots_per_sector)
+    {
+        _loc_advance_sector(fs, loc);
+    }
+}
+
+/** Advance a location to the next slot, advancing the sector too if needed. */
+static void _loc_advance_slot(ringfs_t * const fs, struct ringfs_loc * const loc)
+{
+    if (fs->flags & RINGFS_VARIABLE)
+    {
+        uint32_t status;
+
+        /* An erased header ends the records of a sector. */
+        _slot_get_status(fs, loc, &status);
+        if (status == SLOT_ERASED)
+        {
+            _loc_advance_sector(fs, loc);
+        }
+        else
+        {
+            _loc_advance_bytes(fs, loc, _var_record_size(fs->var_length));
+        }
+
+        return;
+    }
+
+    loc->slot++;
+    if (loc->slot >= fs->slots_per_sector)
+    {
+        _loc_advance_sector(fs, loc);
+    }
+
+    return;
+}
+
+/**
+ * @}
+ * @defgroup cursor
+ * @{
+ */
+
+/** How far a location is past the read head. */
+static int32_t _loc_offset(ringfs_t * const fs, const struct ringfs_loc * const loc)
+{
+    return _sector_distance(fs, fs->read.sector, loc->sector) * fs->slots_per_sector +
+           loc->slot - fs->read.slot;
+}
+
+/** Move cursor objects out of a sector that's about to be erased. */
+static void _cursors_reclaim(ringfs_t * const fs, int32_t sector)
+{
+    for (struct ringfs_cursor *cursor = fs->cursors; cursor; cursor = cursor->next)
+    {
+        if (cursor->loc.sector == sector)
+        {
+            _loc_advance_sector(fs, &cursor->loc);
+        }
+        if (cursor->discarded.sector == sector)
+        {
+            _loc_advance_sector(fs, &cursor->discarded);
+        }
+    }
+}
+
+/** Pull cursor objects left behind by the read head moving up to a location. */
+static void _cursors_follow(ringfs_t * const fs, const struct ringfs_loc * const to)
+{
+    const int32_t offset = _loc_offset(fs, to);
+
+    for (struct ringfs_cursor *cursor = fs->cursors; cursor; cursor = cursor->next)
+    {
+        if (_loc_offset(fs, &cursor->loc) < offset)
+        {
+            cursor->loc = *to;
+        }
+        if (_loc_offset(fs, &cursor->discarded) < offset)
+        {
+            cursor->discarded = *to;
+        }
+    }
+}
+
+/** Start every cursor object over at the read head. */
+static void _cursors_reset(ringfs_t * const fs)
+{
+    for (struct ringfs_cursor *cursor = fs->cursors; cursor; cursor = cursor->next)
+    {
+        cursor->loc = fs->read;
+        cursor->discarded = fs->read;
+    }
+}
+
+/**
+ * @}
+ * @defgroup seq
+ * @{
+ */
+
+/** Sequence number of the write sector's first slot, numbered yet or not. */
+static uint32_t _seq_write_base(ringfs_t * const fs)
+{
+    const int32_t sectors = _sector_distance(fs, fs->seq_sector, fs->write.sector);
+
+    return fs->seq_base + (uint32_t)(sectors * fs->slots_per_sector);
+}
+
+/** Sequence number of the slot at a location in use. */
+static int32_t _seq_at(ringfs_t * const fs, const struct ringfs_loc * const loc, uint32_t * const seq)
+{
+    uint32_t base;
+
+    if (loc->sector == fs->write.sector)
+    {
+        base = _seq_write_base(fs);
+    }
+    else if (_sector_get_seq(fs, loc->sector, &base) != 0 || base == UINT32_MAX)
+    {
+        return -1;
+    }
+
+    *seq = base + (uint32_t)loc->slot;
+    return 0;
+}
+
+/**
+ * @}
+ * @defgroup key
+ * @{
+ *
+ * RINGFS_KEY_RANGE: the key range of the write sector is tracked in RAM as
+ * objects are appended, and programmed when the write head moves on. After
+ * ringfs_scan() the appends before the mount aren't known, so the range is
+ * rebuilt from the slots instead.
+ */
+
+/** Value of a key field in RAM. */
+static uint32_t _key_value(ringfs_t * const fs, const uint8_t * const field)
+{
+    if (fs->key_size == 1)
+    {
+        return *field;
+    }
+    if (fs->key_size == 2)
+    {
+        uint16_t key;
+        memcpy(&key, field, sizeof(key));
+        return key;
+    }
+
+    uint32_t key;
+    memcpy(&key, field, sizeof(key));
+    return key;
+}
+
+static void _key_add(ringfs_t * const fs, uint32_t key)
+{
+    if (key < fs->key_min)
+    {
+        fs->key_min = key;
+    }
+    if (key > fs->key_max)
+    {
+        fs->key_max = key;
+    }
+}
+
+/** Account for an object about to be written at the write head. */
+static void _key_note(ringfs_t * const fs, const void * const object)
+{
+    if (fs->key_size > 0)
+    {
+        _key_add(fs, _key_value(fs, (const uint8_t *)object + fs->key_offset));
+    }
+}
+
+/** Start tracking the range of a sector from scratch. */
+static void _key_reset(ringfs_t * const fs, int32_t sector, bool valid)
+{
+    fs->key_sector = sector;
+    fs->key_valid = valid;
+    fs->key_min = UINT32_MAX;
+    fs->key_max = 0;
+}
+
+/** Recompute the tracked range from the valid slots of its sector. */
+static void _key_rebuild(ringfs_t * const fs)
+{
+    uint8_t field[4];
+
+    _key_reset(fs, fs->key_sector, true);
+    for (struct ringfs_loc loc = { fs->key_sector, 0 }; loc.slot < fs->slots_per_sector; loc.slot++)
+    {
+        uint32_t status;
+
+        _slot_get_status(fs, &loc, &status);
+        if (status == SLOT_ERASED)
+        {
+            break;
+        }
+        if (status == SLOT_VALID)
+        {
+            _flash_read(fs, _slot_address(fs, &loc) + fs->slot_header_size + fs->key_offset,
+                    field, fs->key_size);
+            _key_add(fs, _key_value(fs, field));
+        }
+    }
+}
+
+/** Program the range of the sector the write head left, if it has one. */
+static void _key_summarize(ringfs_t * const fs)
+{
+    uint32_t status;
+    uint32_t keys[2];
+
+    if (fs->key_size > 0 && fs->key_sector != fs->write.sector &&
+        _sector_get_status(fs, fs->key_sector, &status) >= 0 && status == SECTOR_IN_USE &&
+        _sector_get_keys(fs, fs->key_sector, keys) == 0 && keys[0] == UINT32_MAX && keys[1] == UINT32_MAX)
+    {
+        if (!fs->key_valid)
+        {
+            _key_rebuild(fs);
+        }
+        keys[0] = fs->key_min;
+        keys[1] = fs->key_max;
+        _sector_set_keys(fs, fs->key_sector, keys);
+    }
+
+    _key_reset(fs, fs->write.sector, true);
+}
+
+/** Whether a sector other than the write sector may hold keys in [lo, hi]. */
+static bool _key_may_match(ringfs_t * const fs, int32_t sector, uint32_t lo, uint32_t hi)
+{
+    uint32_t keys[2];
+
+    if (_sector_get_keys(fs, sector, keys) != 0 || (keys[0] == UINT32_MAX && keys[1] == UINT32_MAX))
+    {
+        /* Not summarized: the sector the write head just left. */
+        return true;
+    }
+
+    return keys[0] <= hi && keys[1] >= lo;
+}
+
+/**
+ * @}
+ * @defgroup spsc
+ * @{
+ *
+ * RINGFS_SPSC: the producer owns the write head, the consumer owns the read
+ * head and the cursor. The producer publishes the write head after every
+ * commit, and counts the sectors it reclaims; the consumer catches up with
+ * the reclaims at its next step instead of having its heads moved under it.
+ *
+ * While it touches a sector, the consumer pins it. The producer publishes
+ * a reclaim before looking at the pin and the consumer pins before looking
+ * at the reclaims, so either the consumer steps out of the sector or the
+ * producer sees the pin. It then leaves the sector alone and fails the
+ * append; the next one tries the erase again, without a second reclaim.
+ */
+
+#if defined(RINGFS_ATOMIC_LOAD) && defined(RINGFS_ATOMIC_STORE)
+#define SPSC_LOAD(p)          RINGFS_ATOMIC_LOAD(p)
+#define SPSC_STORE(p, v)      RINGFS_ATOMIC_STORE((p), (v))
+#define SPSC_PUBLISH(p, v)    RINGFS_ATOMIC_STORE((p), (v))
+#define SPSC_ACQUIRE(p)       RINGFS_ATOMIC_LOAD(p)
+#elif defined(__GNUC__)
+#define SPSC_LOAD(p)          __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define SPSC_STORE(p, v)      __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define SPSC_PUBLISH(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define SPSC_ACQUIRE(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#else
+/* No atomics known for this compiler: RINGFS_SPSC is refused at init. */
+#define SPSC_UNAVAILABLE
+#define SPSC_LOAD(p)          (*(p))
+#define SPSC_STORE(p, v)      (*(p) = (v))
+#define SPSC_PUBLISH(p, v)    (*(p) = (v))
+#define SPSC_ACQUIRE(p)       (*(p))
+#endif
+
+/** Forget concurrent state: both sides must be idle. */
+static void _spsc_reset(ringfs_t * const fs)
+{
+    fs->spsc.write = fs->write.sector * fs->slots_per_sector + fs->write.slot;
+    fs->spsc.reclaims = 0;
+    fs->spsc.first = 0;
+    fs->spsc.pin = -1;
+    fs->spsc.deferred = -1;
+    fs->spsc.seen = 0;
+    fs->spsc.view = fs->write;
+}
+
+/** Producer: make everything committed so far visible to the consumer. */
+static void _spsc_publish(ringfs_t * const fs)
+{
+    if (fs->flags & RINGFS_SPSC)
+    {
+        SPSC_PUBLISH(&fs->spsc.write, fs->write.sector * fs->slots_per_sector + fs->write.slot);
+    }
+}
+
+/**
+ * Producer: take a sector back from under the consumer before erasing it.
+ *
+ * @returns Zero if it can be erased, -1 while the consumer is in it.
+ */
+static int32_t _spsc_reclaim(ringfs_t * const fs, int32_t sector)
+{
+    /* A reclaim is published once, however long its erase has to wait. */
+    if (fs->spsc.deferred != sector)
+    {
+        SPSC_STORE(&fs->spsc.first, _sector_after(fs, sector, 1));
+        SPSC_STORE(&fs->spsc.reclaims, fs->spsc.reclaims + 1);
+    }
+
+    if (SPSC_LOAD(&fs->spsc.pin) == sector)
+    {
+        fs->spsc.deferred = sector;
+        return -1;
+    }
+    fs->spsc.deferred = -1;
+
+    return 0;
+}
+
+/** Consumer: move a head out of any sector reclaimed since the last catch-up. */
+static void _spsc_drop(ringfs_t * const fs, struct ringfs_loc * const loc, int32_t first, uint32_t missed)
+{
+    const int32_t sector_count = fs->flash->sector_count;
+    const uint32_t behind = (uint32_t)_sector_distance(fs, loc->sector, first);
+
+    /* Reclaims are consecutive: the last ones freed the sectors before first. */
+    if (missed >= (uint32_t)sector_count || (behind >= 1 && behind <= missed))
+    {
+        loc->sector = first;
+        loc->slot = 0;
+    }
+}
+
+/** Consumer: catch up with the reclaims and the published write head. */
+static void _spsc_sync(ringfs_t * const fs)
+{
+    uint32_t reclaims;
+    int32_t first;
+
+    do
+    {
+        reclaims = SPSC_LOAD(&fs->spsc.reclaims);
+        first = SPSC_LOAD(&fs->spsc.first);
+    } while (reclaims != SPSC_LOAD(&fs->spsc.reclaims));
+
+    if (reclaims != fs->spsc.seen)
+    {
+        _spsc_drop(fs, &fs->read, first, reclaims - fs->spsc.seen);
+        _spsc_drop(fs, &fs->cursor, first, reclaims - fs->spsc.seen);
+        fs->spsc.seen = reclaims;
+    }
+
+    const int32_t write = SPSC_ACQUIRE(&fs->spsc.write);
+    fs->spsc.view.sector = write / fs->slots_per_sector;
+    fs->spsc.view.slot = write % fs->slots_per_sector;
+}
+
+/** Consumer: pin the sector of a head, following it if it had to move. */
+static void _spsc_pin(ringfs_t * const fs, struct ringfs_loc * const loc)
+{
+    if (!(fs->flags & RINGFS_SPSC))
+    {
+        return;
+    }
+
+    int32_t pinned;
+    do
+    {
+        pinned = loc->sector;
+        SPSC_STORE(&fs->spsc.pin, pinned);
+        _spsc_sync(fs);
+    } while (loc->sector != pinned);
+}
+
+/** Consumer: pin a head's sector again after the head moved. */
+static void _spsc_follow(ringfs_t * const fs, struct ringfs_loc * const loc)
+{
+    if ((fs->flags & RINGFS_SPSC) && loc->sector != fs->spsc.pin)
+    {
+        _spsc_pin(fs, loc);
+    }
+}
+
+static void _spsc_unpin(ringfs_t * const fs)
+{
+    if (fs->flags & RINGFS_SPSC)
+    {
+        SPSC_STORE(&fs->spsc.pin, -1);
+    }
+}
+
+/** The write head as the consumer may see it. */
+static struct ringfs_loc *_write_view(ringfs_t * const fs)
+{
+    return (fs->flags & RINGFS_SPSC) ? &fs->spsc.view : &fs->write;
+}
+
+/**
+ * @}
+ * @defgroup async
+ * @{
+ *
+ * Asynchronous appends and fetches: the flash transfers of the synchronous
+ * sequence, each started once the one before is complete.
+ */
+
+enum async_step
+{
+    ASYNC_IDLE = 0,
+    ASYNC_RESERVE,      /**< Append: slot header set RESERVED. */
+    ASYNC_PAYLOAD,      /**< Append: object written. */
+    ASYNC_COMMIT,       /**< Append: slot header set VALID. */
+    ASYNC_STATUS,       /**< Fetch: slot header read. */
+    ASYNC_OBJECT,       /**< Fetch: object read. */
+};
+
+/** Whether the flash can run transfers in the background. */
+static bool _async_dma(ringfs_t * const fs)
+{
+    return fs->flash->program_start && fs->flash->read_start && fs->flash->transfer_busy;
+}
+
+static bool _async_programs(ringfs_t * const fs)
+{
+    return fs->async.step <= ASYNC_COMMIT;
+}
+
+/** Start the next piece of the transfer: programs don't cross a page. */
+static void _async_chunk(ringfs_t * const fs)
+{
+    const int32_t page_size = fs->flash->page_size;
+    const ringfs_addr_t address = fs->async.address + fs->async.done;
+    uint8_t * const data    = fs->async.data + fs->async.done;
+    int32_t chunk           = fs->async.size - fs->async.done;
+    int32_t res;
+
+    if (_async_programs(fs) && page_size > 0 && chunk > page_size - _page_offset(fs, address))
+    {
+        chunk = page_size - _page_offset(fs, address);
+    }
+    fs->async.chunk = chunk;
+
+    _flash_suspend(fs);
+    fs->async.start = STATS_BEGIN(fs);
+    if (_async_dma(fs))
+    {
+        res = _async_programs(fs) ? fs->flash->program_start(fs->flash, address, data, chunk) :
+                                    fs->flash->read_start(fs->flash, address, data, chunk);
+    }
+    else
+    {
+        res = _async_programs(fs) ? fs->flash->program(fs->flash, address, data, chunk) :
+                                    fs->flash->read(fs->flash, address, data, chunk);
+    }
+    fs->async.failed = res < 0;
+}
+
+static void _async_transfer(ringfs_t * const fs, enum async_step step, ringfs_addr_t address, void *data, int32_t size)
+{
+    fs->async.step = step;
+    fs->async.address = address;
+    fs->async.data = data;
+    fs->async.size = size;
+    fs->async.done = 0;
+    _async_chunk(fs);
+}
+
+static void _async_finish(ringfs_t * const fs, int32_t result)
+{
+    fs->async.step = ASYNC_IDLE;
+    if (fs->async.callback)
+    {
+        fs->async.callback(fs, result, fs->async.context);
+    }
+}
+
+/** Read the state of the slot at the read cursor, or finish if there's none. */
+static void _async_fetch_next(ringfs_t * const fs)
+{
+    if (_loc_equal(&fs->cursor, &fs->write))
+    {
+        _async_finish(fs, -1);
+        return;
+    }
+
+    fs->async.slot = _slot_address(fs, &fs->cursor);
+    _async_transfer(fs, ASYNC_STATUS, fs->async.slot + (int32_t)offsetof(struct slot_header, status),
+            &fs->async.status, sizeof(fs->async.status));
+}
+
+/** Carry on after a complete transfer. */
+static void _async_step(ringfs_t * const fs)
+{
+    switch (fs->async.step)
+    {
+        case ASYNC_RESERVE:
+            _async_transfer(fs, ASYNC_PAYLOAD, fs->async.slot + fs->slot_header_size,
+                    fs->async.object, fs->object_size);
+            break;
+
+        case ASYNC_PAYLOAD:
+            fs->async.status = SLOT_VALID;
+            _async_transfer(fs, ASYNC_COMMIT, fs->async.slot,
+                    &fs->async.status, sizeof(fs->async.status));
+            break;
+
+        case ASYNC_COMMIT:
+            _slot_status_changed(fs, &fs->write, SLOT_VALID);
+            _loc_advance_slot(fs, &fs->write);
+            _async_finish(fs, 0);
+            break;
+
+        case ASYNC_STATUS:
+            if (fs->async.status == SLOT_VALID)
+            {
+                _async_transfer(fs, ASYNC_OBJECT, fs->async.slot + fs->slot_header_size,
+                        fs->async.object, fs->object_size);
+                break;
+            }
+            STATS_ADD(fs, fetch_skipped, fs->async.status != SLOT_ERASED);
+            _loc_advance_slot(fs, &fs->cursor);
+            _async_fetch_next(fs);
+            break;
+
+        case ASYNC_OBJECT:
+            _fetch_done(fs, &fs->cursor);
+            _async_finish(fs, 0);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/** Whether the layout allows asynchronous operations, and none is running. */
+static bool _async_ready(ringfs_t * const fs)
+{
+    return fs->async.step == ASYNC_IDLE &&
+           !(fs->flags & (RINGFS_SLOT_BITMAP | RINGFS_VARIABLE | RINGFS_SPSC));
+}
+
+/**
+ * @}
+ */
+
+/* And here we go. */
+
+int32_t ringfs_init(ringfs_t * const fs, struct ringfs_flash_partition * const flash, uint32_t version, int32_t object_size)
+{
+    return ringfs_init_ex(fs, flash, version, object_size, 0);
+}
+
+int32_t ringfs_init_ex(ringfs_t * const fs, struct ringfs_flash_partition * const flash, uint32_t version, int32_t object_size, uint32_t flags)
+{
+    /* Copy arguments to instance. */
+    fs->flash = flash;
+    fs->version = version;
+    fs->object_size = object_size;
+    fs->flags = flags;
+
+    /* The consumer side reads slot states without caching them. */
+    if ((flags & RINGFS_SPSC) && (flags & (RINGFS_SLOT_BITMAP | RINGFS_VARIABLE)))
+    {
+        return -1;
+    }
+
+#ifdef SPSC_UNAVAILABLE
+    if (flags & RINGFS_SPSC)
+    {
+        return -1;
+    }
+#endif
+
+    /* Sequence numbers are counted in slots, and kept by the producer. */
+    if ((flags & RINGFS_SEQUENCE) && (flags & (RINGFS_VARIABLE | RINGFS_SPSC)))
+    {
+        return -1;
+    }
+
+    /* Key ranges are tracked per slot write, by the producer. */
+    if ((flags & RINGFS_KEY_RANGE) && (flags & (RINGFS_VARIABLE | RINGFS_SPSC)))
+    {
+        return -1;
+    }
+
+    /* About sqrt(sector_count) sectors per group, and at least two groups. */
+    fs->group_size = 1;
+    while ((int64_t)fs->group_size * fs->group_size < fs->flash->sector_count)
+    {
+        fs->group_size++;
+    }
+    if ((flags & RINGFS_SECTOR_GROUPS) &&
+        ((flags & RINGFS_SPSC) || fs->flash->sector_count <= fs->group_size))
+    {
+        return -1;
+    }
+
+    /* Precalculate commonly used values. */
+    const int32_t room = fs->flash->sector_size - _sector_trailer_size(fs);
+    if (flags & RINGFS_VARIABLE)
+    {
+        /* Locations are byte offsets; object_size is the largest record. */
+        if ((flags & (RINGFS_SLOT_BITMAP | RINGFS_PAGE_ALIGN)) || object_size < 1 || object_size > 0xFFFF ||
+            _var_record_size(object_size) > room)
+        {
+            return -1;
+        }
+        fs->slot_header_size = (int32_t)sizeof(struct var_header);
+        fs->slots_per_sector = room;
+    }
+    else if (flags & RINGFS_SLOT_BITMAP)
+    {
+        if (flags & RINGFS_PAGE_ALIGN)
+        {
+            return -1;
+        }
+
+        /* Fit as many slots as possible next to their bitmap. */
+        fs->slot_header_size = 0;
+        fs->slots_per_sector = room * 8 / (fs->object_size * 8 + 2);
+        while (fs->slots_per_sector * fs->object_size + _slot_bitmap_size(fs->slots_per_sector) > room)
+        {
+            fs->slots_per_sector--;
+        }
+    }
+    else if (flags & RINGFS_PAGE_ALIGN)
+    {
+        /* Keep slots off page boundaries; a slot bigger than a page starts
+         * on its own page. The last page shares its room with the header. */
+        const int32_t page_size = fs->flash->page_size;
+        const int32_t slot_size = (int32_t)sizeof(struct slot_header) + fs->object_size;
+        if (page_size <= 0 || fs->flash->sector_size % page_size)
+        {
+            return -1;
+        }
+        fs->slot_header_size = (int32_t)sizeof(struct slot_header);
+        fs->page_slots  = slot_size <= page_size ? page_size / slot_size : 1;
+        fs->page_stride = (slot_size + page_size - 1) / page_size * page_size;
+
+        const int32_t groups = room / fs->page_stride;
+        const int32_t rest   = (room - groups * fs->page_stride) / slot_size;
+        fs->slots_per_sector = groups * fs->page_slots + (rest < fs->page_slots ? rest : fs->page_slots);
+    }
+    else
+    {
+        fs->slot_header_size = (int32_t)sizeof(struct slot_header);
+        fs->slots_per_sector = room / (fs->slot_header_size + fs->object_size);
+    }
+    fs->bitmap_sector = -1;
+    fs->var_loc.sector = -1;
+    fs->var_loc.slot = 0;
+
+    fs->sector_table = NULL;
+
+    fs->wbuf = NULL;
+    fs->wbuf_size = 0;
+    fs->wbuf_count = 0;
+    fs->wbuf_timeout = 0;
+    fs->wbuf_age = 0;
+    fs->cache = NULL;
+    fs->cache_filling_level = 0;
+
+    fs->count_table = NULL;
+    fs->count_total = 0;
+    fs->count_cursor = 0;
+    fs->count_valid = false;
+
+    fs->readahead = NULL;
+    fs->readahead_size = 0;
+    fs->readahead_count = 0;
+
+    fs->checkpoint_sector = -1;
+    fs->checkpoint_next = 0;
+
+    fs->erase_ahead = 1;
+    fs->erase_callback = NULL;
+
+    fs->erase.sector = -1;
+    fs->erase.suspended = false;
+
+#ifdef RINGFS_STATS
+    fs->stats = NULL;
+    fs->stats_call = RINGFS_CALL_OTHER;
+    fs->stats_appending = false;
+#endif
+
+    fs->read.sector = fs->write.sector = fs->cursor.sector = 0;
+    fs->read.slot = fs->write.slot = fs->cursor.slot = 0;
+    fs->cursors = NULL;
+    fs->seq_sector = 0;
+    fs->seq_base = 0;
+    fs->key_offset = 0;
+    fs->key_size = 0;
+    _key_reset(fs, 0, true);
+    fs->async.step = ASYNC_IDLE;
+    _spsc_reset(fs);
+
+    return 0;
+}
+
+int32_t ringfs_set_sector_table(ringfs_t * const fs, uint32_t * const table, int32_t entries)
+{
+    if (table && (entries < fs->flash->sector_count || (fs->flags & RINGFS_SPSC)))
+    {
+        return -1;
+    }
+
+    fs->sector_table = table;
+
+    return 0;
+}
+
+int32_t ringfs_set_write_buffer(ringfs_t * const fs, void * const buffer, int32_t size, uint32_t flush_timeout)
+{
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
+
+    STATS_CALL(fs, OTHER);
+
+    /* Only the header layout commits a slot in the same program as its data. */
+    if (buffer && ((fs->flags & (RINGFS_VARIABLE | RINGFS_SLOT_BITMAP)) ||
+                   size < slot_size || size < fs->flash->page_size))
+    {
+        return -1;
+    }
+
+    if (_wbuf_flush(fs) != 0)
+    {
+        return -1;
+    }
+
+    fs->wbuf = buffer;
+    fs->wbuf_size = size;
+    fs->wbuf_timeout = flush_timeout;
+    fs->cache = NULL;
+    fs->cache_filling_level = 0;
+
+    return 0;
+}
+
+int32_t ringfs_set_count_table(ringfs_t * const fs, int32_t * const table, int32_t entries)
+{
+    if (table && (entries < fs->flash->sector_count || (fs->flags & RINGFS_SPSC)))
+    {
+        return -1;
+    }
+
+    fs->count_table = table;
+    _count_reset(fs, false);
+
+    return 0;
+}
+
+int32_t ringfs_set_read_buffer(ringfs_t * const fs, void * const buffer, int32_t size)
+{
+    /* Variable-size records are only buffered for ringfs_peek(), without headers. */
+    const int32_t minimum = (fs->flags & RINGFS_VARIABLE) ? fs->object_size :
+                            fs->slot_header_size + fs->object_size;
+    if (buffer && (size < minimum || (fs->flags & RINGFS_SPSC)))
+    {
+        return -1;
+    }
+
+    fs->readahead = buffer;
+    fs->readahead_size = size;
+    fs->readahead_count = 0;
+
+    return 0;
+}
+
+#ifdef RINGFS_STATS
+int32_t ringfs_set_stats(ringfs_t * const fs, struct ringfs_stats * const stats)
+{
+    /* Both sides would bump the same counters. */
+    if (stats && (fs->flags & RINGFS_SPSC))
+    {
+        return -1;
+    }
+
+    fs->stats = stats;
+
+    return 0;
+}
+#endif
+
+int32_t ringfs_set_checkpoint(ringfs_t * const fs, int32_t sector)
+{
+    STATS_CALL(fs, OTHER);
+
+    if (sector >= fs->flash->sector_offset &&
+        sector < fs->flash->sector_offset + fs->flash->sector_count)
+    {
+        return -1;
+    }
+    if (fs->flash->sector_size < (int32_t)sizeof(struct checkpoint_record))
+    {
+        return -1;
+    }
+    if (sector >= 0 && (fs->flags & RINGFS_SPSC))
+    {
+        return -1;
+    }
+
+    fs->checkpoint_sector = sector < 0 ? -1 : sector;
+    fs->checkpoint_next = 0;
+
+    return 0;
+}
+
+int32_t ringfs_set_erase_ahead(ringfs_t * const fs, int32_t sectors, tErase_Sector_callback callback)
+{
+    if (sectors < 1 || sectors >= fs->flash->sector_count)
+    {
+        return -1;
+    }
+    /* The producer only ever reclaims the sector right after its own. */
+    if ((sectors > 1 || callback) && (fs->flags & RINGFS_SPSC))
+    {
+        return -1;
+    }
+
+    fs->erase_ahead = sectors;
+    fs->erase_callback = callback;
+
+    return 0;
+}
+
+int32_t ringfs_set_key(ringfs_t * const fs, int32_t offset, int32_t size)
+{
+    if (!(fs->flags & RINGFS_KEY_RANGE) || (size != 1 && size != 2 && size != 4) ||
+        offset < 0 || offset > fs->object_size - size)
+    {
+        return -1;
+    }
+
+    fs->key_offset = offset;
+    fs->key_size = size;
+
+    return 0;
+}
+
+int32_t ringfs_format(ringfs_t * const fs)
+{
+    STATS_CALL(fs, FORMAT);
+
+    fs->wbuf_count = 0;
+    _erase_wait(fs);
+    _readahead_invalidate(fs, -1);
+    _count_reset(fs, false);
+
+    /* A stale checkpoint must not outlive a partially formatted partition. */
+    if (fs->checkpoint_sector >= 0)
+    {
+        _flash_erase(fs, _checkpoint_address(fs, 0));
+        fs->checkpoint_next = 0;
+    }
+
+    /* Mark all sectors to prevent half-erased filesystems. */
+    for (int32_t sector = 0; sector < fs->flash->sector_count; sector++)
+    {
+        _sector_set_status(fs, sector, SECTOR_FORMATTING);
+    }
+
+    /* Erase, update version, mark as free. */
+    for (int32_t sector = 0; sector < fs->flash->sector_count; sector++)
+    {
+        _sector_free(fs, sector);
+    }
+
+    /* Start reading & writing at the first sector. */
+    fs->read.sector = 0;
+    fs->read.slot = 0;
+    fs->write.sector = 0;
+    fs->write.slot = 0;
+    fs->cursor.sector = 0;
+    fs->cursor.slot = 0;
+    _count_reset(fs, true);
+    _cursors_reset(fs);
+    _spsc_reset(fs);
+    fs->seq_sector = 0;
+    fs->seq_base = 0;
+    _key_reset(fs, 0, true);
+
+    _checkpoint_write(fs);
+
+    return 0;
+}
+
+/**
+ * Find the first ERASED slot of a sector. Slots are used strictly in order,
+ * so bisection finds it in O(log slots_per_sector) reads.
+ *
+ * @returns Slot index, or slots_per_sector if the sector is full.
+ */
+static int32_t _scan_first_erased_slot(ringfs_t * const fs, int32_t sector)
+{
+    int32_t lo = 0;
+    int32_t hi = fs->slots_per_sector;
+
+    while (lo < hi)
+    {
+        struct ringfs_loc loc = { sector, lo + (hi - lo) / 2 };
+        uint32_t status;
+
+        _slot_get_status(fs, &loc, &status);
+        if (status == SLOT_ERASED)
+        {
+            hi = loc.slot;
+        }
+        else
+        {
+            lo = loc.slot + 1;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * Skip the discarded prefix of a sector, starting at the given slot.
+ *
+ * Discards always proceed from the read head, so within a sector every
+ * GARBAGE slot comes before every VALID one (RESERVED slots may appear
+ * anywhere). A GARBAGE last slot thus means the sector holds no data, and
+ * otherwise bisecting for the first non-GARBAGE slot never skips valid data.
+ *
+ * @returns True if the location was moved to the next sector.
+ */
+static bool _scan_skip_garbage(ringfs_t * const fs, struct ringfs_loc * const loc)
+{
+    const int32_t sector = loc->sector;
+    int32_t lo = loc->slot;
+    int32_t hi = (sector == fs->write.sector) ? fs->write.slot : fs->slots_per_sector;
+    uint32_t status;
+
+    if (hi == fs->slots_per_sector)
+    {
+        struct ringfs_loc last = { sector, hi - 1 };
+        _slot_get_status(fs, &last, &status);
+        if (status == SLOT_GARBAGE)
+        {
+            STATS_ADD(fs, scan_skipped, hi - lo);
+            _loc_advance_sector(fs, loc);
+            return true;
+        }
+    }
+
+    while (lo < hi)
+    {
+        struct ringfs_loc mid = { sector, lo + (hi - lo) / 2 };
+
+        _slot_get_status(fs, &mid, &status);
+        if (status == SLOT_GARBAGE)
+        {
+            lo = mid.slot + 1;
+        }
+        else
+        {
+            hi = mid.slot;
+        }
+    }
+
+    STATS_ADD(fs, scan_skipped, lo - loc->slot);
+    loc->slot = lo;
+    if (loc->slot >= fs->slots_per_sector)
+    {
+        _loc_advance_sector(fs, loc);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * RINGFS_SLOT_BITMAP: a power loss between programming a payload and
+ * committing it leaves an ERASED slot that can't be programmed again. Mark
+ * such slots RESERVED so the write head moves past them.
+ */
+static void _scan_recover_write(ringfs_t * const fs)
+{
+    const int32_t sector = fs->write.sector;
+    int32_t dirty = -1;
+    uint32_t status;
+
+    /* Nothing is written to a sector before it's marked IN_USE. */
+    _sector_get_status(fs, sector, &status);
+    if (status != SECTOR_IN_USE)
+    {
+        return;
+    }
+
+    for (int32_t slot = fs->write.slot; slot < fs->slots_per_sector; slot++)
+    {
+        struct ringfs_loc loc = { sector, slot };
+        const ringfs_addr_t slot_addr = _slot_address(fs, &loc);
+        uint8_t buf[16];
+
+        for (int32_t offs = 0; offs < fs->object_size && dirty < slot; offs += (int32_t)sizeof(buf))
+        {
+            int32_t size = fs->object_size - offs;
+            if (size > (int32_t)sizeof(buf))
+            {
+                size = (int32_t)sizeof(buf);
+            }
+
+            _flash_read(fs, slot_addr + offs, buf, size);
+            for (int32_t i = 0; i < size; i++)
+            {
+                if (buf[i] != 0xFF)
+                {
+                    dirty = slot;
+                    break;
+                }
+            }
+        }
+    }
+
+    /* Stop at the end of the sector: a dirty last slot moves the write head on. */
+    while (fs->write.sector == sector && fs->write.slot <= dirty)
+    {
+        _slot_set_bits(fs, &fs->write, SLOT_BITS_RESERVED);
+        _loc_advance_slot(fs, &fs->write);
+    }
+}
+
+/**
+ * Position the heads once the write sector is known. The read head is moved
+ * forward from the given location to the first VALID slot.
+ */
+static void _scan_heads(ringfs_t * const fs, int32_t write_sector, const struct ringfs_loc * const read)
+{
+    /* Variable-size records can't be bisected. */
+    const bool linear = (fs->flags & (RINGFS_LINEAR_SCAN | RINGFS_VARIABLE)) != 0;
+
+    /* Scan the write sector and skip all occupied slots at the beginning. */
+    fs->write.sector = write_sector;
+    fs->write.slot = 0;
+    if (linear)
+    {
+        while (fs->write.sector == write_sector)
+        {
+            uint32_t status;
+            _slot_get_status(fs, &fs->write, &status);
+            if (status == SLOT_ERASED)
+            {
+                break;
+            }
+
+            _loc_advance_slot(fs, &fs->write);
+        }
+    }
+    else
+    {
+        fs->write.slot = _scan_first_erased_slot(fs, write_sector);
+        if (fs->write.slot >= fs->slots_per_sector)
+        {
+            _loc_advance_sector(fs, &fs->write);
+        }
+    }
+    if (fs->slot_header_size == 0)
+    {
+        _scan_recover_write(fs);
+    }
+    /* If the sector was full, we're at the beginning of a FREE sector now. */
+
+    /* Position the read head at the given location, then skip
+     * over garbage/invalid slots until something of value is found or we reach
+     * the write head which means there's no data. */
+    fs->read = *read;
+    bool enter = true;
+    bool skip = !linear;
+    while (!_loc_equal(&fs->read, &fs->write))
+    {
+        uint32_t status;
+
+        /* Consumed sectors are skipped without looking at their slots. */
+        if (enter)
+        {
+            enter = false;
+            _sector_get_status(fs, fs->read.sector, &status);
+            if (status == SECTOR_CONSUMED)
+            {
+                _loc_advance_sector(fs, &fs->read);
+                enter = true;
+                skip = !linear;
+                continue;
+            }
+        }
+
+        if (skip)
+        {
+            skip = false;
+            if (_scan_skip_garbage(fs, &fs->read))
+            {
+                enter = true;
+                skip = true;
+                continue;
+            }
+            if (_loc_equal(&fs->read, &fs->write))
+            {
+                break;
+            }
+        }
+
+        _slot_get_status(fs, &fs->read, &status);
+        if (status == SLOT_VALID)
+        {
+            break;
+        }
+
+        STATS_ADD(fs, scan_skipped, status != SLOT_ERASED);
+        _loc_advance_slot(fs, &fs->read);
+        enter = fs->read.slot == 0;
+        skip = !linear && enter;
+    }
+}
+
+/** Read a sector header, keeping the sector table (if any) up to date. */
+static void _scan_read_header(ringfs_t * const fs, int32_t sector, struct sector_header * const header)
+{
+    const int32_t sector_size = fs->flash->sector_size;
+    const int32_t offs        = sector_size - (int32_t)sizeof(struct sector_header);
+
+    _flash_read(fs, _sector_address(fs, sector) + offs, header, sizeof(*header));
+
+    /* Detect and fix partially erased sectors. */
+    if (header->status == SECTOR_ERASING || header->status == SECTOR_ERASED)
+    {
+        _sector_free(fs, sector);
+        header->status = SECTOR_FREE;
+        header->version = _sector_version(fs);
+    }
+
+    if (fs->sector_table)
+    {
+        fs->sector_table[sector] = header->status;
+    }
+}
+
+/**
+ * Read a sector header and check that it belongs to a mounted partition:
+ * FREE or IN_USE, of our version. Consumed sectors are still part of the
+ * ring (_scan_heads() skips them), so they come out as IN_USE.
+ *
+ * @returns Zero on success, -1 if the partition can't be mounted.
+ */
+static int32_t _scan_sector_status(ringfs_t * const fs, int32_t sector, uint32_t * const status)
+{
+    struct sector_header header;
+    _scan_read_header(fs, sector, &header);
+
+    if (header.status == SECTOR_CONSUMED)
+    {
+        header.status = SECTOR_IN_USE;
+    }
+
+    /* Detect partially-formatted partitions. */
+    if (header.status == SECTOR_FORMATTING)
+    {
+        //printf("ringfs_scan: partially formatted partition\r\n");
+        return -1;
+    }
+
+    /* Detect corrupted sectors. */
+    if (header.status != SECTOR_FREE && header.status != SECTOR_IN_USE)
+    {
+        //printf("ringfs_scan: corrupted sector %d\r\n", sector);
+        return -1;
+    }
+
+    /* Detect obsolete versions. We can't do this earlier because the version
+     * could have been invalid due to a partial erase. */
+    if (header.version != _sector_version(fs))
+    {
+        //printf("ringfs_scan: incompatible version 0x%08"PRIx32"\r\n", header.version);
+        return -1;
+    }
+
+    *status = header.status;
+    return 0;
+}
+
+/** Forget the sector table, for scans that don't read every sector. */
+static void _scan_forget_table(ringfs_t * const fs)
+{
+    if (fs->sector_table)
+    {
+        for (int32_t sector = 0; sector < fs->flash->sector_count; sector++)
+        {
+            fs->sector_table[sector] = SECTOR_UNKNOWN;
+        }
+    }
+}
+
+/**
+ * Mount from the last checkpoint record, reading only the sectors around
+ * the recorded heads. The write head may have entered up to
+ * CHECKPOINT_MAX_LAG sectors past the record (a power loss before the next
+ * record was written); sectors it reclaimed on the way push the read head
+ * forward, like ringfs_append() did.
+ *
+ * @returns Zero on success, -1 if the checkpoint can't be trusted.
+ */
+static int32_t _scan_checkpoint(ringfs_t * const fs)
+{
+    const int32_t sector_count = fs->flash->sector_count;
+    struct checkpoint_record record;
+    struct sector_header header;
+
+    if (fs->checkpoint_next == 0)
+    {
+        return -1;
+    }
+
+    _flash_read(fs, _checkpoint_address(fs, fs->checkpoint_next - 1), &record, sizeof(record));
+    if (record.status != CHECKPOINT_VALID ||
+        record.check != _checkpoint_check(&record) ||
+        record.version != _sector_version(fs) ||
+        record.write.sector < 0 || record.write.sector >= sector_count ||
+        record.read.sector < 0 || record.read.sector >= sector_count ||
+        record.read.slot < 0 || record.read.slot >= fs->slots_per_sector)
+    {
+        return -1;
+    }
+
+    /* Nothing is known about the sectors we don't look at. */
+    _scan_forget_table(fs);
+
+    int32_t write_sector = record.write.sector;
+    _scan_read_header(fs, write_sector, &header);
+    if (header.version != _sector_version(fs))
+    {
+        return -1;
+    }
+
+    int32_t lag = 0;
+    if (header.status == SECTOR_IN_USE || header.status == SECTOR_CONSUMED)
+    {
+        /* Follow the write head to the last IN_USE sector before a FREE one. */
+        for (;;)
+        {
+            const int32_t next_sector = (write_sector + 1) % sector_count;
+
+            _scan_read_header(fs, next_sector, &header);
+            if (header.version != _sector_version(fs))
+            {
+                return -1;
+            }
+            if (header.status == SECTOR_FREE)
+            {
+                break;
+            }
+            if ((header.status != SECTOR_IN_USE && header.status != SECTOR_CONSUMED) ||
+                lag == CHECKPOINT_MAX_LAG)
+            {
+                return -1;
+            }
+
+            write_sector = next_sector;
+            lag++;
+        }
+    }
+    else if (header.status != SECTOR_FREE || record.write.slot != 0)
+    {
+        /* A FREE write sector is only recorded before its first append. */
+        return -1;
+    }
+
+    /* Sectors reclaimed since the record was written took the read head with them. */
+    struct ringfs_loc read = record.read;
+    for (int32_t step = 1; step <= lag + fs->erase_ahead && lag > 0; step++)
+    {
+        if (read.sector == (record.write.sector + step) % sector_count)
+        {
+            read.sector = (write_sector + fs->erase_ahead + 1) % sector_count;
+            read.slot = 0;
+            break;
+        }
+    }
+
+    if (read.sector != write_sector)
+    {
+        _scan_read_header(fs, read.sector, &header);
+        if ((header.status != SECTOR_IN_USE && header.status != SECTOR_CONSUMED) ||
+            header.version != _sector_version(fs))
+        {
+            return -1;
+        }
+    }
+
+    _scan_heads(fs, write_sector, &read);
+
+    return 0;
+}
+
+/**
+ * RINGFS_SECTOR_GROUPS: find the heads from the group states. The write head
+ * is in the one group still filling (the later one if a power loss left two
+ * filling), the first FREE sector after it starts the FREE run, and the read
+ * head is the first IN_USE sector after that. A FREE group followed by a
+ * FREE group's first sector is FREE throughout, so the run is followed a
+ * group at a time.
+ *
+ * @returns Zero on success, -1 if the groups don't tell (the caller then
+ *          reads every sector).
+ */
+static int32_t _scan_groups(ringfs_t * const fs, int32_t * const write_sector, int32_t * const read_sector)
+{
+    const int32_t sector_count = fs->flash->sector_count;
+    int32_t filling[2];
+    int32_t fillings = 0;
+    bool used_seen = false;
+    uint32_t status;
+
+    /* Nothing is known about the sectors we don't look at. */
+    _scan_forget_table(fs);
+
+    for (int32_t leader = 0; leader < sector_count; leader += fs->group_size)
+    {
+        if (_scan_sector_status(fs, leader, &status) != 0)
+        {
+            return -1;
+        }
+        if (status != SECTOR_IN_USE)
+        {
+            continue;
+        }
+
+        used_seen = true;
+        _group_get_status(fs, leader, &status);
+        if (status == GROUP_FILLING)
+        {
+            if (fillings == 2)
+            {
+                return -1;
+            }
+            filling[fillings++] = leader;
+        }
+    }
+
+    /* Nothing in use: the write head's group would be, unless the erase-ahead
+     * pool reaches back into it. */
+    if (!used_seen && fs->erase_ahead <= sector_count - fs->group_size)
+    {
+        *write_sector = 0;
+        *read_sector = 0;
+        return 0;
+    }
+
+    int32_t group = fillings == 1 ? filling[0] : -1;
+    int32_t stale = -1;
+    if (fillings == 2)
+    {
+        const bool second = _group_next(fs, filling[0]) == filling[1];
+        const bool first = _group_next(fs, filling[1]) == filling[0];
+
+        if (second == first)
+        {
+            return -1;
+        }
+        group = second ? filling[1] : filling[0];
+        stale = second ? filling[0] : filling[1];
+    }
+    if (group < 0)
+    {
+        return -1;
+    }
+
+    /* The FREE run starts in the group or at the first sector of the next. */
+    const int32_t span = _sector_distance(fs, group, _group_next(fs, group));
+    int32_t sector = group;
+    do
+    {
+        sector = _sector_after(fs, sector, 1);
+        if (_scan_sector_status(fs, sector, &status) != 0)
+        {
+            return -1;
+        }
+    }
+    while (status == SECTOR_IN_USE && _sector_distance(fs, group, sector) < span);
+    if (status != SECTOR_FREE)
+    {
+        return -1;
+    }
+    *write_sector = _sector_after(fs, sector, sector_count - 1);
+
+    /* Follow the FREE run; it ends at the latest at the write head's group. */
+    while (status == SECTOR_FREE)
+    {
+        if (sector % fs->group_size == 0)
+        {
+            const int32_t leader = _group_next(fs, sector);
+
+            if (_scan_sector_status(fs, leader, &status) != 0)
+            {
+                return -1;
+            }
+            if (status == SECTOR_FREE)
+            {
+                sector = leader;
+                continue;
+            }
+        }
+
+        sector = _sector_after(fs, sector, 1);
+        if (_scan_sector_status(fs, sector, &status) != 0)
+        {
+            return -1;
+        }
+    }
+    *read_sector = sector;
+
+    if (stale >= 0)
+    {
+        _group_close(fs, stale);
+    }
+
+    return 0;
+}
+
+/** After a full scan, leave the write head's group the only one filling. */
+static void _scan_close_groups(ringfs_t * const fs)
+{
+    for (int32_t leader = 0; leader < fs->flash->sector_count; leader += fs->group_size)
+    {
+        if (leader != fs->write.sector - fs->write.sector % fs->group_size)
+        {
+            _group_close(fs, leader);
+        }
+    }
+}
+
+/** Settle everything that follows from the recovered heads. */
+static void _scan_done(ringfs_t * const fs)
+{
+    /* Move the read cursors to the read head position. */
+    fs->cursor = fs->read;
+    _cursors_reset(fs);
+    _spsc_reset(fs);
+
+    /* A write sector not numbered yet comes right after a full one. */
+    if (fs->flags & RINGFS_SEQUENCE)
+    {
+        uint32_t base = UINT32_MAX;
+
+        fs->seq_sector = fs->write.sector;
+        _sector_get_seq(fs, fs->seq_sector, &base);
+        if (base == UINT32_MAX)
+        {
+            fs->seq_sector = _sector_after(fs, fs->write.sector, fs->flash->sector_count - 1);
+            _sector_get_seq(fs, fs->seq_sector, &base);
+        }
+
+        /* Nothing numbered at all: a freshly formatted partition. */
+        if (base == UINT32_MAX)
+        {
+            fs->seq_sector = fs->write.sector;
+            base = 0;
+        }
+        fs->seq_base = base;
+    }
+
+    /* The range of the last sector written to is rebuilt when it's left. */
+    if (fs->flags & RINGFS_KEY_RANGE)
+    {
+        uint32_t status;
+
+        _sector_get_status(fs, fs->write.sector, &status);
+        _key_reset(fs, status == SECTOR_IN_USE ? fs->write.sector :
+                   _sector_after(fs, fs->write.sector, fs->flash->sector_count - 1), false);
+    }
+}
+
+int32_t ringfs_scan(ringfs_t * const fs)
+{
+    STATS_CALL(fs, SCAN);
+
+    _wbuf_flush(fs);
+    _erase_wait(fs);
+    _readahead_invalidate(fs, -1);
+    fs->bitmap_sector = -1;
+    fs->var_loc.sector = -1;
+    _count_reset(fs, false);
+
+    if (fs->checkpoint_sector >= 0)
+    {
+        fs->checkpoint_next = _checkpoint_find_next(fs);
+
+        if (!(fs->flags & RINGFS_LINEAR_SCAN) && _scan_checkpoint(fs) == 0)
+        {
+            _scan_done(fs);
+            return 0;
+        }
+    }
+
+    if ((fs->flags & RINGFS_SECTOR_GROUPS) && !(fs->flags & RINGFS_LINEAR_SCAN))
+    {
+        int32_t write_sector, read_sector;
+
+        if (_scan_groups(fs, &write_sector, &read_sector) == 0)
+        {
+            struct ringfs_loc read = { read_sector, 0 };
+            _scan_heads(fs, write_sector, &read);
+            _scan_done(fs);
+            _checkpoint_write(fs);
+            return 0;
+        }
+    }
+
+    uint32_t previous_sector_status = SECTOR_FREE;
+    /* The read sector is the first IN_USE sector *after* a FREE sector
+     * (or the first one). */
+    int32_t read_sector = 0;
+    /* The write sector is the last IN_USE sector *before* a FREE sector
+     * (or the last one). */
+    int32_t write_sector = fs->flash->sector_count - 1;
+    /* There must be at least one FREE sector available at all times. */
+    bool free_seen = false;
+    /* If there's no IN_USE sector, we start at the first one. */
+    bool used_seen = false;
+
+    /* Iterate over sectors. */
+    for (int32_t sector = 0; sector < fs->flash->sector_count; sector++)
+    {
+        /* Read sector header, fixing partially erased sectors. */
+        uint32_t status;
+        if (_scan_sector_status(fs, sector, &status) != 0)
+        {
+            return -1;
+        }
+
+        /* Record the presence of a FREE sector. */
+        if (status == SECTOR_FREE)
+        {
+            free_seen = true;
+        }
+
+        /* Record the presence of a IN_USE sector. */
+        if (status == SECTOR_IN_USE)
+        {
+            used_seen = true;
+        }
+
+        /* Update read & write sectors according to the above rules. */
+        if (status == SECTOR_IN_USE && previous_sector_status == SECTOR_FREE)
+        {
+            read_sector = sector;
+        }
+
+        if (status == SECTOR_FREE && previous_sector_status == SECTOR_IN_USE)
+        {
+            write_sector = sector-1;
+        }
+
+        previous_sector_status = status;
+    }
+
+    /* Detect the lack of a FREE sector. */
+    if ( !free_seen )
+    {
+        //printf("ringfs_scan: invariant violated: no FREE sector found\r\n");
+        return -1;
+    }
+
+    /* Start writing at the first sector if the file system is empty. */
+    if ( !used_seen )
+    {
+        write_sector = 0;
+    }
+
+    struct ringfs_loc read = { read_sector, 0 };
+    _scan_heads(fs, write_sector, &read);
+
+    if (fs->flags & RINGFS_SECTOR_GROUPS)
+    {
+        _scan_close_groups(fs);
+    }
+    _scan_done(fs);
+
+    /* Spare the next mount a full scan. */
+    _checkpoint_write(fs);
+
+    return 0;
+}
+
+int32_t ringfs_capacity(ringfs_t * const fs)
+{
+    return fs->slots_per_sector * (fs->flash->sector_count - fs->erase_ahead);
+}
+
+int32_t ringfs_count_estimate(ringfs_t * const fs)
+{
+    if (fs->flags & RINGFS_SPSC)
+    {
+        _spsc_sync(fs);
+    }
+
+    const struct ringfs_loc * const write = _write_view(fs);
+    const int32_t sector_diff = _sector_distance(fs, fs->read.sector, write->sector);
+
+    return sector_diff * fs->slots_per_sector + write->slot - fs->read.slot;
+}
+
+int32_t ringfs_count_exact(ringfs_t * const fs)
+{
+    STATS_CALL(fs, OTHER);
+
+    if (fs->count_table)
+    {
+        if (!fs->count_valid)
+        {
+            _count_rebuild(fs);
+        }
+
+        return fs->count_total;
+    }
+
+    int32_t count = 0;
+
+    /* Use a temporary loc for iteration. */
+    struct ringfs_loc loc = fs->read;
+    while (!_loc_equal(&loc, &fs->write))
+    {
+        uint32_t status;
+        _slot_get_status(fs, &loc, &status);
+        
+        if (status == SLOT_VALID)
+        {
+            count++;
+        }
+
+        _loc_advance_slot(fs, &loc);
+    }
+
+    return count;
+}
+
+/**
+ * Hand the sector furthest ahead of the write head over to the erase-ahead
+ * pool: move the heads out, mark it ERASING and notify the erase callback.
+ * The erase itself happens in ringfs_service(), ringfs_erase_sector() or,
+ * if the write head gets there first, inline in _append_prepare().
+ */
+static void _pool_reclaim(ringfs_t * const fs)
+{
+    uint32_t status;
+    const int32_t sector = _sector_after(fs, fs->write.sector, fs->erase_ahead);
+
+    _sector_get_status(fs, sector, &status);
+    if (status == SECTOR_FREE || status == SECTOR_ERASING)
+    {
+        return;
+    }
+
+    if (_sector_reclaim(fs, sector) != 0)
+    {
+        return;
+    }
+    _sector_set_status(fs, sector, SECTOR_ERASING);
+
+    if (fs->erase_callback)
+    {
+        fs->erase_callback(sector);
+    }
+}
+
+/**
+ * Make the write head ready for appending.
+ *
+ * There are three sectors involved in appending a value:
+ * - the sector where the append happens: it has to be writable
+ * - the next sector: it must be free (invariant)
+ * - the next-next sector: read & cursor heads are moved there if needed
+ *
+ * With an erase-ahead pool, the sectors up to erase_ahead past the write
+ * head are reclaimed when it enters a new sector, and the next sector is
+ * only erased inline if nobody got around to it yet.
+ */
+/** Make sure the next sector is free and the write sector writable. */
+static int32_t _append_make_room(ringfs_t * const fs)
+{
+    uint32_t status;
+
+    /* Make sure the next sector is free. */
+    int32_t next_sector = _sector_after(fs, fs->write.sector, 1);
+    _sector_get_status(fs, next_sector, &status);
+    if (status != SECTOR_FREE)
+    {
+        /* Next sector must be freed. But first... */
+
+        /* Move the read & cursor heads out of the way. */
+        if (_sector_reclaim(fs, next_sector) != 0)
+        {
+            return -1;
+        }
+
+        /* Free the next sector. */
+        _sector_free(fs, next_sector);
+    }
+
+    /* Now we can make sure the current write sector is writable. */
+    _sector_get_status(fs, fs->write.sector, &status);
+    if (status == SECTOR_FREE)
+    {
+        /* Free sector. Number it, then mark as used. */
+        if (fs->flags & RINGFS_SEQUENCE)
+        {
+            fs->seq_base = _seq_write_base(fs);
+            fs->seq_sector = fs->write.sector;
+            _sector_set_seq(fs, fs->write.sector, fs->seq_base);
+        }
+        if (fs->flags & RINGFS_KEY_RANGE)
+        {
+            _key_summarize(fs);
+        }
+        _sector_set_status(fs, fs->write.sector, SECTOR_IN_USE);
+        /* Entering a group closes the one before; a power loss in between
+         * leaves both filling, which ringfs_scan() sorts out. */
+        if ((fs->flags & RINGFS_SECTOR_GROUPS) && fs->write.sector % fs->group_size == 0)
+        {
+            const int32_t previous = _sector_after(fs, fs->write.sector, fs->flash->sector_count - 1);
+            _group_close(fs, previous - previous % fs->group_size);
+        }
+        if (fs->erase_ahead > 1 || fs->erase_callback)
+        {
+            _pool_reclaim(fs);
+        }
+        _checkpoint_write(fs);
+    }
+    else if (status != SECTOR_IN_USE)
+    {
+        //printf("ringfs_append: corrupted filesystem\r\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int32_t _append_prepare(ringfs_t * const fs)
+{
+    /* Whichever call appends, erases on the way hold it up. */
+    STATS_APPENDING(fs, true);
+    const int32_t res = _append_make_room(fs);
+    STATS_APPENDING(fs, false);
+
+    return res;
+}
+
+/**
+ * Check whether one more slot fits the buffered run. A run starts at the
+ * write head and stays within its sector, the buffer and (except for a
+ * first slot straddling two pages) the program page it starts in.
+ */
+static bool _wbuf_fits(ringfs_t * const fs)
+{
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
+    const int32_t page_size = fs->flash->page_size;
+    const int32_t run_size  = (fs->wbuf_count + 1) * slot_size;
+
+    if (fs->write.slot + fs->wbuf_count >= fs->slots_per_sector || run_size > fs->wbuf_size)
+    {
+        return false;
+    }
+
+    if (page_size > 0 && fs->wbuf_count > 0)
+    {
+        const ringfs_addr_t start = _slot_address(fs, &fs->write);
+        return _page_offset(fs, start) + run_size <= page_size;
+    }
+
+    return true;
+}
+
+/** Stage a reserved slot image in the write buffer, flushing as needed. */
+static int32_t _wbuf_append(ringfs_t * const fs, const void * const object)
+{
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
+    const uint32_t reserved = SLOT_RESERVED;
+
+    if (!_wbuf_fits(fs) && _wbuf_flush(fs) != 0)
+    {
+        return -1;
+    }
+
+    uint8_t *slot = fs->wbuf + fs->wbuf_count * slot_size;
+    memcpy(slot, &reserved, sizeof(reserved));
+    memcpy(slot + fs->slot_header_size, object, (size_t)fs->object_size);
+    if (fs->wbuf_count++ == 0)
+    {
+        fs->wbuf_age = 0;
+    }
+
+    /* Program the run as soon as it's complete. */
+    if (!_wbuf_fits(fs))
+    {
+        return _wbuf_flush(fs);
+    }
+
+    return 0;
+}
+
+/** Program the buffered run, if any. */
+static int32_t _wbuf_flush(ringfs_t * const fs)
+{
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
+    const int32_t count     = fs->wbuf_count;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    if (_append_prepare(fs) != 0)
+    {
+        return -1;
+    }
+
+    for (int32_t slot = 0; slot < count; slot++)
+    {
+        _key_note(fs, fs->wbuf + slot * slot_size + fs->slot_header_size);
+    }
+
+    /* The run goes out reserved in a single program, then is committed. */
+    fs->wbuf_count = 0;
+    STATS_ADD(fs, header_bytes, count * fs->slot_header_size);
+    STATS_ADD(fs, payload_bytes, count * fs->object_size);
+    _flash_program(fs, _slot_address(fs, &fs->write), fs->wbuf, count * slot_size);
+    _append_commit(fs, count);
+
+    return 0;
+}
+
+int32_t ringfs_flush(ringfs_t * const fs)
+{
+    STATS_CALL(fs, FLUSH);
+    return _wbuf_flush(fs);
+}
+
+int32_t ringfs_append_to_cache(ringfs_t * const fs, const void * const object, int32_t size)
+{
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
+
+    if (!fs->wbuf || size < 0 || size > fs->object_size)
+    {
+        return -1;
+    }
+
+    /* Take the end of the write buffer for the object being filled. */
+    if (!fs->cache)
+    {
+        if (fs->wbuf_size - fs->object_size < slot_size || _wbuf_flush(fs) != 0)
+        {
+            return -1;
+        }
+
+        fs->wbuf_size -= fs->object_size;
+        fs->cache = fs->wbuf + fs->wbuf_size;
+    }
+
+    if (size + fs->cache_filling_level > fs->object_size)
+    {
+        if (ringfs_append(fs, fs->cache) != 0)
+        {
+            return -1;
+        }
+        fs->cache_filling_level = 0;
+    }
+
+    memcpy(fs->cache + fs->cache_filling_level, object, (size_t)size);
+    fs->cache_filling_level += size;
+
+    return size;
+}
+
+int32_t ringfs_idle(ringfs_t * const fs, uint32_t elapsed)
+{
+    STATS_CALL(fs, FLUSH);
+
+    if (fs->wbuf_count == 0 || fs->wbuf_timeout == 0)
+    {
+        return 0;
+    }
+
+    fs->wbuf_age += elapsed;
+    if (fs->wbuf_age < fs->wbuf_timeout)
+    {
+        return 0;
+    }
+
+    return _wbuf_flush(fs) == 0 ? 1 : -1;
+}
+
+int32_t ringfs_append(ringfs_t * const fs, const void * const object)
+{
+    STATS_CALL(fs, APPEND);
+
+    if (fs->flags & RINGFS_VARIABLE)
+    {
+        return _append_var(fs, object, fs->object_size);
+    }
+
+    if (fs->wbuf)
+    {
+        return _wbuf_append(fs, object);
+    }
+
+    if (_append_prepare(fs) != 0)
+    {
+        return -1;
+    }
+
+    const ringfs_addr_t slot_addr = _slot_address(fs, &fs->write);
+    _key_note(fs, object);
+
+    if (fs->slot_header_size)
+    {
+        /* Preallocate slot, write object, commit write: in one go. */
+        const uint32_t reserved = SLOT_RESERVED;
+        const uint32_t valid    = SLOT_VALID;
+        const struct ringfs_iovec iov[] = {
+            { slot_addr, &reserved, sizeof(reserved) },
+            { slot_addr + fs->slot_header_size, object, fs->object_size },
+            { slot_addr, &valid, sizeof(valid) },
+        };
+
+        _slot_status_changed(fs, &fs->write, SLOT_VALID);
+        STATS_ADD(fs, header_bytes, sizeof(reserved) + sizeof(valid));
+        STATS_ADD(fs, payload_bytes, fs->object_size);
+        _flash_programv(fs, iov, 3);
+    }
+    else
+    {
+        /* Write object, then commit it in the bitmap. */
+        STATS_ADD(fs, payload_bytes, fs->object_size);
+        _flash_program(fs, slot_addr, object, fs->object_size);
+        _slot_set_status(fs, &fs->write, SLOT_VALID);
+    }
+
+    /* Advance the write head. */
+    _loc_advance_slot(fs, &fs->write);
+    _spsc_publish(fs);
+
+    return 0; // fs->object_size;
+}
+
+/**
+ * Write a run of objects into consecutive slots of the write sector.
+ *
+ * Slot headers and payloads are contiguous on flash, so the reserve step is
+ * staged in a small buffer and programmed for as many slots as fit at once.
+ * Slots are then committed one by one, oldest first, so a power loss leaves
+ * a committed prefix followed by RESERVED slots. (In the bitmap layout there
+ * are no headers, and the torn slots are found by ringfs_scan().)
+ */
+static void _append_run(ringfs_t * const fs, const uint8_t *objects, int32_t count)
+{
+    const int32_t slot_h_size = fs->slot_header_size;
+    const int32_t slot_size   = slot_h_size + fs->object_size;
+    const int32_t page_size   = fs->flash->page_size;
+    const uint32_t reserved   = SLOT_RESERVED;
+    struct ringfs_loc loc     = fs->write;
+    uint8_t chunk[RINGFS_BATCH_CHUNK_SIZE];
+
+    for (int32_t slot = 0; slot < count; slot++)
+    {
+        _key_note(fs, objects + slot * fs->object_size);
+    }
+
+    /* Reserve slots and write objects. */
+    for (int32_t slot = 0; slot < count; )
+    {
+        const ringfs_addr_t slot_addr = _slot_address(fs, &loc);
+
+        if (slot_size > (int32_t)sizeof(chunk))
+        {
+            /* Too big to stage: header and payload go separately. */
+            _slot_set_status(fs, &loc, SLOT_RESERVED);
+            STATS_ADD(fs, payload_bytes, fs->object_size);
+            _flash_program(fs, slot_addr + slot_h_size,
+                    objects + slot * fs->object_size, fs->object_size);
+            loc.slot++;
+            slot++;
+            continue;
+        }
+
+        /* Don't let a program cross a page boundary past its first slot. */
+        int32_t limit = (int32_t)sizeof(chunk);
+        if (page_size > 0 && page_size - _page_offset(fs, slot_addr) < limit)
+        {
+            limit = page_size - _page_offset(fs, slot_addr);
+        }
+
+        int32_t staged = 0;
+        while (slot < count && (staged == 0 || staged + slot_size <= limit) &&
+               staged + slot_size <= (int32_t)sizeof(chunk))
+        {
+            memcpy(&chunk[staged], &reserved, (size_t)slot_h_size);
+            memcpy(&chunk[staged + slot_h_size], objects + slot * fs->object_size, (size_t)fs->object_size);
+            staged += slot_size;
+            loc.slot++;
+            slot++;
+            STATS_ADD(fs, header_bytes, slot_h_size);
+            STATS_ADD(fs, payload_bytes, fs->object_size);
+        }
+        _flash_program(fs, slot_addr, chunk, staged);
+    }
+
+    _append_commit(fs, count);
+}
+
+/** Commit a run of slots written at the write head in order, and advance it. */
+static void _append_commit(ringfs_t * const fs, int32_t count)
+{
+    if (fs->slot_header_size == 0)
+    {
+        for (int32_t slot = 0; slot < count; slot++)
+        {
+            _slot_set_status(fs, &fs->write, SLOT_VALID);
+            _loc_advance_slot(fs, &fs->write);
+        }
+
+        return;
+    }
+
+    const uint32_t valid = SLOT_VALID;
+    struct ringfs_iovec iov[RINGFS_IOV_MAX];
+    int32_t queued = 0;
+    for (int32_t slot = 0; slot < count; slot++)
+    {
+        iov[queued].address = _slot_address(fs, &fs->write);
+        iov[queued].data    = &valid;
+        iov[queued].size    = sizeof(valid);
+        queued++;
+        STATS_ADD(fs, header_bytes, sizeof(valid));
+
+        _slot_status_changed(fs, &fs->write, SLOT_VALID);
+        _loc_advance_slot(fs, &fs->write);
+
+        if (queued == RINGFS_IOV_MAX || slot == count - 1)
+        {
+            _flash_programv(fs, iov, queued);
+            queued = 0;
+        }
+    }
+    _spsc_publish(fs);
+}
+
+int32_t ringfs_append_batch(ringfs_t * const fs, const void * const objects, int32_t count)
+{
+    const uint8_t *object = objects;
+
+    STATS_CALL(fs, APPEND);
+
+    /* Keep the order with anything still buffered. */
+    if (_wbuf_flush(fs) != 0)
+    {
+        return -1;
+    }
+
+    while (count > 0 && (fs->flags & RINGFS_VARIABLE))
+    {
+        if (_append_var(fs, object, fs->object_size) != 0)
+        {
+            return -1;
+        }
+
+        object += fs->object_size;
+        count--;
+    }
+
+    while (count > 0)
+    {
+        if (_append_prepare(fs) != 0)
+        {
+            return -1;
+        }
+
+        /* Never cross a sector boundary in one run: the next sector has to
+         * be freed (and the heads moved) before it's written to. */
+        int32_t run = fs->slots_per_sector - fs->write.slot;
+        if (run > count)
+        {
+            run = count;
+        }
+
+        _append_run(fs, object, run);
+
+        object += run * fs->object_size;
+        count  -= run;
+    }
+
+    return 0;
+}
+
+static int32_t _append_var(ringfs_t * const fs, const void * const object, int32_t size)
+{
+    const int32_t record_size = _var_record_size(size);
+
+    if (!(fs->flags & RINGFS_VARIABLE) || size < 1 || size > fs->object_size)
+    {
+        return -1;
+    }
+
+    /* Records don't span sectors: leave the rest of this one erased. */
+    if (fs->write.slot + record_size > fs->slots_per_sector)
+    {
+        _loc_advance_sector(fs, &fs->write);
+    }
+
+    if (_append_prepare(fs) != 0)
+    {
+        return -1;
+    }
+
+    /* Reserve the record together with its length, write it, commit it. */
+    const ringfs_addr_t record_addr = _slot_address(fs, &fs->write);
+    const struct var_header reserved = { VAR_RESERVED, (uint16_t)size };
+    const struct var_header valid    = { VAR_VALID, 0xFFFF };
+    const struct ringfs_iovec iov[] = {
+        { record_addr, &reserved, sizeof(reserved) },
+        { record_addr + (int32_t)sizeof(reserved), object, size },
+        { record_addr, &valid, sizeof(valid) },
+    };
+
+    fs->var_loc.sector = -1;
+    _slot_status_changed(fs, &fs->write, SLOT_VALID);
+    STATS_ADD(fs, header_bytes, sizeof(reserved) + sizeof(valid));
+    STATS_ADD(fs, payload_bytes, size);
+    _flash_programv(fs, iov, 3);
+
+    /* Advance the write head. */
+    _loc_advance_bytes(fs, &fs->write, record_size);
+
+    return 0;
+}
+
+int32_t ringfs_append_var(ringfs_t * const fs, const void * const object, int32_t size)
+{
+    STATS_CALL(fs, APPEND_VAR);
+    return _append_var(fs, object, size);
+}
+
+void ringfs_erase_sector(ringfs_t * const fs, const int32_t sector2erase)
+{
+    uint32_t status;
+
+    STATS_CALL(fs, ERASE);
+
+    /* With an erase-ahead pool, only erase sectors that were handed over:
+     * the write head may have reached (and erased) it in the meantime. */
+    if (fs->erase_ahead > 1 || fs->erase_callback)
+    {
+        _sector_get_status(fs, sector2erase, &status);
+        if (status != SECTOR_ERASING)
+        {
+            return;
+        }
+    }
+
+    /* Free the next sector. */
+    _sector_free(fs, sector2erase);
+}
+
+/** Block until the background erase (if any) is complete. */
+static void _erase_wait(ringfs_t * const fs)
+{
+    while (_erase_poll(fs) > 0)
+    {
+    }
+}
+
+static int32_t _erase_begin(ringfs_t * const fs, const int32_t sector)
+{
+    uint32_t status;
+
+    if (fs->erase.sector >= 0)
+    {
+        return -1;
+    }
+
+    _sector_get_status(fs, sector, &status);
+    if (status == SECTOR_FREE)
+    {
+        return 0;
+    }
+
+    if (_sector_reclaim(fs, sector) != 0)
+    {
+        return -1;
+    }
+
+    if (!fs->flash->erase_start || !fs->flash->erase_busy)
+    {
+        _sector_free(fs, sector);
+        return 0;
+    }
+
+    /* Marking the sector first keeps a power loss during the erase safe. */
+    _sector_set_status(fs, sector, SECTOR_ERASING);
+    _readahead_invalidate(fs, sector);
+    const uint32_t start = STATS_BEGIN(fs);
+    fs->flash->erase_start(fs->flash, _sector_address(fs, sector));
+    STATS_END(fs, ERASE, start);
+    fs->erase.sector = sector;
+    fs->erase.suspended = false;
+
+    return 1;
+}
+
+int32_t ringfs_erase_begin(ringfs_t * const fs, const int32_t sector)
+{
+    STATS_CALL(fs, ERASE);
+    return _erase_begin(fs, sector);
+}
+
+static int32_t _erase_poll(ringfs_t * const fs)
+{
+    const int32_t sector = fs->erase.sector;
+
+    if (sector < 0)
+    {
+        return 0;
+    }
+
+    if (fs->flash->erase_busy(fs->flash))
+    {
+        return 1;
+    }
+
+    fs->erase.sector = -1;
+    _sector_erase_finish(fs, sector);
+
+    return 0;
+}
+
+int32_t ringfs_erase_poll(ringfs_t * const fs)
+{
+    STATS_CALL(fs, ERASE);
+    return _erase_poll(fs);
+}
+
+int32_t ringfs_service(ringfs_t * const fs)
+{
+    STATS_CALL(fs, ERASE);
+
+    /* Keep a background erase going. */
+    if (fs->erase.sector >= 0)
+    {
+        _erase_poll(fs);
+        return 1;
+    }
+
+    for (int32_t ahead = 1; ahead <= fs->erase_ahead; ahead++)
+    {
+        const int32_t sector = _sector_after(fs, fs->write.sector, ahead);
+        uint32_t status;
+
+        /* Sectors still holding data are left for the write head to reclaim. */
+        _sector_get_status(fs, sector, &status);
+        if (status != SECTOR_FREE && status != SECTOR_IN_USE)
+        {
+            _erase_begin(fs, sector);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/** Count an object fetched at the built-in cursor; cursor objects aren't counted. */
+static void _fetch_counted(ringfs_t * const fs, struct ringfs_loc * const loc)
+{
+    if (loc == &fs->cursor)
+    {
+        fs->count_cursor++;
+    }
+}
+
+/** Move a fetch position past the object just read. */
+static void _fetch_done(ringfs_t * const fs, struct ringfs_loc * const loc)
+{
+    _loc_advance_slot(fs, loc);
+    _fetch_counted(fs, loc);
+}
+
+/** Fetch the next object at a fetch position: the cursor or a cursor object. */
+static int32_t _fetch(ringfs_t * const fs, struct ringfs_loc * const loc, void * const object)
+{
+    if (fs->flags & RINGFS_VARIABLE)
+    {
+        return _fetch_var(fs, loc, object, fs->object_size) < 0 ? -1 : 0;
+    }
+
+    /* Advance forward in search of a valid slot. */
+    while (!_loc_equal(loc, _write_view(fs)))
+    {
+        uint32_t status;
+
+        _spsc_follow(fs, loc);
+        if (_loc_equal(loc, _write_view(fs)))
+        {
+            break;
+        }
+
+        const uint8_t *slot = _readahead_slot(fs, loc);
+
+        if (slot)
+        {
+            /* Serve the slot from RAM. */
+            if (fs->slot_header_size)
+            {
+                memcpy(&status, slot + offsetof(struct slot_header, status), sizeof(status));
+            }
+            else
+            {
+                _slot_get_status(fs, loc, &status);
+            }
+            if (status == SLOT_VALID)
+            {
+                memcpy(object, slot + fs->slot_header_size, (size_t)fs->object_size);
+                _fetch_done(fs, loc);
+                return 0;
+            }
+
+            STATS_ADD(fs, fetch_skipped, status != SLOT_ERASED);
+            _loc_advance_slot(fs, loc);
+            continue;
+        }
+
+        if (fs->flash->readv && fs->slot_header_size)
+        {
+            /* Status and payload in one transaction; the payload is only
+             * kept if the slot turns out to be valid. */
+            const ringfs_addr_t slot_addr = _slot_address(fs, loc);
+            const struct ringfs_read_iovec iov[] = {
+                { slot_addr + (int32_t)offsetof(struct slot_header, status), &status, sizeof(status) },
+                { slot_addr + fs->slot_header_size, object, fs->object_size },
+            };
+            _flash_readv(fs, iov, 2);
+
+            if (status == SLOT_VALID)
+            {
+                _fetch_done(fs, loc);
+                return 0;
+            }
+
+            STATS_ADD(fs, fetch_skipped, status != SLOT_ERASED);
+            _loc_advance_slot(fs, loc);
+            continue;
+        }
+
+        _slot_get_status(fs, loc, &status);
+
+        if (status == SLOT_VALID)
+        {
+            _flash_read(fs, _slot_address(fs, loc) + fs->slot_header_size,
+                    object, fs->object_size);
+            _fetch_done(fs, loc);
+            return 0;
+        }
+
+        STATS_ADD(fs, fetch_skipped, status != SLOT_ERASED);
+        _loc_advance_slot(fs, loc);
+    }
+
+    return -1;
+}
+
+int32_t ringfs_fetch(ringfs_t * const fs, void * const object)
+{
+    STATS_CALL(fs, FETCH);
+
+    _spsc_pin(fs, &fs->cursor);
+    const int32_t result = _fetch(fs, &fs->cursor, object);
+    _spsc_unpin(fs);
+
+    return result;
+}
+
+static int32_t _fetch_var(ringfs_t * const fs, struct ringfs_loc * const loc, void * const object, int32_t size)
+{
+    if (!(fs->flags & RINGFS_VARIABLE))
+    {
+        return -1;
+    }
+
+    /* Advance forward in search of a valid record. */
+    while (!_loc_equal(loc, &fs->write))
+    {
+        uint32_t status;
+
+        _slot_get_status(fs, loc, &status);
+        if (status == SLOT_VALID)
+        {
+            const int32_t length = fs->var_length;
+            if (length > size)
+            {
+                return -1;
+            }
+
+            _flash_read(fs, _slot_address(fs, loc) + (int32_t)sizeof(struct var_header),
+                    object, length);
+            _loc_advance_bytes(fs, loc, _var_record_size(length));
+            _fetch_counted(fs, loc);
+            return length;
+        }
+
+        STATS_ADD(fs, fetch_skipped, status != SLOT_ERASED);
+        _loc_advance_slot(fs, loc);
+    }
+
+    return -1;
+}
+
+int32_t ringfs_fetch_var(ringfs_t * const fs, void * const object, int32_t size)
+{
+    STATS_CALL(fs, FETCH_VAR);
+    return _fetch_var(fs, &fs->cursor, object, size);
+}
+
+/** Move the cursor forward to the next VALID slot, if any. */
+static bool _cursor_find_valid(ringfs_t * const fs)
+{
+    while (!_loc_equal(&fs->cursor, &fs->write))
+    {
+        uint32_t status;
+        const uint8_t *slot = _readahead_slot(fs, &fs->cursor);
+
+        if (slot && fs->slot_header_size)
+        {
+            memcpy(&status, slot + offsetof(struct slot_header, status), sizeof(status));
+        }
+        else
+        {
+            _slot_get_status(fs, &fs->cursor, &status);
+        }
+
+        if (status == SLOT_VALID)
+        {
+            return true;
+        }
+
+        STATS_ADD(fs, fetch_skipped, status != SLOT_ERASED);
+        _loc_advance_slot(fs, &fs->cursor);
+    }
+
+    return false;
+}
+
+int32_t ringfs_peek(ringfs_t * const fs, const void ** const object)
+{
+    STATS_CALL(fs, FETCH);
+
+    if ((fs->flags & RINGFS_SPSC) || !_cursor_find_valid(fs))
+    {
+        return -1;
+    }
+
+    const int32_t size = (fs->flags & RINGFS_VARIABLE) ? fs->var_length : fs->object_size;
+    const ringfs_addr_t addr = _slot_address(fs, &fs->cursor) + fs->slot_header_size;
+
+    /* Point straight into the flash, unless an erase keeps it busy. */
+    if (fs->flash->map && fs->erase.sector < 0)
+    {
+        const void *mapped = fs->flash->map(fs->flash, addr, size);
+        if (mapped)
+        {
+            *object = mapped;
+            return size;
+        }
+    }
+
+    /* Otherwise serve it from the read buffer. */
+    const uint8_t *slot = _readahead_slot(fs, &fs->cursor);
+    if (slot)
+    {
+        *object = slot + fs->slot_header_size;
+        return size;
+    }
+
+    if (!fs->readahead || size > fs->readahead_size)
+    {
+        return -1;
+    }
+
+    _readahead_invalidate(fs, -1);
+    _flash_read(fs, addr, fs->readahead, size);
+    *object = fs->readahead;
+
+    return size;
+}
+
+int32_t ringfs_advance(ringfs_t * const fs)
+{
+    STATS_CALL(fs, FETCH);
+
+    if ((fs->flags & RINGFS_SPSC) || !_cursor_find_valid(fs))
+    {
+        return -1;
+    }
+
+    const int32_t size = (fs->flags & RINGFS_VARIABLE) ? fs->var_length : fs->object_size;
+    _loc_advance_slot(fs, &fs->cursor);
+    fs->count_cursor++;
+
+    return size;
+}
+
+/** Move the read head up to a location, marking everything on the way. */
+static void _discard_to(ringfs_t * const fs, struct ringfs_loc * const to)
+{
+    const int32_t read_sector = fs->read.sector;
+
+    _cursors_follow(fs, to);
+
+    /* Retire fully consumed sectors as a whole. */
+    while (fs->read.sector != to->sector)
+    {
+        _sector_set_status(fs, fs->read.sector, SECTOR_CONSUMED);
+        _loc_advance_sector(fs, &fs->read);
+        _spsc_follow(fs, &fs->read);
+    }
+
+    /* Mark the consumed part of the last sector slot by slot. */
+    while (!_loc_equal(&fs->read, to))
+    {
+        _slot_set_status(fs, &fs->read, SLOT_GARBAGE);
+        _loc_advance_slot(fs, &fs->read);
+        _spsc_follow(fs, &fs->read);
+    }
+
+    if (fs->read.sector != read_sector)
+    {
+        _checkpoint_write(fs);
+    }
+}
+
+int32_t ringfs_discard(ringfs_t * const fs)
+{
+    STATS_CALL(fs, DISCARD);
+    _spsc_pin(fs, &fs->read);
+    _count_discard(fs);
+    _discard_to(fs, &fs->cursor);
+    _spsc_unpin(fs);
+
+    return 0;
+}
+
+int32_t ringfs_item_discard(ringfs_t * const fs)
+{
+    STATS_CALL(fs, DISCARD);
+    _spsc_pin(fs, &fs->read);
+
+    if (_loc_equal(&fs->read, _write_view(fs)))
+    {
+        _spsc_unpin(fs);
+        return -1;
+    }
+
+    if (fs->count_table && fs->count_valid)
+    {
+        uint32_t status;
+        _slot_get_status(fs, &fs->read, &status);
+        if (status == SLOT_VALID)
+        {
+            _count_add(fs, fs->read.sector, -1);
+            if (!_loc_equal(&fs->read, &fs->cursor))
+            {
+                fs->count_cursor--;
+            }
+        }
+    }
+
+    /* Finishing a sector retires it as a whole. */
+    struct ringfs_loc next = fs->read;
+    _loc_advance_slot(fs, &next);
+    if (next.sector != fs->read.sector)
+    {
+        _sector_set_status(fs, fs->read.sector, SECTOR_CONSUMED);
+    }
+    else
+    {
+        _slot_set_status(fs, &fs->read, SLOT_GARBAGE);
+    }
+
+    /* Never leave the cursors behind the read head. */
+    if (_loc_equal(&fs->read, &fs->cursor))
+    {
+        fs->cursor = next;
+    }
+    _cursors_follow(fs, &next);
+    fs->read = next;
+    _spsc_unpin(fs);
+
+    if (fs->read.slot == 0)
+    {
+        _checkpoint_write(fs);
+    }
+
+    return 0;
+}
+
+int32_t ringfs_rewind(ringfs_t * const fs)
+{
+    fs->cursor = fs->read;
+    fs->count_cursor = 0;
+    return 0;
+}
+
+/**
+ * Get the slots laid out back to back from a location, up to the write
+ * head: mapped if possible, then from the read buffer, then read into the
+ * chunk.
+ *
+ * @returns Number of slots got, zero if not even one fits the chunk.
+ */
+static int32_t _export_run(ringfs_t * const fs, struct ringfs_loc * const loc,
+        uint8_t * const chunk, int32_t chunk_size, const uint8_t ** const slots)
+{
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
+    int32_t count = _slot_run(fs, loc);
 
-    return 0;
-}
+    if (loc->sector == fs->write.sector && count > fs->write.slot - loc->slot)
+    {
+        count = fs->write.slot - loc->slot;
+    }
 
-int32_t ringfs_format(ringfs_t * const fs)
-{
-    /* Mark all sectors to prevent half-erased filesystems. */
-    for (int32_t sector = 0; sector < fs->flash->sector_count; sector++)
+    if (fs->flash->map && fs->erase.sector < 0)
     {
-        _sector_set_status(fs, sector, SECTOR_FORMATTING);
+        *slots = fs->flash->map(fs->flash, _slot_address(fs, loc), count * slot_size);
+        if (*slots)
+        {
+            return count;
+        }
     }
 
-    /* Erase, update version, mark as free. */
-    for (int32_t sector = 0; sector < fs->flash->sector_count; sector++)
+    *slots = _readahead_slot(fs, loc);
+    if (*slots)
     {
-        _sector_free(fs, sector);
+        const int32_t buffered = fs->readahead_loc.slot + fs->readahead_count - loc->slot;
+        return count < buffered ? count : buffered;
     }
 
-    /* Start reading & writing at the first sector. */
-    fs->read.sector = 0;
-    fs->read.slot = 0;
-    fs->write.sector = 0;
-    fs->write.slot = 0;
-    fs->cursor.sector = 0;
-    fs->cursor.slot = 0;
+    if (count > chunk_size / slot_size)
+    {
+        count = chunk_size / slot_size;
+    }
+    if (count > 0)
+    {
+        _flash_read(fs, _slot_address(fs, loc), chunk, count * slot_size);
+    }
+    *slots = chunk;
 
-    return 0;
+    return count;
 }
 
-int32_t ringfs_scan(ringfs_t * const fs)
+int32_t ringfs_export(ringfs_t * const fs, ringfs_export_sink sink, void * const context, bool discard)
 {
-    uint32_t previous_sector_status = SECTOR_FREE;
-    /* The read sector is the first IN_USE sector *after* a FREE sector
-     * (or the first one). */
-    int32_t read_sector = 0;
-    /* The write sector is the last IN_USE sector *before* a FREE sector
-     * (or the last one). */
-    int32_t write_sector = fs->flash->sector_count - 1;
-    /* There must be at least one FREE sector available at all times. */
-    bool free_seen = false;
-    /* If there's no IN_USE sector, we start at the first one. */
-    bool used_seen = false;
+    STATS_CALL(fs, FETCH);
 
-    /* Iterate over sectors. */
-    for (int32_t sector = 0; sector < fs->flash->sector_count; sector++)
+    if (fs->flags & (RINGFS_VARIABLE | RINGFS_SPSC))
     {
-        const int32_t sector_size = fs->flash->sector_size;
-        const int32_t offs        = sector_size - (int32_t)sizeof(struct sector_header) + (int32_t)offsetof(struct sector_header, status);
-        const int32_t addr        = _sector_address(fs, sector);
+        return -1;
+    }
 
-        /* Read sector header. */
-        struct sector_header header;
-        int32_t len = fs->flash->read(fs->flash, addr+offs, &header, sizeof(header));
-        (void)len;
+    const int32_t slot_size = fs->slot_header_size + fs->object_size;
+    uint8_t chunk[RINGFS_BATCH_CHUNK_SIZE];
+    struct ringfs_loc loc = fs->read;
+    int32_t exported = 0;
+    bool stopped = false, failed = false;
+
+    while (!stopped && !_loc_equal(&loc, &fs->write))
+    {
+        const uint8_t *slots;
+        const int32_t count = _export_run(fs, &loc, chunk, (int32_t)sizeof(chunk), &slots);
 
-        /* Detect partially-formatted partitions. */
-        if (header.status == SECTOR_FORMATTING)
+        if (count == 0)
         {
-            //printf("ringfs_scan: partially formatted partition\r\n");
-            return -1;
+            failed = true;
+            break;
         }
 
-        /* Detect and fix partially erased sectors. */
-        if (header.status == SECTOR_ERASING || header.status == SECTOR_ERASED)
+        /* Hand over each stretch of VALID slots; i == count ends the last one. */
+        int32_t first = 0;
+        for (int32_t i = 0; i <= count; i++)
         {
-            _sector_free(fs, sector);
-            header.status = SECTOR_FREE;
+            uint32_t status = SLOT_ERASED;
+
+            if (i < count)
+            {
+                if (fs->slot_header_size)
+                {
+                    memcpy(&status, slots + i * slot_size + offsetof(struct slot_header, status), sizeof(status));
+                }
+                else
+                {
+                    struct ringfs_loc at = { loc.sector, loc.slot + i };
+                    _slot_get_status(fs, &at, &status);
+                }
+                if (status == SLOT_VALID)
+                {
+                    continue;
+                }
+                STATS_ADD(fs, fetch_skipped, status != SLOT_ERASED);
+            }
+
+            if (i > first)
+            {
+                if (sink(context, slots + first * slot_size + fs->slot_header_size, i - first, slot_size) != 0)
+                {
+                    loc.slot += first;
+                    stopped = true;
+                    break;
+                }
+                exported += i - first;
+                if (discard)
+                {
+                    _count_add(fs, loc.sector, -(i - first));
+                }
+            }
+            first = i + 1;
         }
 
-        /* Detect corrupted sectors. */
-        if (header.status != SECTOR_FREE && header.status != SECTOR_IN_USE)
+        if (!stopped)
         {
-            //printf("ringfs_scan: corrupted sector %d\r\n", sector);
-            return -1;
+            loc.slot += count - 1;
+            _loc_advance_slot(fs, &loc);
         }
+    }
+
+    if (discard)
+    {
+        STATS_CALL(fs, DISCARD);
 
-        /* Detect obsolete versions. We can't do this earlier because the version
-         * could have been invalid due to a partial erase. */
-        if (header.version != fs->version)
+        /* Everything before the cursor has been exported, or is still ahead. */
+        if (_loc_offset(fs, &fs->cursor) <= _loc_offset(fs, &loc))
         {
-            //printf("ringfs_scan: incompatible version 0x%08"PRIx32"\r\n", header.version);
-            return -1;
+            fs->cursor = loc;
+            fs->count_cursor = 0;
         }
-
-        /* Record the presence of a FREE sector. */
-        if (header.status == SECTOR_FREE)
+        else
         {
-            free_seen = true;
+            fs->count_cursor -= exported;
         }
+        _discard_to(fs, &loc);
+    }
 
-        /* Record the presence of a IN_USE sector. */
-        if (header.status == SECTOR_IN_USE)
+    return failed ? -1 : exported;
+}
+
+int32_t ringfs_seek_seq(ringfs_t * const fs, uint32_t seq)
+{
+    uint32_t first;
+
+    STATS_CALL(fs, FETCH);
+
+    if (!(fs->flags & RINGFS_SEQUENCE) || _seq_at(fs, &fs->read, &first) != 0 ||
+        seq < first || seq > _seq_write_base(fs) + (uint32_t)fs->write.slot)
+    {
+        return -1;
+    }
+
+    /* Find the last sector in use numbered at or below seq. */
+    int32_t lo = 0;
+    int32_t hi = _sector_distance(fs, fs->read.sector, fs->write.sector);
+    while (lo < hi)
+    {
+        const int32_t mid = lo + (hi - lo + 1) / 2;
+        const struct ringfs_loc loc = { _sector_after(fs, fs->read.sector, mid), 0 };
+        uint32_t base;
+
+        if (_seq_at(fs, &loc, &base) != 0)
         {
-            used_seen = true;
+            return -1;
         }
-
-        /* Update read & write sectors according to the above rules. */
-        if (header.status == SECTOR_IN_USE && previous_sector_status == SECTOR_FREE)
+        if (base <= seq)
         {
-            read_sector = sector;
+            lo = mid;
         }
-
-        if (header.status == SECTOR_FREE && previous_sector_status == SECTOR_IN_USE)
+        else
         {
-            write_sector = sector-1;
+            hi = mid - 1;
         }
+    }
 
-        previous_sector_status = header.status;
+    struct ringfs_loc loc = { _sector_after(fs, fs->read.sector, lo), 0 };
+    uint32_t base;
+    if (_seq_at(fs, &loc, &base) != 0)
+    {
+        return -1;
+    }
+    loc.slot = (int32_t)(seq - base);
+    if (loc.slot >= fs->slots_per_sector)
+    {
+        _loc_advance_sector(fs, &loc);
     }
 
-    /* Detect the lack of a FREE sector. */
-    if ( !free_seen )
+    /* The counts don't know how far the cursor went. */
+    _count_reset(fs, false);
+    fs->cursor = loc;
+
+    return 0;
+}
+
+int32_t ringfs_tell_seq(ringfs_t * const fs, uint32_t * const seq)
+{
+    STATS_CALL(fs, FETCH);
+
+    if (!(fs->flags & RINGFS_SEQUENCE))
     {
-        //printf("ringfs_scan: invariant violated: no FREE sector found\r\n");
         return -1;
     }
 
-    /* Start writing at the first sector if the file system is empty. */
-    if ( !used_seen )
+    return _seq_at(fs, &fs->cursor, seq);
+}
+
+int32_t ringfs_query_range(ringfs_t * const fs, uint32_t lo, uint32_t hi, void * const object)
+{
+    STATS_CALL(fs, FETCH);
+
+    if (fs->key_size == 0 || lo > hi)
     {
-        write_sector = 0;
+        return -1;
     }
 
-    /* Scan the write sector and skip all occupied slots at the beginning. */
-    fs->write.sector = write_sector;
-    fs->write.slot = 0;
-    while (fs->write.sector == write_sector)
+    int32_t checked = -1;
+    while (!_loc_equal(&fs->cursor, &fs->write))
     {
-        uint32_t status;
-        _slot_get_status(fs, &fs->write, &status);
-        if (status == SLOT_ERASED)
+        /* Look at each sector's range once, as the cursor enters it. */
+        if (fs->cursor.sector != checked && fs->cursor.sector != fs->write.sector)
         {
-            break;
+            if (!_key_may_match(fs, fs->cursor.sector, lo, hi))
+            {
+                /* The counts don't know how many objects were passed over. */
+                _count_reset(fs, false);
+                _loc_advance_sector(fs, &fs->cursor);
+                continue;
+            }
+            checked = fs->cursor.sector;
         }
 
-        _loc_advance_slot(fs, &fs->write);
-    }
-    /* If the sector was full, we're at the beginning of a FREE sector now. */
-
-    /* Position the read head at the start of the first IN_USE sector, then skip
-     * over garbage/invalid slots until something of value is found or we reach
-     * the write head which means there's no data. */
-    fs->read.sector = read_sector;
-    fs->read.slot   = 0;
-    while (!_loc_equal(&fs->read, &fs->write))
-    {
-        uint32_t status;
-        _slot_get_status(fs, &fs->read, &status);
-        if (status == SLOT_VALID)
+        if (_fetch(fs, &fs->cursor, object) != 0)
         {
             break;
         }
 
-        _loc_advance_slot(fs, &fs->read);
+        const uint32_t key = _key_value(fs, (const uint8_t *)object + fs->key_offset);
+        if (key >= lo && key <= hi)
+        {
+            return 0;
+        }
     }
 
-    /* Move the read cursor to the read head position. */
-    fs->cursor = fs->read;
-
-    return 0;
+    return -1;
 }
 
-int32_t ringfs_capacity(ringfs_t * const fs)
+int32_t ringfs_cursor_open(ringfs_t * const fs, struct ringfs_cursor * const cursor)
 {
-    return fs->slots_per_sector * (fs->flash->sector_count - 1);
-}
+    /* The consumer side of SPSC only keeps track of its own heads. */
+    if (fs->flags & RINGFS_SPSC)
+    {
+        return -1;
+    }
 
-int32_t ringfs_count_estimate(ringfs_t * const fs)
-{
-    int32_t sector_diff = (fs->write.sector - fs->read.sector + fs->flash->sector_count) %
-        fs->flash->sector_count;
+    for (struct ringfs_cursor *open = fs->cursors; open; open = open->next)
+    {
+        if (open == cursor)
+        {
+            return -1;
+        }
+    }
 
-    return sector_diff * fs->slots_per_sector + fs->write.slot - fs->read.slot;
+    cursor->loc = fs->read;
+    cursor->discarded = fs->read;
+    cursor->next = fs->cursors;
+    fs->cursors = cursor;
+
+    return 0;
 }
 
-int32_t ringfs_count_exact(ringfs_t * const fs)
+int32_t ringfs_cursor_close(ringfs_t * const fs, struct ringfs_cursor * const cursor)
 {
-    int32_t count = 0;
-
-    /* Use a temporary loc for iteration. */
-    struct ringfs_loc loc = fs->read;
-    while (!_loc_equal(&loc, &fs->write))
+    for (struct ringfs_cursor **link = &fs->cursors; *link; link = &(*link)->next)
     {
-        uint32_t status;
-        _slot_get_status(fs, &loc, &status);
-        
-        if (status == SLOT_VALID)
+        if (*link == cursor)
         {
-            count++;
+            *link = cursor->next;
+            return 0;
         }
-
-        _loc_advance_slot(fs, &loc);
     }
 
-    return count;
+    return -1;
 }
 
-/**
- * @brief append the data chunk to the cache.
- *        each page for the S25FL164 will be filled.
- *
- * @param fs
- * @param object
- * @param size
- * @return
- */
-int32_t ringfs_append_to_cache(ringfs_t * const fs, const void * const object, int32_t size)
+int32_t ringfs_cursor_fetch(ringfs_t * const fs, struct ringfs_cursor * const cursor, void * const object)
 {
-	int32_t res = size;
-
-	if ((size + fs->cache_filling_level) > CACHE_SIZE)
-	{
-		// write cached page
-		res = ringfs_append(fs, fs->cache);
-		if (!res)
-		{
-			res = size;
-		}
-	    fs->cache_filling_level = 0;
-	    //memset(fs->cache, 0, CACHE_SIZE);
-	}
-
-	memcpy(&fs->cache[fs->cache_filling_level], object, (size_t)size);
-    fs->cache_filling_level += size;
-
-	return res;
+    STATS_CALL(fs, FETCH);
+    return _fetch(fs, &cursor->loc, object) < 0 ? -1 : 0;
 }
 
-int32_t ringfs_append(ringfs_t * const fs, const void * const object)
+int32_t ringfs_cursor_discard(ringfs_t * const fs, struct ringfs_cursor * const cursor)
 {
-    uint32_t status;
+    STATS_CALL(fs, DISCARD);
 
-    /*
-     * There are three sectors involved in appending a value:
-     * - the sector where the append happens: it has to be writable
-     * - the next sector: it must be free (invariant)
-     * - the next-next sector: read & cursor heads are moved there if needed
-     */
+    cursor->discarded = cursor->loc;
 
-    /* Make sure the next sector is free. */
-    int32_t next_sector = (fs->write.sector+1) % fs->flash->sector_count;
-    _sector_get_status(fs, next_sector, &status);
-    if (status != SECTOR_FREE)
+    /* The read head only goes as far as the cursor furthest behind. */
+    struct ringfs_loc slowest = cursor->discarded;
+    for (struct ringfs_cursor *other = fs->cursors; other; other = other->next)
     {
-        /* Next sector must be freed. But first... */
-
-        /* Move the read & cursor heads out of the way. */
-        if (fs->read.sector == next_sector)
-        {
-            _loc_advance_sector(fs, &fs->read);
-        }
-
-        if (fs->cursor.sector == next_sector)
+        if (_loc_offset(fs, &other->discarded) < _loc_offset(fs, &slowest))
         {
-            _loc_advance_sector(fs, &fs->cursor);
+            slowest = other->discarded;
         }
-
-        /* Free the next sector. */
-        _sector_free(fs, next_sector);
     }
 
-    /* Now we can make sure the current write sector is writable. */
-    _sector_get_status(fs, fs->write.sector, &status);
-    if (status == SECTOR_FREE)
+    if (_loc_equal(&slowest, &fs->read))
     {
-        /* Free sector. Mark as used. */
-        _sector_set_status(fs, fs->write.sector, SECTOR_IN_USE);
+        return 0;
     }
-    else if (status != SECTOR_IN_USE)
+
+    /* The per-sector counts only follow the built-in cursor. */
+    _count_reset(fs, false);
+    if (_loc_offset(fs, &fs->cursor) < _loc_offset(fs, &slowest))
     {
-        //printf("ringfs_append: corrupted filesystem\r\n");
-        return -1;
+        fs->cursor = slowest;
     }
+    _discard_to(fs, &slowest);
 
-    /* Preallocate slot. */
-    _slot_set_status(fs, &fs->write, SLOT_RESERVED);
-
-    /* Write object. */
-    const int32_t slot_addr = _slot_address(fs, &fs->write);
-    const int32_t slot_h_size = sizeof(struct slot_header);
-    fs->flash->program(
-    		           fs->flash,
-                       slot_addr + slot_h_size,
-                       object,
-					   fs->object_size
-					  );
-
-    (void) object;
-
-    /* Commit write. */
-    _slot_set_status(fs, &fs->write, SLOT_VALID);
-
-    /* Advance the write head. */
-    _loc_advance_slot(fs, &fs->write);
-
-    return 0; // fs->object_size;
+    return 0;
 }
 
-
-void ringfs_erase_sector(ringfs_t * const fs, const int32_t sector2erase)
+int32_t ringfs_cursor_rewind(ringfs_t * const fs, struct ringfs_cursor * const cursor)
 {
-    /* Free the next sector. */
-    _sector_free(fs, sector2erase);
+    (void) fs;
+    cursor->loc = cursor->discarded;
+    return 0;
 }
 
-
-int32_t ringfs_fetch(ringfs_t * const fs, void * const object)
+int32_t ringfs_append_async(ringfs_t * const fs, const void * const object,
+        ringfs_async_callback callback, void *context)
 {
-    /* Advance forward in search of a valid slot. */
-    while (!_loc_equal(&fs->cursor, &fs->write))
-    {
-        uint32_t status;
+    STATS_CALL(fs, APPEND);
 
-        _slot_get_status(fs, &fs->cursor, &status);
+    /* Keep the order with anything still buffered. */
+    if (!_async_ready(fs) || _wbuf_flush(fs) != 0 || _append_prepare(fs) != 0)
+    {
+        return -1;
+    }
 
-        if (status == SLOT_VALID)
-        {
-            fs->flash->read(fs->flash,
-                    _slot_address(fs, &fs->cursor) + (int32_t)sizeof(struct slot_header),
-                    object, fs->object_size);
-            _loc_advance_slot(fs, &fs->cursor);
-            return 0;
-        }
+    fs->async.slot = _slot_address(fs, &fs->write);
+    fs->async.object = (void *)object;
+    fs->async.callback = callback;
+    fs->async.context = context;
+    _key_note(fs, object);
+    STATS_ADD(fs, header_bytes, 2 * sizeof(fs->async.status));
+    STATS_ADD(fs, payload_bytes, fs->object_size);
 
-        _loc_advance_slot(fs, &fs->cursor);
-    }
+    fs->async.status = SLOT_RESERVED;
+    _async_transfer(fs, ASYNC_RESERVE, fs->async.slot, &fs->async.status, sizeof(fs->async.status));
 
-    return -1;
+    return 0;
 }
 
-int32_t ringfs_discard(ringfs_t * const fs)
+int32_t ringfs_fetch_async(ringfs_t * const fs, void * const object,
+        ringfs_async_callback callback, void *context)
 {
-    while (!_loc_equal(&fs->read, &fs->cursor))
+    STATS_CALL(fs, FETCH);
+
+    if (!_async_ready(fs) || _loc_equal(&fs->cursor, &fs->write))
     {
-        _slot_set_status(fs, &fs->read, SLOT_GARBAGE);
-        _loc_advance_slot(fs, &fs->read);
+        return -1;
     }
 
+    fs->async.object = object;
+    fs->async.callback = callback;
+    fs->async.context = context;
+    _async_fetch_next(fs);
+
     return 0;
 }
 
-int32_t ringfs_item_discard(ringfs_t * const fs)
+int32_t ringfs_async_poll(ringfs_t * const fs)
 {
-        _slot_set_status(fs, &fs->read, SLOT_GARBAGE);
-        _loc_advance_slot(fs, &fs->read);
+    while (fs->async.step != ASYNC_IDLE)
+    {
+        if (!fs->async.failed && _async_dma(fs) && fs->flash->transfer_busy(fs->flash))
+        {
+            return 1;
+        }
+        _flash_resume(fs);
 
-    return 0;
-}
+        if (_async_programs(fs))
+        {
+            STATS_CALL(fs, APPEND);
+            STATS_END(fs, PROGRAM, fs->async.start);
+        }
+        else
+        {
+            STATS_CALL(fs, FETCH);
+            STATS_END(fs, READ, fs->async.start);
+        }
+
+        if (fs->async.failed)
+        {
+            if (_async_programs(fs))
+            {
+                /* The slot may be torn: don't program the next object over it. */
+                _slot_set_status(fs, &fs->write, SLOT_GARBAGE);
+                _loc_advance_slot(fs, &fs->write);
+            }
+            _async_finish(fs, -1);
+            continue;
+        }
+
+        fs->async.done += fs->async.chunk;
+        if (fs->async.done < fs->async.size)
+        {
+            _async_chunk(fs);
+            continue;
+        }
+
+        _async_step(fs);
+    }
 
-int32_t ringfs_rewind(ringfs_t * const fs)
-{
-    fs->cursor = fs->read;
     return 0;
 }
 
@@ -580,19 +4170,20 @@ void ringfs_dump(FILE *stream, ringfs_t * const fs)
 
     for (int sector=0; sector<fs->flash->sector_count; sector++)
     {
-        const int32_t addr        = _sector_address(fs, sector);
-        const int32_t sector_size = fs->flash->sector_size;
-        const int32_t offs        = sector_size - (int32_t)sizeof(struct sector_header) + (int32_t)offsetof(struct sector_header, status);
+        const ringfs_addr_t addr        = _sector_address(fs, sector);
+        const int32_t       sector_size = fs->flash->sector_size;
+        const int32_t       offs        = sector_size - (int32_t)sizeof(struct sector_header) + (int32_t)offsetof(struct sector_header, status);
 
         /* Read sector header. */
         struct sector_header header;
-        fs->flash->read(fs->flash, addr+offs, &header, sizeof(header));
+        _flash_read(fs, addr+offs, &header, sizeof(header));
 
         switch (header.status)
         {
             case SECTOR_ERASED:     description = "ERASED";     break;
             case SECTOR_FREE:       description = "FREE";       break;
             case SECTOR_IN_USE:     description = "IN_USE";     break;
+            case SECTOR_CONSUMED:   description = "CONSUMED";   break;
             case SECTOR_ERASING:    description = "ERASING";    break;
             case SECTOR_FORMATTING: description = "FORMATTING"; break;
             default:                description = "UNKNOWN";    break;
@@ -18,6 +18,7 @@ extern "C" {
  * @{
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -25,6 +26,37 @@ extern "C" {
 #define VISUALIZE_SECTORS_AND_SLOTS	1
 #undef VISUALIZE_SECTORS_AND_SLOTS
 
+/**
+ * Flash address, in bytes. 64-bit with RINGFS_LARGE_PARTITIONS defined, for
+ * partitions past 2 GB; the define must then be the same for every file
+ * that includes this header, the flash driver's included.
+ */
+#ifdef RINGFS_LARGE_PARTITIONS
+typedef int64_t ringfs_addr_t;
+#else
+typedef int32_t ringfs_addr_t;
+#endif
+
+
+/**
+ * One range of a vectored program.
+ */
+struct ringfs_iovec
+{
+    ringfs_addr_t address;  /**< Start address, in bytes. */
+    const void *data;       /**< Data to program. */
+    int32_t size;           /**< Size of the range, in bytes. */
+};
+
+/**
+ * One range of a vectored read.
+ */
+struct ringfs_read_iovec
+{
+    ringfs_addr_t address;  /**< Start address, in bytes. */
+    void *  data;           /**< Buffer to read into. */
+    int32_t size;           /**< Size of the range, in bytes. */
+};
 
 /**
  * Flash memory + partition descriptor.
@@ -41,7 +73,7 @@ struct ringfs_flash_partition
      * @param address Any address inside the sector.
      * @returns Zero on success, -1 on failure.
      */
-    int32_t (*sector_erase)(struct ringfs_flash_partition *flash, int32_t address);
+    int32_t (*sector_erase)(struct ringfs_flash_partition *flash, ringfs_addr_t address);
     /**
      * Program flash memory bits by toggling them from 1 to 0.
      * @param address Start address, in bytes.
@@ -49,7 +81,7 @@ struct ringfs_flash_partition
      * @param size Size of data.
      * @returns size on success, -1 on failure.
      */
-    int32_t (*program)(struct ringfs_flash_partition *flash, int32_t address, const void *data, int32_t size);
+    int32_t (*program)(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int32_t size);
     /**
      * Read flash memory.
      * @param address Start address, in bytes.
@@ -57,9 +89,254 @@ struct ringfs_flash_partition
      * @param size Size of data.
      * @returns size on success, -1 on failure.
      */
-    int32_t (*read)(struct ringfs_flash_partition *flash, int32_t address, void *data, int32_t size);
+    int32_t (*read)(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int32_t size);
+
+    /**
+     * Start erasing a sector and return without waiting. Optional, used by
+     * ringfs_erase_begin() together with erase_busy.
+     * @param address Any address inside the sector.
+     * @returns Zero on success, -1 on failure.
+     */
+    int32_t (*erase_start)(struct ringfs_flash_partition *flash, ringfs_addr_t address);
+    /**
+     * Check on an erase started with erase_start. Optional.
+     * @returns Nonzero while the erase is running, zero once it's complete.
+     */
+    int32_t (*erase_busy)(struct ringfs_flash_partition *flash);
+    /**
+     * Suspend a running erase so the chip accepts reads and programs.
+     * Optional; leave NULL if the chip can read and program other sectors
+     * while erasing. Must be provided together with erase_resume.
+     * @returns Zero on success, -1 on failure.
+     */
+    int32_t (*erase_suspend)(struct ringfs_flash_partition *flash);
+    /**
+     * Resume an erase suspended with erase_suspend.
+     * @returns Zero on success, -1 on failure.
+     */
+    int32_t (*erase_resume)(struct ringfs_flash_partition *flash);
+
+    /**
+     * Map flash memory for direct reading, e.g. on memory-mapped or XIP
+     * flash. Optional, used by ringfs_peek().
+     * @param address Start address, in bytes.
+     * @param size Size of the mapped range.
+     * @returns Pointer to the data, or NULL if the range can't be mapped.
+     */
+    const void *(*map)(struct ringfs_flash_partition *flash, ringfs_addr_t address, int32_t size);
+
+    /**
+     * Program several ranges in one go, e.g. as a single queued DMA
+     * transaction. Optional; without it each range goes through program.
+     * Ranges must be programmed in the given order: they may overlap, and
+     * the order is what keeps slot commits crash-safe.
+     * @param iov Ranges to program.
+     * @param count Number of ranges.
+     * @returns Zero on success, -1 on failure.
+     */
+    int32_t (*programv)(struct ringfs_flash_partition *flash, const struct ringfs_iovec *iov, int32_t count);
+    /**
+     * Read several ranges in one go. Optional; without it RingFS issues
+     * separate reads.
+     * @param iov Ranges to read.
+     * @param count Number of ranges.
+     * @returns Zero on success, -1 on failure.
+     */
+    int32_t (*readv)(struct ringfs_flash_partition *flash, const struct ringfs_read_iovec *iov, int32_t count);
+
+    /**
+     * Start programming and return without waiting, e.g. by queueing a DMA
+     * transfer. Optional, used by ringfs_append_async() together with
+     * read_start and transfer_busy. The data stays in place until the
+     * transfer is complete.
+     * @param address Start address, in bytes.
+     * @param data Data to program.
+     * @param size Size of data; never crosses a program page.
+     * @returns Zero on success, -1 on failure.
+     */
+    int32_t (*program_start)(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int32_t size);
+    /**
+     * Start reading and return without waiting. Optional, used by
+     * ringfs_fetch_async().
+     * @param address Start address, in bytes.
+     * @param data Buffer to store read data.
+     * @param size Size of data.
+     * @returns Zero on success, -1 on failure.
+     */
+    int32_t (*read_start)(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int32_t size);
+    /**
+     * Check on a transfer started with program_start or read_start.
+     * Optional.
+     * @returns Nonzero while the transfer is running, zero once it's complete.
+     */
+    int32_t (*transfer_busy)(struct ringfs_flash_partition *flash);
+
+    int32_t page_size;              /**< Program page size, in bytes. Zero if unpaged. RingFS never programs across a page. */
 };
 
+/**
+ * Instance flags, see ringfs_init_ex().
+ */
+enum ringfs_flags
+{
+    RINGFS_LINEAR_SCAN = 0x0001, /**< Let ringfs_scan() check every sector and slot linearly instead of bisecting. */
+    /**
+     * Keep slot states in a 2-bit-per-slot bitmap next to the sector header
+     * instead of a 4-byte header in front of every slot. Fits more slots per
+     * sector and reads the states of 16 slots at once. This is a different
+     * on-flash format: partitions aren't compatible between layouts.
+     */
+    RINGFS_SLOT_BITMAP = 0x0002,
+    /**
+     * Store variable-size records packed back-to-back, each framed with a
+     * 4-byte header holding its length; see ringfs_append_var(). The
+     * object_size given to ringfs_init_ex() becomes the largest record size.
+     * Capacity and count estimates are in bytes rather than objects. Can't
+     * be combined with RINGFS_SLOT_BITMAP; a read buffer only serves
+     * ringfs_peek().
+     */
+    RINGFS_VARIABLE    = 0x0004,
+    /**
+     * Lay slots out so that none crosses a program page (see page_size),
+     * padding the end of each page as needed. Slots bigger than a page start
+     * on a page boundary instead. Then every slot write is one page program.
+     * Requires a page size that divides the sector size; can't be combined
+     * with the other layouts. The on-flash format depends on the page size.
+     */
+    RINGFS_PAGE_ALIGN  = 0x0008,
+    /**
+     * Let one producer task append while one consumer task fetches and
+     * discards, without a lock around the instance. The producer calls
+     * ringfs_append(), ringfs_append_batch(), ringfs_flush() and
+     * ringfs_idle(); the consumer calls ringfs_fetch(), ringfs_discard(),
+     * ringfs_item_discard(), ringfs_rewind() and ringfs_count_estimate().
+     * Everything else needs both sides idle. The flash driver must be safe
+     * to call from both tasks. An overrun moves the consumer's heads the
+     * next time it calls in. The producer never waits: an append that
+     * needs the sector the consumer is reading from fails with -1, and the
+     * next one retries the erase. Needs GCC or Clang atomics, or
+     * RINGFS_ATOMIC_LOAD(p) and RINGFS_ATOMIC_STORE(p, v) defined for the
+     * build as sequentially consistent loads and stores.
+     * Can't be combined with the bitmap or variable-size layouts, and rules
+     * out the sector, count and read buffers, checkpoints, the erase-ahead
+     * pool, statistics and ringfs_peek()/ringfs_advance().
+     */
+    RINGFS_SPSC        = 0x0010,
+    /**
+     * Number every slot with a sequence number, counting up from zero at
+     * ringfs_format(): each object's is one more than the previous one's,
+     * give or take slots torn by a power loss. The number of a sector's
+     * first slot is kept next to its header, which makes ringfs_seek_seq()
+     * a binary search over sectors. Can't be combined with the variable-size
+     * layout or RINGFS_SPSC.
+     */
+    RINGFS_SEQUENCE    = 0x0020,
+    /**
+     * Keep the smallest and largest key (see ringfs_set_key()) of every
+     * sector next to its header, written as the write head moves on to the
+     * next sector. ringfs_query_range() then skips sectors that can't hold
+     * a match. Can't be combined with the variable-size layout or
+     * RINGFS_SPSC.
+     */
+    RINGFS_KEY_RANGE   = 0x0040,
+    /**
+     * Split the partition into groups of about the square root of its
+     * sector count, and mark each group full next to its first sector's
+     * header once the write head leaves it. ringfs_scan() then reads the
+     * first sector of every group and the sectors of the few groups around
+     * the heads instead of every sector: O(sqrt(n)) header reads on
+     * partitions of thousands of sectors. Sectors it doesn't read aren't
+     * checked. Needs at least 3 sectors; can't be combined with RINGFS_SPSC.
+     */
+    RINGFS_SECTOR_GROUPS = 0x0080,
+};
+
+#ifdef RINGFS_STATS
+/** Public calls that flash operations are counted against. */
+enum ringfs_stats_call
+{
+    RINGFS_CALL_OTHER,          /**< Setup, counting and anything else. */
+    RINGFS_CALL_FORMAT,
+    RINGFS_CALL_SCAN,
+    RINGFS_CALL_APPEND,         /**< ringfs_append() and ringfs_append_batch(). */
+    RINGFS_CALL_APPEND_VAR,
+    RINGFS_CALL_FLUSH,          /**< ringfs_flush() and ringfs_idle(). */
+    RINGFS_CALL_FETCH,          /**< ringfs_fetch(), ringfs_peek(), ringfs_advance() and ringfs_export(). */
+    RINGFS_CALL_FETCH_VAR,
+    RINGFS_CALL_DISCARD,        /**< ringfs_discard(), ringfs_item_discard() and exports that discard. */
+    RINGFS_CALL_ERASE,          /**< ringfs_erase_sector(), ringfs_erase_begin(), ringfs_erase_poll() and ringfs_service(). */
+    RINGFS_CALL_COUNT,
+};
+
+/** Flash operation kinds. */
+enum ringfs_stats_op
+{
+    RINGFS_OP_READ,
+    RINGFS_OP_PROGRAM,
+    RINGFS_OP_ERASE,
+    RINGFS_OP_COUNT,
+};
+
+#ifndef RINGFS_STATS_BUCKETS
+/** Number of latency histogram buckets. */
+#define RINGFS_STATS_BUCKETS 16
+#endif
+
+/**
+ * Runtime statistics, compiled in with RINGFS_STATS and attached with
+ * ringfs_set_stats(). Counters only ever grow; clear the structure to reset.
+ */
+struct ringfs_stats
+{
+    /** Driver calls issued, by public call and operation. Vectored calls count once. */
+    uint32_t ops[RINGFS_CALL_COUNT][RINGFS_OP_COUNT];
+    uint32_t fetch_skipped;     /**< Garbage or reserved slots skipped while fetching. */
+    uint32_t scan_skipped;      /**< Garbage or reserved slots skipped by ringfs_scan(). */
+    uint32_t append_erases;     /**< Erases done inline while appending, by any call that appends. */
+    uint32_t header_bytes;      /**< Bytes programmed into slot and record headers. */
+    uint32_t payload_bytes;     /**< Bytes of objects programmed. */
+
+    /**
+     * Optional free-running timestamp source, in any unit. When set, every
+     * flash operation is timed into the histograms below.
+     */
+    uint32_t (*timestamp)(void);
+    /** Bucket n counts operations taking less than 2^n ticks; the last one takes the rest. */
+    uint32_t latency[RINGFS_OP_COUNT][RINGFS_STATS_BUCKETS];
+    uint32_t latency_max[RINGFS_OP_COUNT];  /**< Slowest operation seen, in ticks. */
+};
+#endif
+
+/**
+ * callback definition allowing to erase a sector from a low priority thread
+ */
+typedef void (*tErase_Sector_callback)(const int32_t sector2erase);
+
+struct ringfs;
+
+/**
+ * Completion callback of ringfs_append_async() and ringfs_fetch_async(),
+ * called from ringfs_async_poll().
+ *
+ * @param fs The instance the operation ran on.
+ * @param result Zero on success, -1 on failure (or nothing to fetch).
+ * @param context As passed when the operation was started.
+ */
+typedef void (*ringfs_async_callback)(struct ringfs *fs, int32_t result, void *context);
+
+/**
+ * Sink of ringfs_export(), handed runs of consecutive objects.
+ *
+ * @param context As passed to ringfs_export().
+ * @param objects First object of the run.
+ * @param count Number of objects in the run.
+ * @param stride Distance between the starts of two objects, in bytes: the
+ *               object size in the RINGFS_SLOT_BITMAP layout, where payloads
+ *               are back to back, the slot size otherwise.
+ * @returns Zero to go on, -1 to stop the export before this run.
+ */
+typedef int32_t (*ringfs_export_sink)(void *context, const void *objects, int32_t count, int32_t stride);
+
 /** @private */
 struct ringfs_loc
 {
@@ -67,8 +344,31 @@ struct ringfs_loc
     int32_t slot;
 };
 
-// page cache of 256 bytes contains slot status and cached data bytes
-#define CACHE_SIZE (256-4)
+/** Largest number of ranges RingFS passes to one programv call. */
+#ifndef RINGFS_IOV_MAX
+#define RINGFS_IOV_MAX 8
+#endif
+
+/**
+ * Size of the stack buffer used by ringfs_append_batch() to stage slots, in
+ * bytes. Larger values mean fewer program calls per batch.
+ */
+#ifndef RINGFS_BATCH_CHUNK_SIZE
+#define RINGFS_BATCH_CHUNK_SIZE 64
+#endif
+
+/**
+ * Read position of one more consumer, see ringfs_cursor_open().
+ * Structure fields should not be accessed directly.
+ */
+struct ringfs_cursor
+{
+    struct ringfs_loc loc;          /* Next slot to fetch. */
+    struct ringfs_loc discarded;    /* Everything before is done with. */
+    struct ringfs_cursor *next;
+};
+
+
 /**
  * RingFS instance. Should be initialized with ringfs_init() befure use.
  * Structure fields should not be accessed directly.
@@ -79,16 +379,120 @@ typedef struct ringfs
     struct ringfs_flash_partition *flash;
     uint32_t version;
     int32_t object_size;
+    uint32_t flags;
     /* Cached values. */
     int32_t slots_per_sector;
+    int32_t slot_header_size;
+
+    /* Slot groups of the RINGFS_PAGE_ALIGN layout. */
+    int32_t page_slots;
+    int32_t page_stride;
+
+    /* Last bitmap word read in the RINGFS_SLOT_BITMAP layout. */
+    int32_t bitmap_sector;
+    int32_t bitmap_word;
+    uint8_t bitmap_cache[4];
+
+    /* Last record header read in the RINGFS_VARIABLE layout. */
+    struct ringfs_loc var_loc;
+    uint16_t var_status;
+    uint16_t var_length;
 
     /* Read/write pointers. Modified as needed. */
     struct ringfs_loc read;
     struct ringfs_loc write;
     struct ringfs_loc cursor;
 
-    uint8_t	cache[CACHE_SIZE];
-    int32_t	cache_filling_level;
+    /* Open cursor objects, see ringfs_cursor_open(). */
+    struct ringfs_cursor *cursors;
+
+    /* Optional RAM shadow of the sector status words, see ringfs_set_sector_table(). */
+    uint32_t *sector_table;
+
+    /* Optional write-combining buffer, see ringfs_set_write_buffer(). */
+    uint8_t *wbuf;
+    int32_t wbuf_size;
+    int32_t wbuf_count;
+    uint32_t wbuf_timeout;
+    uint32_t wbuf_age;
+    /* Object being filled by ringfs_append_to_cache(), at the end of wbuf. */
+    uint8_t *cache;
+    int32_t cache_filling_level;
+
+    /* Optional per-sector valid object counts, see ringfs_set_count_table(). */
+    int32_t *count_table;
+    int32_t count_total;
+    int32_t count_cursor;
+    bool count_valid;
+
+    /* Optional read-ahead buffer for ringfs_fetch(), see ringfs_set_read_buffer(). */
+    uint8_t *readahead;
+    int32_t readahead_size;
+    struct ringfs_loc readahead_loc;
+    int32_t readahead_count;
+
+    /* Optional head checkpoint, see ringfs_set_checkpoint(). */
+    int32_t checkpoint_sector;
+    int32_t checkpoint_next;
+
+    /* Erase-ahead pool, see ringfs_set_erase_ahead(). */
+    int32_t erase_ahead;
+    tErase_Sector_callback erase_callback;
+
+    /* Background erase in progress, see ringfs_erase_begin(). */
+    struct {
+        int32_t sector;
+        bool suspended;
+    } erase;
+
+    /* Append or fetch in progress, see ringfs_append_async(). */
+    struct {
+        int32_t step;
+        bool failed;
+        ringfs_addr_t slot;         /* Address of the slot. */
+        void *object;
+        uint32_t status;            /* Slot header programmed or read. */
+        uint8_t *data;              /* Transfer in progress... */
+        ringfs_addr_t address;
+        int32_t size;
+        int32_t done;               /* ...the part of it done... */
+        int32_t chunk;              /* ...and its current piece. */
+        uint32_t start;
+        ringfs_async_callback callback;
+        void *context;
+    } async;
+
+    /* Producer/consumer handoff of the RINGFS_SPSC mode. */
+    struct {
+        int32_t write;              /* Published write head, slots from the partition start. */
+        uint32_t reclaims;          /* Sectors reclaimed by the producer so far... */
+        int32_t first;              /* ...and the sector after the last one. */
+        int32_t pin;                /* Sector the consumer is in, or -1. */
+        int32_t deferred;           /* Producer only: sector reclaimed, erase pending, or -1. */
+        uint32_t seen;              /* Consumer only: reclaims caught up with. */
+        struct ringfs_loc view;     /* Consumer only: write head as last published. */
+    } spsc;
+
+    /* Sequence number of the first slot of a sector, see RINGFS_SEQUENCE. */
+    int32_t seq_sector;
+    uint32_t seq_base;
+
+    /* Sectors per group, see RINGFS_SECTOR_GROUPS. */
+    int32_t group_size;
+
+    /* Key field and the key range of a sector not summarized yet, see ringfs_set_key(). */
+    int32_t key_offset;
+    int32_t key_size;
+    int32_t key_sector;
+    bool key_valid;
+    uint32_t key_min;
+    uint32_t key_max;
+
+#ifdef RINGFS_STATS
+    struct ringfs_stats *stats;
+    enum ringfs_stats_call stats_call;
+    bool stats_appending;
+#endif
 } ringfs_t;
 
 /**
@@ -104,6 +508,166 @@ typedef struct ringfs
  */
 int32_t ringfs_init(ringfs_t * const fs, struct ringfs_flash_partition * const flash, uint32_t version, int32_t object_size);
 
+/**
+ * Initialize a RingFS instance with non-default behaviour.
+ * ringfs_init() is equivalent to ringfs_init_ex() with zero flags.
+ *
+ * @param fs RingFS instance to be initialized.
+ * @param flash Flash memory interface. Must be implemented externally.
+ * @param version Object version.
+ * @param object_size Size of one stored object, in bytes.
+ * @param flags Bitwise OR of enum ringfs_flags values.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_init_ex(ringfs_t * const fs, struct ringfs_flash_partition * const flash, uint32_t version, int32_t object_size, uint32_t flags);
+
+/**
+ * Attach a RAM shadow table of sector states. Once attached, the table is
+ * filled by ringfs_format() or ringfs_scan() and kept in sync with every
+ * sector status change, so ringfs_append() no longer has to read sector
+ * headers from flash. Must be called after ringfs_init() and before
+ * ringfs_format() or ringfs_scan().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param table Caller-provided table, one entry per sector. NULL detaches it.
+ * @param entries Number of entries in the table. Must be at least sector_count.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_set_sector_table(ringfs_t * const fs, uint32_t * const table, int32_t entries);
+
+/**
+ * Attach a write-combining buffer. Appended objects are staged in it as
+ * reserved slot images and programmed together once the run is complete: at
+ * the end of a program page (see page_size), of the sector or of the buffer.
+ * A flush of n objects writes the reserved run in one payload program that
+ * doesn't cross a page boundary (unless one slot straddles two pages), then
+ * commits the slots in order with n 4-byte header programs, as
+ * ringfs_append_batch() does: n + 1 programs on flash, or one plus one
+ * programv call per RINGFS_IOV_MAX commits. A torn flush only leaves
+ * uncommitted slots.
+ *
+ * Buffered objects aren't visible to ringfs_fetch() or the counts, and are
+ * lost on reset, until flushed by ringfs_flush(), ringfs_idle() or any call
+ * that needs the on-flash state (ringfs_append_batch(), ringfs_scan()).
+ * Only available with the default slot layout. Must be called after
+ * ringfs_init().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param buffer Caller-provided buffer. NULL detaches it.
+ * @param size Size of the buffer, at least one slot and one page.
+ * @param flush_timeout Age after which ringfs_idle() flushes buffered objects,
+ *                      in the units given to ringfs_idle(). Zero disables it.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_set_write_buffer(ringfs_t * const fs, void * const buffer, int32_t size, uint32_t flush_timeout);
+
+/**
+ * Program any objects staged in the write buffer.
+ *
+ * @param fs Initialized RingFS instance.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_flush(ringfs_t * const fs);
+
+/**
+ * Flush the write buffer once its oldest object is older than the flush
+ * timeout. Call periodically, e.g. from an idle task or timer tick.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param elapsed Time since the previous call, in caller-defined units.
+ * @returns 1 if the buffer was flushed, 0 if not, -1 on failure.
+ */
+int32_t ringfs_idle(ringfs_t * const fs, uint32_t elapsed);
+
+/**
+ * Attach a RAM table of per-sector valid object counts, making
+ * ringfs_count_exact() O(1). The counts are kept up to date by appends and
+ * discards; after ringfs_scan() (or a sector erased from under the heads)
+ * they're rebuilt by the next ringfs_count_exact(), which then costs one
+ * linear pass. Must be called after ringfs_init().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param table Caller-provided table, one entry per sector. NULL detaches it.
+ * @param entries Number of entries in the table. Must be at least sector_count.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_set_count_table(ringfs_t * const fs, int32_t * const table, int32_t entries);
+
+/**
+ * Attach a read-ahead buffer. ringfs_fetch() then reads a run of slots from
+ * the cursor sector in one flash read and serves the following fetches from
+ * RAM. Slot status changes made by this instance are mirrored into the
+ * buffer, and the buffered run is dropped when its sector is erased. The
+ * buffer also serves ringfs_peek() on flash that can't be mapped.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param buffer Caller-provided buffer. NULL detaches it.
+ * @param size Buffer size, in bytes. Must hold at least one slot
+ *             (object_size + 4 bytes).
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_set_read_buffer(ringfs_t * const fs, void * const buffer, int32_t size);
+
+#ifdef RINGFS_STATS
+/**
+ * Attach a statistics structure. From then on, the flash operations of every
+ * public call are counted against it. Calls made internally by another one
+ * (e.g. ringfs_flush() from ringfs_append()) count against the outer call.
+ * Not available with RINGFS_SPSC: the producer and consumer would update the
+ * counters and the current call from two tasks at once.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param stats Caller-provided structure, cleared or not. NULL detaches it.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_set_stats(ringfs_t * const fs, struct ringfs_stats * const stats);
+#endif
+
+/**
+ * Keep a log of head positions in a spare flash sector, so ringfs_scan() can
+ * mount by validating the last record with a few targeted reads instead of
+ * reading every sector header. A record is written whenever the write head
+ * enters a new sector or the read head leaves one; when the sector fills up
+ * it's erased and the log starts over. ringfs_scan() falls back to a full
+ * scan (and writes a fresh record) if the checkpoint is missing, stale
+ * or corrupt. Must be called before ringfs_format() or ringfs_scan().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param sector Absolute sector number of the checkpoint sector on the flash
+ *               device. Must lie outside the partition. -1 disables it.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_set_checkpoint(ringfs_t * const fs, int32_t sector);
+
+/**
+ * Keep several sectors ahead of the write head erased, so appends don't have
+ * to wait for a sector erase. Whenever the write head enters a new sector,
+ * the sector `sectors` ahead of it is marked for erasure (moving the read
+ * heads out of it) and handed to the callback, if any. The erase is then
+ * done by ringfs_erase_sector() or ringfs_service(), typically from a low
+ * priority task. ringfs_append() only erases inline when the next sector is
+ * still pending. The pool sectors don't hold data, see ringfs_capacity().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param sectors Number of sectors to keep erased. 1 is the default
+ *                behaviour: only the next sector, erased inline.
+ * @param callback Called with each sector handed over for erasure, or NULL.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_set_erase_ahead(ringfs_t * const fs, int32_t sectors, tErase_Sector_callback callback);
+
+/**
+ * Describe the key of RINGFS_KEY_RANGE objects: an unsigned integer in the
+ * host's byte order, e.g. a timestamp, at a fixed place in every object.
+ * Must be called before ringfs_format() or ringfs_scan().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param offset Offset of the key field in the object, in bytes.
+ * @param size Size of the key field: 1, 2 or 4 bytes.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_set_key(ringfs_t * const fs, int32_t offset, int32_t size);
+
 /**
  * Format the flash memory.
  *
@@ -114,6 +678,10 @@ int32_t ringfs_format(ringfs_t * const fs);
 
 /**
  * Scan the flash memory for a valid filesystem.
+ * Mounts from the checkpoint if one is set and valid. Otherwise reads every
+ * sector header (with RINGFS_SECTOR_GROUPS, those of the group leaders and
+ * the groups around the heads), then locates the write and read heads by
+ * bisecting their sectors. RINGFS_LINEAR_SCAN disables these shortcuts.
  *
  * @param fs Initialized RingFS instance.
  * @returns Zero on success, -1 on failure.
@@ -121,7 +689,8 @@ int32_t ringfs_format(ringfs_t * const fs);
 int32_t ringfs_scan(ringfs_t * const fs);
 
 /**
- * Calculate maximum RingFS capacity.
+ * Calculate maximum RingFS capacity. Sectors of the erase-ahead pool don't
+ * count.
  *
  * @param fs Initialized RingFS instance.
  * @returns Maximum capacity on success, -1 on failure.
@@ -130,7 +699,8 @@ int32_t ringfs_capacity(ringfs_t * const fs);
 
 /**
  * Calculate approximate object count.
- * Runs in O(1).
+ * Runs in O(1). With a count table attached, ringfs_count_exact() is O(1)
+ * as well.
  *
  * @param fs Initialized RingFS instance.
  * @returns Estimated object count on success, -1 on failure.
@@ -139,7 +709,8 @@ int32_t ringfs_count_estimate(ringfs_t * const fs);
 
 /**
  * Calculate exact object count.
- * Runs in O(n).
+ * Runs in O(n), or O(1) with a count table (see ringfs_set_count_table()),
+ * except for the first call after ringfs_scan().
  *
  * @param fs Initialized RingFS instance.
  * @returns Exact object count on success, -1 on failure.
@@ -156,13 +727,45 @@ int32_t ringfs_count_exact(ringfs_t * const fs);
 int32_t ringfs_append(ringfs_t * const fs, const void * const object);
 
 /**
- * Append an object at the end of the cache.
+ * Append several objects at the end of the ring. Deletes oldest objects as
+ * needed. Objects sharing a sector are reserved and written with as few
+ * program calls as possible, then committed in order; a power loss can only
+ * leave uncommitted slots, which are skipped like those of ringfs_append().
  *
  * @param fs Initialized RingFS instance.
- * @param object Object to be stored.
- * @param size amount of bytes to store
+ * @param objects Array of count objects to be stored, object_size bytes each.
+ * @param count Number of objects.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_append_batch(ringfs_t * const fs, const void * const objects, int32_t count);
+
+/**
+ * Append a variable-size record. Requires RINGFS_VARIABLE.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Record to be stored.
+ * @param size Record size in bytes, 1 to the maximum given at init.
  * @returns Zero on success, -1 on failure.
  */
+int32_t ringfs_append_var(ringfs_t * const fs, const void * const object, int32_t size);
+
+/**
+ * Append a chunk of bytes at the end of the cache. Chunks are packed into an
+ * object, which is appended once the next chunk doesn't fit; the rest of the
+ * object is left as it was. The object being filled takes the last
+ * object_size bytes of the write buffer, which must be attached first with
+ * ringfs_set_write_buffer() and hold at least one slot more. It's lost on
+ * reset and when the write buffer is attached again.
+ *
+ * @deprecated The chunks aren't framed, so they can't be told apart again,
+ * and the cache is lost on reset. Use RINGFS_VARIABLE with
+ * ringfs_append_var() instead.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Chunk to be stored.
+ * @param size Size of the chunk, at most object_size.
+ * @returns size on success, -1 on failure.
+ */
 int32_t ringfs_append_to_cache(ringfs_t * const fs, const void * const object, int32_t size);
 
 /**
@@ -175,13 +778,57 @@ int32_t ringfs_append_to_cache(ringfs_t * const fs, const void * const object, i
 int32_t ringfs_fetch(ringfs_t * const fs, void * const object);
 
 /**
- * Discard all fetched objects up to the read cursor.
+ * Fetch the next variable-size record at the read cursor. Requires
+ * RINGFS_VARIABLE. The cursor isn't moved if the record doesn't fit.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Buffer to store the retrieved record.
+ * @param size Size of the buffer.
+ * @returns Record size on success, -1 on failure.
+ */
+int32_t ringfs_fetch_var(ringfs_t * const fs, void * const object, int32_t size);
+
+/**
+ * Get a pointer to the next object at the read cursor without copying it.
+ * Points directly into flash if the partition has a map op (and no
+ * background erase is running); otherwise the object is served from the
+ * read buffer (see ringfs_set_read_buffer()). The pointer stays valid until
+ * the next call into RingFS. Doesn't advance the cursor past the object,
+ * see ringfs_advance().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Set to point to the object.
+ * @returns Object size on success, -1 if there's no object or no way to
+ *          serve it.
+ */
+int32_t ringfs_peek(ringfs_t * const fs, const void ** const object);
+
+/**
+ * Advance the read cursor past the next object, like ringfs_fetch() without
+ * copying it.
+ *
+ * @param fs Initialized RingFS instance.
+ * @returns Size of the skipped object, -1 if there's none.
+ */
+int32_t ringfs_advance(ringfs_t * const fs);
+
+/**
+ * Discard all fetched objects up to the read cursor. Sectors consumed in
+ * full are retired with a single header program each; only the slots of the
+ * last, partially consumed sector are marked individually.
  *
  * @param fs Initialized RingFS instance.
  * @returns Zero on success, -1 on failure.
  */
 int32_t ringfs_discard(ringfs_t * const fs);
 
+/**
+ * Discard the oldest object, whether it was fetched or not. The read cursor
+ * is moved along if it pointed to it.
+ *
+ * @param fs Initialized RingFS instance.
+ * @returns Zero on success, -1 if there's nothing to discard.
+ */
 int32_t ringfs_item_discard(ringfs_t * const fs);
 
 /**
@@ -193,18 +840,211 @@ int32_t ringfs_item_discard(ringfs_t * const fs);
 int32_t ringfs_rewind(ringfs_t * const fs);
 
 /**
- * callback definition allowing to erase a sector from a low priority thread
+ * Hand every object from the read head to the write head to a sink, a
+ * sector run at a time instead of an object at a time. Runs point straight
+ * into flash if the partition has a map op (and no background erase is
+ * running); otherwise slots are read in bulk into the read buffer (see
+ * ringfs_set_read_buffer()), or into a RINGFS_BATCH_CHUNK_SIZE stack buffer
+ * without one. Runs are only valid during the sink call, and the sink must
+ * not call into RingFS. Leaves the read cursor alone unless discarding.
+ * Not available with RINGFS_VARIABLE or RINGFS_SPSC.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param sink Called with each run of objects.
+ * @param context Passed to the sink.
+ * @param discard Discard the objects the sink took afterwards, like
+ *                ringfs_discard() does, pulling the read cursor along.
+ * @returns Number of objects the sink took (all of them unless it stopped
+ *          the export), or -1 if there's no buffer a slot fits in.
  */
-typedef void (*tErase_Sector_callback)(const int32_t sector2erase);
+int32_t ringfs_export(ringfs_t * const fs, ringfs_export_sink sink, void * const context, bool discard);
+
+/**
+ * Open a cursor object for one more consumer, starting at the oldest
+ * object. Each open cursor fetches and discards on its own; the read head
+ * follows the cursor furthest behind, so an object is discarded once every
+ * cursor is done with it. ringfs_discard() and ringfs_item_discard() still
+ * move the read head on their own, and pull any cursor behind it along.
+ * Not available with RINGFS_SPSC.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param cursor Cursor to open, owned by the caller until closed.
+ * @returns Zero on success, -1 on failure (also if it's already open).
+ */
+int32_t ringfs_cursor_open(ringfs_t * const fs, struct ringfs_cursor * const cursor);
+
+/**
+ * Close a cursor object. Whatever it held back is given up at the next
+ * discard by another cursor.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param cursor Open cursor.
+ * @returns Zero on success, -1 if the cursor isn't open.
+ */
+int32_t ringfs_cursor_close(ringfs_t * const fs, struct ringfs_cursor * const cursor);
+
+/**
+ * Fetch the next object at a cursor object, like ringfs_fetch().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param cursor Open cursor.
+ * @param object Buffer to store retrieved object into.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_cursor_fetch(ringfs_t * const fs, struct ringfs_cursor * const cursor, void * const object);
+
+/**
+ * Mark everything fetched at a cursor object as done with, and discard what
+ * no other open cursor still needs.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param cursor Open cursor.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_cursor_discard(ringfs_t * const fs, struct ringfs_cursor * const cursor);
+
+/**
+ * Rewind a cursor object back to the last object it didn't discard.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param cursor Open cursor.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_cursor_rewind(ringfs_t * const fs, struct ringfs_cursor * const cursor);
+
+/**
+ * Move the read cursor to the object with a given sequence number, or past
+ * the gap it fell into. Takes a flash read per halving of the sectors in
+ * use. Requires RINGFS_SEQUENCE.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param seq Sequence number, from the read head's up to the write head's.
+ * @returns Zero on success, -1 if the number isn't held (the cursor stays).
+ */
+int32_t ringfs_seek_seq(ringfs_t * const fs, uint32_t seq);
+
+/**
+ * Sequence number of the slot at the read cursor: the next object fetched
+ * has this number or a higher one. Requires RINGFS_SEQUENCE.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param seq Where to store the number.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_tell_seq(ringfs_t * const fs, uint32_t * const seq);
+
+/**
+ * Fetch the next object at the read cursor whose key is within [lo, hi],
+ * advancing the cursor past it. Objects out of range are passed over, and
+ * whole sectors whose key range doesn't overlap [lo, hi] are skipped
+ * without reading their slots. Requires a key, see ringfs_set_key().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param lo Smallest key wanted.
+ * @param hi Largest key wanted.
+ * @param object Buffer to store the object in.
+ * @returns Zero on success, -1 if no more objects match.
+ */
+int32_t ringfs_query_range(ringfs_t * const fs, uint32_t lo, uint32_t hi, void * const object);
 
 /**
  * @brief sector erase for the given sector
  *
+ * With an erase-ahead pool, sectors that aren't pending erasure (anymore)
+ * are left alone.
+ *
  * @param   fs 				pointer to the initialized RingFS instance.
  * @param	sector2erase	sector to be erased
  */
 void ringfs_erase_sector(ringfs_t * const fs, const int32_t sector2erase);
 
+/**
+ * Start erasing a sector in the background. The sector is marked ERASING
+ * first (so a power loss is repaired by ringfs_scan()) and the read heads
+ * are moved out of it. Other sectors stay usable while the erase runs; on
+ * flash providing erase_suspend/erase_resume, every flash access by RingFS
+ * suspends the erase around it. Appends that need the sector wait for the
+ * erase to complete. Falls back to a blocking erase if the flash has no
+ * erase_start/erase_busy ops.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param sector Sector to be erased.
+ * @returns 1 if the erase is running, 0 if it's already complete,
+ *          -1 if another erase is in progress.
+ */
+int32_t ringfs_erase_begin(ringfs_t * const fs, const int32_t sector);
+
+/**
+ * Advance a background erase started with ringfs_erase_begin(). Marks the
+ * sector FREE once the flash reports completion.
+ *
+ * @param fs Initialized RingFS instance.
+ * @returns 1 while the erase is running, 0 once it's complete (or if there
+ *          was none).
+ */
+int32_t ringfs_erase_poll(ringfs_t * const fs);
+
+/**
+ * Erase one pending sector of the erase-ahead pool, if any. Uses a
+ * background erase (see ringfs_erase_begin()) when the flash supports it,
+ * in which case subsequent calls poll it.
+ *
+ * @param fs Initialized RingFS instance.
+ * @returns 1 if work was done or is in progress, 0 if the pool was complete.
+ */
+int32_t ringfs_service(ringfs_t * const fs);
+
+/**
+ * Start appending an object without waiting for the flash. The reserve,
+ * write and commit steps of ringfs_append() are each started in turn by
+ * ringfs_async_poll(), once the one before is complete, so a power loss
+ * leaves the slot as crash-safe as a synchronous append does. Entering a
+ * new sector (freeing the next one) is still done right away, see
+ * ringfs_set_erase_ahead() to keep erases out of it. Without the
+ * program_start, read_start and transfer_busy flash ops, each step is a
+ * synchronous transfer. If a transfer fails, the slot is marked garbage
+ * and skipped, and the callback gets -1.
+ *
+ * Only ringfs_async_poll() may be called until the callback has been.
+ * Not available with RINGFS_SLOT_BITMAP, RINGFS_VARIABLE or RINGFS_SPSC.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Object to be stored; must stay in place until completion.
+ * @param callback Called on completion, or NULL.
+ * @param context Passed to the callback.
+ * @returns Zero if the append was started, -1 on failure.
+ */
+int32_t ringfs_append_async(ringfs_t * const fs, const void * const object,
+        ringfs_async_callback callback, void *context);
+
+/**
+ * Start fetching the next object at the read cursor without waiting for
+ * the flash, see ringfs_append_async(). Doesn't use the read buffer.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Buffer to store the object in; must stay in place until
+ *               completion.
+ * @param callback Called on completion, or NULL. The result is -1 if
+ *                 there turned out to be nothing to fetch.
+ * @param context Passed to the callback.
+ * @returns Zero if the fetch was started, -1 on failure (also if there's
+ *          nothing to fetch).
+ */
+int32_t ringfs_fetch_async(ringfs_t * const fs, void * const object,
+        ringfs_async_callback callback, void *context);
+
+/**
+ * Advance the append or fetch in progress: start its next transfer once
+ * the one before is complete, and call its callback at the end. Call it
+ * from the task that started the operation, e.g. when the driver signals
+ * a transfer completion.
+ *
+ * @param fs Initialized RingFS instance.
+ * @returns 1 while an operation is running, 0 once it's complete (or if
+ *          there was none).
+ */
+int32_t ringfs_async_poll(ringfs_t * const fs);
+
 /**
  * Dump filesystem metadata. For debugging purposes.
  * @param stream File stream to write to.
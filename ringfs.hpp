@@ -0,0 +1,156 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef RINGFS_HPP
+#define RINGFS_HPP
+
+/**
+ * @defgroup ringfs_cxx_api RingFS C++ API
+ * @{
+ *
+ * A typed, header-only wrapper over the C API for a partition whose geometry
+ * is known at compile time. Requires C++17.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+
+#include "ringfs.h"
+
+namespace ringfs_cxx {
+
+/**
+ * Ring of objects of type T on a partition of SectorCount sectors of
+ * SectorSize bytes, in the default slot layout.
+ *
+ * The geometry is checked at compile time, and the figures derived from it
+ * are constants: the counts below cost no division at run time.
+ */
+template <typename T, int32_t SectorSize, int32_t SectorCount>
+class Ring
+{
+    /* On-flash header sizes of the default layout, checked in init(). */
+    static constexpr int32_t sector_header_size = 8;
+    static constexpr int32_t slot_header_size = 4;
+
+    static_assert(std::is_trivially_copyable<T>::value, "objects are stored as raw bytes");
+    static_assert(SectorCount >= 2, "the ring needs at least two sectors");
+    static_assert(SectorSize >= sector_header_size + slot_header_size + (int32_t)sizeof(T),
+                  "an object must fit in a sector");
+
+public:
+    /** Slots in one sector. */
+    static constexpr int32_t slots_per_sector =
+        (SectorSize - sector_header_size) / (slot_header_size + (int32_t)sizeof(T));
+    /** Objects the ring holds, see ringfs_capacity(). */
+    static constexpr int32_t capacity = slots_per_sector * (SectorCount - 1);
+
+    /**
+     * Initialize the instance, see ringfs_init(). Fails if the partition
+     * doesn't have the geometry the ring was declared with.
+     */
+    bool init(ringfs_flash_partition &flash, uint32_t version)
+    {
+        if (flash.sector_size != SectorSize || flash.sector_count != SectorCount)
+        {
+            return false;
+        }
+
+        return ringfs_init(&fs, &flash, version, sizeof(T)) == 0 &&
+               fs.slots_per_sector == slots_per_sector;
+    }
+
+    bool format() { return ringfs_format(&fs) == 0; }
+    bool scan() { return ringfs_scan(&fs) == 0; }
+    bool append(const T &object) { return ringfs_append(&fs, &object) == 0; }
+    bool discard() { return ringfs_discard(&fs) == 0; }
+    bool rewind() { return ringfs_rewind(&fs) == 0; }
+
+    /** Read the object at the cursor and advance past it, see ringfs_fetch(). */
+    std::optional<T> fetch()
+    {
+        T object;
+        if (ringfs_fetch(&fs, &object) != 0)
+        {
+            return std::nullopt;
+        }
+
+        return object;
+    }
+
+    /** See ringfs_count_estimate(). */
+    int32_t count_estimate() const
+    {
+        int32_t sectors = fs.write.sector - fs.read.sector;
+        if (sectors < 0)
+        {
+            sectors += SectorCount;
+        }
+
+        return sectors * slots_per_sector + fs.write.slot - fs.read.slot;
+    }
+
+    /** The underlying instance, for the rest of the C API. */
+    ringfs_t *get() { return &fs; }
+
+    /**
+     * Input iterator fetching from the cursor: a range-for over the ring
+     * reads every object not yet fetched. Doesn't discard anything.
+     */
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        iterator() = default;
+        explicit iterator(Ring *ring) : ring(ring) { ++*this; }
+
+        reference operator*() const { return *object; }
+        pointer operator->() const { return &*object; }
+
+        iterator &operator++()
+        {
+            object = ring->fetch();
+            if (!object)
+            {
+                ring = nullptr;
+            }
+            return *this;
+        }
+
+        bool operator==(const iterator &other) const { return ring == other.ring; }
+        bool operator!=(const iterator &other) const { return ring != other.ring; }
+
+    private:
+        Ring *ring = nullptr;
+        std::optional<T> object;
+    };
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+
+private:
+    ringfs_t fs;
+};
+
+} // namespace ringfs_cxx
+
+/**
+ * @}
+ */
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,275 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/**
+ * @defgroup ringfs_pack_impl RingFS compressed blocks implementation
+ * @details
+ *
+ * A block is one RINGFS_VARIABLE record: a 16-bit object count (native byte
+ * order), then the objects. An object is coded as a word at a time, a short
+ * last word padded with zeros; each word as the difference from the same
+ * word of the previous object in the block (of zero for the first one),
+ * zigzag-mapped so small negative differences stay small, in a varint of 7
+ * bits per byte, least significant first.
+ *
+ * @{
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "ringfs_pack.h"
+
+/** Largest coded size of a word. */
+#define PACK_WORD_MAX 5
+
+static uint32_t _pack_word(const uint8_t * const object, int32_t size, int32_t word)
+{
+    const int32_t offs = word * 4;
+    uint32_t value = 0;
+
+    memcpy(&value, object + offs, (size_t)(size - offs < 4 ? size - offs : 4));
+
+    return value;
+}
+
+static void _pack_put_word(uint8_t * const object, int32_t size, int32_t word, uint32_t value)
+{
+    const int32_t offs = word * 4;
+
+    memcpy(object + offs, &value, (size_t)(size - offs < 4 ? size - offs : 4));
+}
+
+static int32_t _pack_encode(uint8_t *out, uint32_t delta)
+{
+    uint32_t value = (delta << 1) ^ (uint32_t)-(int32_t)(delta >> 31);
+    int32_t length = 0;
+
+    while (value >= 0x80)
+    {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t)value;
+
+    return length;
+}
+
+/** Decode a word difference, without reading past the end of the block. */
+static int32_t _pack_decode(const uint8_t *in, int32_t room, uint32_t * const delta)
+{
+    uint32_t value = 0;
+
+    for (int32_t length = 0; length < room && length < PACK_WORD_MAX; length++)
+    {
+        value |= (uint32_t)(in[length] & 0x7F) << (7 * length);
+        if (!(in[length] & 0x80))
+        {
+            *delta = (value >> 1) ^ (uint32_t)-(int32_t)(value & 1);
+            return length + 1;
+        }
+    }
+
+    return -1;
+}
+
+/** Start staging a new block. */
+static void _pack_begin(ringfs_pack_t * const p)
+{
+    p->used = (int32_t)sizeof(uint16_t);
+    p->count = 0;
+    memset(p->last, 0, (size_t)p->words * 4);
+}
+
+/** Code an object at the end of the staged block, if it fits. */
+static bool _pack_stage(ringfs_pack_t * const p, const void * const object)
+{
+    uint8_t code[PACK_WORD_MAX];
+    int32_t used = p->used;
+
+    for (int32_t word = 0; word < p->words; word++)
+    {
+        const uint32_t value = _pack_word(object, p->object_size, word);
+        const int32_t length = _pack_encode(code, value - p->last[word]);
+
+        if (used + length > p->block_size)
+        {
+            return false;
+        }
+        memcpy(p->block + used, code, (size_t)length);
+        used += length;
+    }
+
+    for (int32_t word = 0; word < p->words; word++)
+    {
+        p->last[word] = _pack_word(object, p->object_size, word);
+    }
+    p->used = used;
+    p->count++;
+
+    return true;
+}
+
+/** Fetch and check the next block in, if any. */
+static bool _pack_next_block(ringfs_pack_t * const p)
+{
+    uint16_t count;
+
+    p->start = p->cursor.loc;
+    if (ringfs_cursor_fetch(p->fs, &p->cursor, p->rblock) != 0)
+    {
+        return false;
+    }
+
+    memcpy(&count, p->rblock, sizeof(count));
+    p->rpos = (int32_t)sizeof(count);
+    p->rleft = count;
+    memset(p->rlast, 0, (size_t)p->words * 4);
+
+    return true;
+}
+
+/**
+ * @}
+ */
+
+int32_t ringfs_pack_init(ringfs_pack_t * const p, ringfs_t * const fs, int32_t object_size, void * const buffer)
+{
+    const int32_t words = (object_size + 3) / 4;
+
+    if (!(fs->flags & RINGFS_VARIABLE) || object_size < 1 ||
+        fs->object_size < (int32_t)sizeof(uint16_t) + words * PACK_WORD_MAX)
+    {
+        return -1;
+    }
+
+    p->fs = fs;
+    p->object_size = object_size;
+    p->words = words;
+    p->block_size = fs->object_size;
+
+    p->block = buffer;
+    p->last = (uint32_t *)(p->block + p->block_size);
+    p->rblock = (uint8_t *)(p->last + words);
+    p->rlast = (uint32_t *)(p->rblock + p->block_size);
+    _pack_begin(p);
+
+    /* Start reading at the read head, again if initialized before. */
+    ringfs_cursor_close(fs, &p->cursor);
+    if (ringfs_cursor_open(fs, &p->cursor) != 0)
+    {
+        return -1;
+    }
+    p->discarded = p->cursor.discarded;
+    p->rleft = 0;
+
+    memset(&p->stats, 0, sizeof(p->stats));
+
+    return 0;
+}
+
+int32_t ringfs_pack_append(ringfs_pack_t * const p, const void * const object)
+{
+    if (_pack_stage(p, object))
+    {
+        return 0;
+    }
+
+    /* Start a new block; the worst case fits an empty one. */
+    if (ringfs_pack_flush(p) != 0)
+    {
+        return -1;
+    }
+    _pack_stage(p, object);
+
+    return 0;
+}
+
+int32_t ringfs_pack_flush(ringfs_pack_t * const p)
+{
+    const uint16_t count = (uint16_t)p->count;
+
+    if (p->count == 0)
+    {
+        return 0;
+    }
+
+    memcpy(p->block, &count, sizeof(count));
+    if (ringfs_append_var(p->fs, p->block, p->used) != 0)
+    {
+        return -1;
+    }
+
+    p->stats.objects += (uint32_t)p->count;
+    p->stats.blocks++;
+    p->stats.raw_bytes += (uint32_t)(p->count * p->object_size);
+    p->stats.packed_bytes += (uint32_t)p->used;
+    _pack_begin(p);
+
+    return 0;
+}
+
+int32_t ringfs_pack_fetch(ringfs_pack_t * const p, void * const object)
+{
+    /* Skip blocks with nothing left to read, empty ones included. */
+    while (p->rleft == 0)
+    {
+        if (!_pack_next_block(p))
+        {
+            return -1;
+        }
+    }
+
+    for (int32_t word = 0; word < p->words; word++)
+    {
+        uint32_t delta;
+        const int32_t length = _pack_decode(p->rblock + p->rpos, p->block_size - p->rpos, &delta);
+
+        if (length < 0)
+        {
+            /* Corrupt block: give up on the rest of it. */
+            p->rleft = 0;
+            return -1;
+        }
+
+        p->rpos += length;
+        p->rlast[word] += delta;
+        _pack_put_word(object, p->object_size, word, p->rlast[word]);
+    }
+    p->rleft--;
+
+    return 0;
+}
+
+int32_t ringfs_pack_discard(ringfs_pack_t * const p)
+{
+    struct ringfs_loc loc = p->cursor.loc;
+    const bool overrun = !(p->cursor.discarded.sector == p->discarded.sector &&
+                           p->cursor.discarded.slot == p->discarded.slot);
+
+    /* Keep a block read only partly, unless the writer has overrun the
+     * cursor (and moved it past the block) meanwhile. */
+    if (p->rleft > 0 && !overrun)
+    {
+        p->cursor.loc = p->start;
+    }
+    const int32_t result = ringfs_cursor_discard(p->fs, &p->cursor);
+    p->cursor.loc = loc;
+    p->discarded = p->cursor.discarded;
+
+    return result;
+}
+
+int32_t ringfs_pack_rewind(ringfs_pack_t * const p)
+{
+    p->rleft = 0;
+
+    return ringfs_cursor_rewind(p->fs, &p->cursor);
+}
+
+/* vim: set ts=4 sw=4 et: */
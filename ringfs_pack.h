@@ -0,0 +1,154 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef RINGFS_PACK_H
+#define RINGFS_PACK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup ringfs_pack_api RingFS compressed blocks
+ * @{
+ *
+ * Fixed-size objects packed into compressed blocks on top of a
+ * RINGFS_VARIABLE instance. Objects are staged in RAM and written a block
+ * at a time, each 32-bit word stored as the zigzag varint of its difference
+ * from the same word of the object before: counters, timestamps and slowly
+ * changing readings shrink to a byte or two. No allocation: the caller
+ * provides the staging and decoding buffers.
+ */
+
+#include <stdint.h>
+
+#include "ringfs.h"
+
+/**
+ * Size of the buffer backing a pack of @p object_size byte objects on an
+ * instance whose largest record is @p block_size bytes.
+ */
+#define RINGFS_PACK_BUFFER_SIZE(block_size, object_size) \
+    (2 * ((block_size) + ((object_size) + 3) / 4 * 4))
+
+/**
+ * Compression counters.
+ */
+struct ringfs_pack_stats
+{
+    uint32_t objects;       /**< Objects written in blocks. */
+    uint32_t blocks;        /**< Blocks written. */
+    uint32_t raw_bytes;     /**< Size of those objects, uncompressed. */
+    uint32_t packed_bytes;  /**< Size of those blocks. */
+};
+
+/**
+ * Compressed block stream. Should be initialized with ringfs_pack_init()
+ * before use. Structure fields other than stats should not be accessed
+ * directly.
+ */
+typedef struct ringfs_pack
+{
+    ringfs_t *fs;
+    int32_t object_size;
+    int32_t words;
+    int32_t block_size;
+
+    /* Block being staged, and the last object staged in it. */
+    uint8_t *block;
+    uint32_t *last;
+    int32_t used;
+    int32_t count;
+
+    /* Block being read: where it starts, where the next object's code is,
+     * the objects left and the last one decoded. The cursor's discard
+     * position as last seen tells an overrun. */
+    struct ringfs_cursor cursor;
+    struct ringfs_loc start;
+    struct ringfs_loc discarded;
+    uint8_t *rblock;
+    uint32_t *rlast;
+    int32_t rpos;
+    int32_t rleft;
+
+    struct ringfs_pack_stats stats;
+} ringfs_pack_t;
+
+/**
+ * Initialize a compressed block stream. It reads with a cursor of its own
+ * (see ringfs_cursor_open()), so the instance's read head follows
+ * ringfs_pack_discard(). Call ringfs_pack_init() again after
+ * ringfs_format() or ringfs_scan().
+ *
+ * @param p Stream to be initialized.
+ * @param fs Initialized RINGFS_VARIABLE instance, formatted or scanned. Its
+ *           object size is the block size: it must hold at least one
+ *           object in the worst case, 2 + 5 bytes per 4 bytes of object.
+ * @param object_size Size of an object, in bytes.
+ * @param buffer Stream storage, RINGFS_PACK_BUFFER_SIZE(fs->object_size,
+ *               object_size) bytes, 4-byte aligned.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_pack_init(ringfs_pack_t * const p, ringfs_t * const fs, int32_t object_size, void * const buffer);
+
+/**
+ * Stage an object, writing out the staged block first if the object doesn't
+ * fit in it anymore. Objects still staged are lost on a power loss.
+ *
+ * @param p Initialized stream.
+ * @param object Object of the stream's object size.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_pack_append(ringfs_pack_t * const p, const void * const object);
+
+/**
+ * Write out the staged block, if any.
+ *
+ * @param p Initialized stream.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_pack_flush(ringfs_pack_t * const p);
+
+/**
+ * Fetch the next object written out, decoding a block at a time.
+ *
+ * @param p Initialized stream.
+ * @param object Buffer to store the object in.
+ * @returns Zero on success, -1 if there are no more objects (or a block
+ *          is corrupt).
+ */
+int32_t ringfs_pack_fetch(ringfs_pack_t * const p, void * const object);
+
+/**
+ * Discard the blocks fetched so far. A block fetched only partly stays
+ * whole: after ringfs_pack_rewind(), its first objects are fetched again.
+ *
+ * @param p Initialized stream.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_pack_discard(ringfs_pack_t * const p);
+
+/**
+ * Go back to the oldest object not discarded.
+ *
+ * @param p Initialized stream.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_pack_rewind(ringfs_pack_t * const p);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/**
+ * @defgroup ringfs_queue_impl RingFS staging queue implementation
+ * @details
+ *
+ * A bounded queue where every entry carries a sequence number. An entry at
+ * position pos is free when its number equals pos, holds an object when it
+ * equals pos+1, and is free again for the next lap at pos+capacity. Pushes
+ * and evictions claim positions by compare-and-swap on head and tail; the
+ * flusher claims a whole run of published entries at once, commits it
+ * straight from the queue storage and only then frees the entries.
+ *
+ * @{
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "ringfs_queue.h"
+
+#define QUEUE_LOAD(p)           __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define QUEUE_STORE(p, v)       __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define QUEUE_CLAIM(p, old, v)  __atomic_compare_exchange_n((p), (old), (v), false, \
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define QUEUE_COUNT(q, field)   __atomic_fetch_add(&(q)->stats.field, 1, __ATOMIC_RELAXED)
+
+static uint8_t *_queue_entry(ringfs_queue_t * const q, uint32_t pos)
+{
+    return q->data + (pos & q->mask) * (uint32_t)q->fs->object_size;
+}
+
+/**
+ * Evict the oldest entry to free the one a push at pos needs. Only done if
+ * that is the entry at the tail and it's published: while the flusher holds
+ * it, evicting newer ones wouldn't free it.
+ */
+static bool _queue_drop(ringfs_queue_t * const q, uint32_t pos)
+{
+    uint32_t oldest = pos - (q->mask + 1);
+    const uint32_t seq = QUEUE_LOAD(&q->seq[pos & q->mask]);
+
+    if (seq != oldest + 1)
+    {
+        /* Freed meanwhile, or still being pushed. */
+        return seq == pos;
+    }
+    if (!QUEUE_CLAIM(&q->tail, &oldest, oldest + 1))
+    {
+        /* Claimed by the flusher, or evicted by another producer. */
+        return false;
+    }
+
+    QUEUE_STORE(&q->seq[pos & q->mask], pos);
+    QUEUE_COUNT(q, dropped);
+    return true;
+}
+
+static void _queue_high_water(ringfs_queue_t * const q, uint32_t depth)
+{
+    uint32_t high = QUEUE_LOAD(&q->stats.high_water);
+
+    while (depth > high && !QUEUE_CLAIM(&q->stats.high_water, &high, depth))
+    {
+    }
+}
+
+/** Claim, commit and free up to max published entries. */
+static int32_t _queue_drain(ringfs_queue_t * const q, int32_t max)
+{
+    int32_t total = 0;
+
+    while (total < max)
+    {
+        uint32_t pos = QUEUE_LOAD(&q->tail);
+        uint32_t count;
+
+        /* Published entries up to the end of the storage, so the run is
+         * contiguous. Retry if a producer evicted the oldest meanwhile. */
+        do
+        {
+            const uint32_t room = q->mask + 1 - (pos & q->mask);
+            count = 0;
+            while (count < room && (int32_t)count < max - total &&
+                   QUEUE_LOAD(&q->seq[(pos + count) & q->mask]) == pos + count + 1)
+            {
+                count++;
+            }
+        } while (count > 0 && !QUEUE_CLAIM(&q->tail, &pos, pos + count));
+
+        if (count == 0)
+        {
+            break;
+        }
+
+        const int32_t result = ringfs_append_batch(q->fs, _queue_entry(q, pos), (int32_t)count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            QUEUE_STORE(&q->seq[(pos + i) & q->mask], pos + i + q->mask + 1);
+        }
+        if (result != 0)
+        {
+            return -1;
+        }
+
+        QUEUE_COUNT(q, commits);
+        __atomic_fetch_add(&q->stats.committed, count, __ATOMIC_RELAXED);
+        total += (int32_t)count;
+    }
+
+    return total;
+}
+
+/**
+ * @}
+ */
+
+int32_t ringfs_queue_init(ringfs_queue_t * const q, ringfs_t * const fs, void * const buffer,
+        int32_t capacity, uint32_t flags)
+{
+    if (capacity < 1 || (capacity & (capacity - 1)) != 0)
+    {
+        return -1;
+    }
+
+    q->fs = fs;
+    q->flags = flags;
+    q->mask = (uint32_t)capacity - 1;
+    q->seq = buffer;
+    q->data = (uint8_t *)buffer + (uint32_t)capacity * sizeof(uint32_t);
+
+    q->head = 0;
+    q->tail = 0;
+    q->busy = 0;
+    for (uint32_t pos = 0; pos <= q->mask; pos++)
+    {
+        q->seq[pos] = pos;
+    }
+
+    memset(&q->stats, 0, sizeof(q->stats));
+
+    return 0;
+}
+
+int32_t ringfs_queue_push(ringfs_queue_t * const q, const void * const object)
+{
+    uint32_t pos = QUEUE_LOAD(&q->head);
+
+    for (;;)
+    {
+        const uint32_t seq = QUEUE_LOAD(&q->seq[pos & q->mask]);
+        const int32_t diff = (int32_t)(seq - pos);
+
+        if (diff == 0)
+        {
+            if (QUEUE_CLAIM(&q->head, &pos, pos + 1))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* Full: the entry still holds last lap's object. */
+            if (!(q->flags & RINGFS_QUEUE_DROP_OLDEST) || !_queue_drop(q, pos))
+            {
+                QUEUE_COUNT(q, rejected);
+                return -1;
+            }
+            pos = QUEUE_LOAD(&q->head);
+        }
+        else
+        {
+            pos = QUEUE_LOAD(&q->head);
+        }
+    }
+
+    memcpy(_queue_entry(q, pos), object, (size_t)q->fs->object_size);
+    QUEUE_STORE(&q->seq[pos & q->mask], pos + 1);
+
+    QUEUE_COUNT(q, pushed);
+    _queue_high_water(q, pos + 1 - QUEUE_LOAD(&q->tail));
+
+    return 0;
+}
+
+int32_t ringfs_queue_depth(ringfs_queue_t * const q)
+{
+    return (int32_t)(QUEUE_LOAD(&q->head) - QUEUE_LOAD(&q->tail));
+}
+
+int32_t ringfs_queue_flush(ringfs_queue_t * const q, int32_t max)
+{
+    uint32_t idle = 0;
+
+    if (!QUEUE_CLAIM(&q->busy, &idle, 1))
+    {
+        return -1;
+    }
+
+    const int32_t result = _queue_drain(q, max);
+    QUEUE_STORE(&q->busy, 0);
+
+    return result;
+}
+
+int32_t ringfs_queue_emergency_flush(ringfs_queue_t * const q)
+{
+    uint32_t idle = 0;
+
+    /* Interrupted a drain: the filesystem is mid-append. */
+    if (!QUEUE_CLAIM(&q->busy, &idle, 1))
+    {
+        return -1;
+    }
+
+    int32_t result = _queue_drain(q, INT32_MAX);
+    if (result >= 0 && ringfs_flush(q->fs) != 0)
+    {
+        result = -1;
+    }
+    QUEUE_STORE(&q->busy, 0);
+
+    return result;
+}
+
+/* vim: set ts=4 sw=4 et: */
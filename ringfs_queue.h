@@ -0,0 +1,155 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef RINGFS_QUEUE_H
+#define RINGFS_QUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup ringfs_queue_api RingFS staging queue
+ * @{
+ *
+ * A fixed-size RAM queue in front of a RingFS instance. Any number of
+ * producers (tasks, interrupt handlers) push objects into it without
+ * locking and without touching flash; a single flusher drains it into the
+ * filesystem with ringfs_append_batch(), many objects per commit.
+ */
+
+#include <stdint.h>
+
+#include "ringfs.h"
+
+/**
+ * Size of the buffer backing a queue of @p capacity objects of
+ * @p object_size bytes each.
+ */
+#define RINGFS_QUEUE_BUFFER_SIZE(capacity, object_size) \
+    ((capacity) * (sizeof(uint32_t) + (object_size)))
+
+/**
+ * Queue flags, see ringfs_queue_init().
+ */
+enum ringfs_queue_flags
+{
+    /**
+     * On overflow, evict the oldest object to make room instead of rejecting
+     * the new one. Objects the flusher is already committing can't be
+     * evicted: while it holds the oldest one, the new object is rejected
+     * and nothing is dropped.
+     */
+    RINGFS_QUEUE_DROP_OLDEST = 0x0001,
+};
+
+/**
+ * Backpressure counters. Updated atomically; read them at any time.
+ */
+struct ringfs_queue_stats
+{
+    uint32_t pushed;        /**< Objects accepted by ringfs_queue_push(). */
+    uint32_t dropped;       /**< Objects evicted to make room (RINGFS_QUEUE_DROP_OLDEST). */
+    uint32_t rejected;      /**< Objects turned away because the queue was full. */
+    uint32_t high_water;    /**< Largest number of objects queued at once. */
+    uint32_t commits;       /**< ringfs_append_batch() calls made by the flusher. */
+    uint32_t committed;     /**< Objects handed to the filesystem. */
+};
+
+/**
+ * RingFS staging queue. Should be initialized with ringfs_queue_init()
+ * before use. Structure fields other than stats should not be accessed
+ * directly.
+ */
+typedef struct ringfs_queue
+{
+    ringfs_t *fs;
+    uint32_t flags;
+    uint32_t mask;
+    /* Per-entry sequence numbers, followed by the entries themselves. */
+    uint32_t *seq;
+    uint8_t *data;
+
+    /* Positions of the next push and the oldest entry, wrapping freely. */
+    uint32_t head;
+    uint32_t tail;
+    /* Set while an entry drain is in progress. */
+    uint32_t busy;
+
+    struct ringfs_queue_stats stats;
+} ringfs_queue_t;
+
+/**
+ * Initialize a staging queue.
+ *
+ * @param q Queue to be initialized.
+ * @param fs Initialized RingFS instance to drain into. Only the flusher may
+ *           use it while the queue is in use.
+ * @param buffer Queue storage, RINGFS_QUEUE_BUFFER_SIZE(capacity,
+ *               fs->object_size) bytes, 4-byte aligned.
+ * @param capacity Number of objects the queue holds; must be a power of two.
+ * @param flags Any combination of ringfs_queue_flags.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_queue_init(ringfs_queue_t * const q, ringfs_t * const fs, void * const buffer,
+        int32_t capacity, uint32_t flags);
+
+/**
+ * Queue an object. Lock-free and never touches flash, so it's safe from
+ * interrupt handlers and any number of tasks at once.
+ *
+ * @param q Initialized queue.
+ * @param object Object of the filesystem's object size.
+ * @returns Zero on success, -1 if the queue was full.
+ */
+int32_t ringfs_queue_push(ringfs_queue_t * const q, const void * const object);
+
+/**
+ * Number of objects queued, including any being committed. Approximate
+ * while producers or the flusher are running.
+ *
+ * @param q Initialized queue.
+ * @returns Number of objects.
+ */
+int32_t ringfs_queue_depth(ringfs_queue_t * const q);
+
+/**
+ * Commit queued objects to the filesystem, oldest first, in as few batch
+ * appends as the queue's wraparound allows. Only one flusher may run at a
+ * time.
+ *
+ * @param q Initialized queue.
+ * @param max Largest number of objects to commit.
+ * @returns Number of objects committed, or -1 on failure (also if another
+ *          drain is in progress).
+ */
+int32_t ringfs_queue_flush(ringfs_queue_t * const q, int32_t max);
+
+/**
+ * Commit everything queued so far and flush the filesystem's write buffer,
+ * for fault handlers that are about to reset. Fails rather than waits if it
+ * interrupted the flusher in the middle of a drain: the filesystem is then
+ * in an unknown state. Objects still being pushed by interrupted producers
+ * are left behind.
+ *
+ * @param q Initialized queue.
+ * @returns Number of objects committed, or -1 on failure.
+ */
+int32_t ringfs_queue_emergency_flush(ringfs_queue_t * const q);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,291 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/**
+ * @defgroup ringfs_stripe_impl RingFS striped partitions implementation
+ * @details
+ *
+ * Logical sector s of the combined partition is sector s / count of device
+ * s % count. Accesses are split at sector boundaries, so that each piece
+ * goes to one device.
+ *
+ * @{
+ */
+
+#include "ringfs_stripe.h"
+
+static ringfs_stripe_t *_stripe(struct ringfs_flash_partition *flash)
+{
+    return flash->user_data;
+}
+
+/**
+ * Find the device holding an address, and the address on it. Suspends the
+ * device's background erase first if RingFS asked for it.
+ */
+static int32_t _stripe_route(ringfs_stripe_t * const stripe, ringfs_addr_t address, ringfs_addr_t * const device_address)
+{
+    const int32_t sector_size = stripe->flash.sector_size;
+    const int32_t sector = (int32_t)(address / sector_size);
+    const int32_t device = sector % stripe->count;
+    struct ringfs_flash_partition * const flash = stripe->devices[device];
+
+    *device_address = ((ringfs_addr_t)flash->sector_offset + sector / stripe->count) * sector_size +
+                      address % sector_size;
+
+    if (device == stripe->erasing && stripe->suspend && !stripe->suspended)
+    {
+        flash->erase_suspend(flash);
+        stripe->suspended = true;
+    }
+
+    return device;
+}
+
+/** Size of the piece of an access that stays in the sector it starts in. */
+static int32_t _stripe_piece(ringfs_stripe_t * const stripe, ringfs_addr_t address, int32_t size)
+{
+    const int32_t room = stripe->flash.sector_size - (int32_t)(address % stripe->flash.sector_size);
+
+    return size < room ? size : room;
+}
+
+static int32_t _stripe_sector_erase(struct ringfs_flash_partition *flash, ringfs_addr_t address)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+    ringfs_addr_t device_address;
+    struct ringfs_flash_partition * const device = stripe->devices[_stripe_route(stripe, address, &device_address)];
+
+    return device->sector_erase(device, device_address);
+}
+
+static int32_t _stripe_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int32_t size)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+    const uint8_t *bytes = data;
+
+    for (int32_t done = 0; done < size; )
+    {
+        const int32_t piece = _stripe_piece(stripe, address + done, size - done);
+        ringfs_addr_t device_address;
+        struct ringfs_flash_partition * const device =
+            stripe->devices[_stripe_route(stripe, address + done, &device_address)];
+
+        if (device->program(device, device_address, bytes + done, piece) < 0)
+        {
+            return -1;
+        }
+        done += piece;
+    }
+
+    return size;
+}
+
+static int32_t _stripe_read(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int32_t size)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+    uint8_t *bytes = data;
+
+    for (int32_t done = 0; done < size; )
+    {
+        const int32_t piece = _stripe_piece(stripe, address + done, size - done);
+        ringfs_addr_t device_address;
+        struct ringfs_flash_partition * const device =
+            stripe->devices[_stripe_route(stripe, address + done, &device_address)];
+
+        if (device->read(device, device_address, bytes + done, piece) < 0)
+        {
+            return -1;
+        }
+        done += piece;
+    }
+
+    return size;
+}
+
+static int32_t _stripe_erase_start(struct ringfs_flash_partition *flash, ringfs_addr_t address)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+    ringfs_addr_t device_address;
+    const int32_t device = _stripe_route(stripe, address, &device_address);
+
+    stripe->erasing = device;
+    stripe->suspend = false;
+    stripe->suspended = false;
+
+    return stripe->devices[device]->erase_start(stripe->devices[device], device_address);
+}
+
+static int32_t _stripe_erase_busy(struct ringfs_flash_partition *flash)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+
+    if (stripe->erasing < 0)
+    {
+        return 0;
+    }
+
+    struct ringfs_flash_partition * const device = stripe->devices[stripe->erasing];
+    const int32_t busy = device->erase_busy(device);
+    if (!busy)
+    {
+        stripe->erasing = -1;
+    }
+
+    return busy;
+}
+
+/** Only note the request: the erasing device is suspended when it's accessed. */
+static int32_t _stripe_erase_suspend(struct ringfs_flash_partition *flash)
+{
+    _stripe(flash)->suspend = true;
+
+    return 0;
+}
+
+static int32_t _stripe_erase_resume(struct ringfs_flash_partition *flash)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+    int32_t result = 0;
+
+    if (stripe->suspended)
+    {
+        struct ringfs_flash_partition * const device = stripe->devices[stripe->erasing];
+        result = device->erase_resume(device);
+    }
+    stripe->suspend = false;
+    stripe->suspended = false;
+
+    return result;
+}
+
+static const void *_stripe_map(struct ringfs_flash_partition *flash, ringfs_addr_t address, int32_t size)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+    ringfs_addr_t device_address;
+
+    if (_stripe_piece(stripe, address, size) < size)
+    {
+        return NULL;
+    }
+
+    struct ringfs_flash_partition * const device = stripe->devices[_stripe_route(stripe, address, &device_address)];
+    return device->map(device, device_address, size);
+}
+
+/* RingFS never starts a transfer across a sector, see ringfs_append_async(). */
+static int32_t _stripe_program_start(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int32_t size)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+    ringfs_addr_t device_address;
+
+    stripe->transfer = _stripe_route(stripe, address, &device_address);
+
+    struct ringfs_flash_partition * const device = stripe->devices[stripe->transfer];
+    return device->program_start(device, device_address, data, size);
+}
+
+static int32_t _stripe_read_start(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int32_t size)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+    ringfs_addr_t device_address;
+
+    stripe->transfer = _stripe_route(stripe, address, &device_address);
+
+    struct ringfs_flash_partition * const device = stripe->devices[stripe->transfer];
+    return device->read_start(device, device_address, data, size);
+}
+
+static int32_t _stripe_transfer_busy(struct ringfs_flash_partition *flash)
+{
+    ringfs_stripe_t * const stripe = _stripe(flash);
+
+    if (stripe->transfer < 0)
+    {
+        return 0;
+    }
+
+    struct ringfs_flash_partition * const device = stripe->devices[stripe->transfer];
+    return device->transfer_busy(device);
+}
+
+/**
+ * @}
+ */
+
+int32_t ringfs_stripe_init(ringfs_stripe_t * const stripe, struct ringfs_flash_partition * const *devices,
+        int32_t count)
+{
+    if (count < 1)
+    {
+        return -1;
+    }
+
+    /* Optional ops are only provided if every device has them. */
+    bool erase_start = true, erase_suspend = true, map = true, transfers = true;
+    for (int32_t device = 0; device < count; device++)
+    {
+        const struct ringfs_flash_partition * const flash = devices[device];
+
+        if (flash->sector_size != devices[0]->sector_size ||
+            flash->sector_count != devices[0]->sector_count ||
+            flash->page_size != devices[0]->page_size)
+        {
+            return -1;
+        }
+
+        erase_start   = erase_start && flash->erase_start && flash->erase_busy;
+        erase_suspend = erase_suspend && flash->erase_suspend && flash->erase_resume;
+        map           = map && flash->map;
+        transfers     = transfers && flash->program_start && flash->read_start && flash->transfer_busy;
+    }
+
+    stripe->devices = devices;
+    stripe->count = count;
+    stripe->erasing = -1;
+    stripe->suspend = false;
+    stripe->suspended = false;
+    stripe->transfer = -1;
+
+    stripe->flash = (struct ringfs_flash_partition) {
+        .sector_size = devices[0]->sector_size,
+        .sector_offset = 0,
+        .sector_count = devices[0]->sector_count * count,
+        .page_size = devices[0]->page_size,
+        .user_data = stripe,
+
+        .sector_erase = _stripe_sector_erase,
+        .program = _stripe_program,
+        .read = _stripe_read,
+    };
+
+    if (erase_start)
+    {
+        stripe->flash.erase_start = _stripe_erase_start;
+        stripe->flash.erase_busy = _stripe_erase_busy;
+    }
+    if (erase_suspend)
+    {
+        stripe->flash.erase_suspend = _stripe_erase_suspend;
+        stripe->flash.erase_resume = _stripe_erase_resume;
+    }
+    if (map)
+    {
+        stripe->flash.map = _stripe_map;
+    }
+    if (transfers)
+    {
+        stripe->flash.program_start = _stripe_program_start;
+        stripe->flash.read_start = _stripe_read_start;
+        stripe->flash.transfer_busy = _stripe_transfer_busy;
+    }
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
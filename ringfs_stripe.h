@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef RINGFS_STRIPE_H
+#define RINGFS_STRIPE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup ringfs_stripe_api RingFS striped partitions
+ * @{
+ *
+ * One partition made of several identical flash devices, with logical
+ * sectors taken from each device in turn: sector 0 from the first, sector 1
+ * from the second and so on. Consecutive sectors are then on different
+ * chips, so an erase ahead of the write head runs on one while appends go
+ * to another. Sector headers stay in their sectors, so ringfs_scan() finds
+ * the order across devices as it does on one.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ringfs.h"
+
+/**
+ * Striped partition. Should be initialized with ringfs_stripe_init()
+ * before use. Structure fields other than flash should not be accessed
+ * directly.
+ */
+typedef struct ringfs_stripe
+{
+    /** The combined partition, to be passed to ringfs_init(). */
+    struct ringfs_flash_partition flash;
+
+    struct ringfs_flash_partition * const *devices;
+    int32_t count;
+
+    /* Device running a background erase, or -1, and whether RingFS asked
+     * for it to be suspended and it actually was. */
+    int32_t erasing;
+    bool suspend;
+    bool suspended;
+
+    /* Device running an asynchronous transfer. */
+    int32_t transfer;
+} ringfs_stripe_t;
+
+/**
+ * Initialize a striped partition. Its ops are filled in from the devices':
+ * an optional op is only provided if every device provides it. Background
+ * erase suspension only stops the device that's erasing, and only when
+ * RingFS accesses that device.
+ *
+ * @param stripe Striped partition to be initialized.
+ * @param devices Device partitions, all with the same sector size, sector
+ *                count and page size. The array must stay in place.
+ * @param count Number of devices.
+ * @returns Zero on success, -1 on failure.
+ */
+int32_t ringfs_stripe_init(ringfs_stripe_t * const stripe, struct ringfs_flash_partition * const *devices,
+        int32_t count);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,265 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * RingFS benchmark. Runs the usual workload against a RAM-backed flash
+ * simulator with modeled operation costs, for a few geometries, object sizes
+ * and layouts. Rates and latencies are modeled flash time, not CPU time.
+ *
+ * A soak run follows: lots of appends and discards, reporting wall-clock
+ * throughput, write amplification and sector wear.
+ *
+ * Usage: tests/bench [erase_us [program_us [read_setup_us [read_ns_per_byte]]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "ringfs.h"
+#include "flashsim.h"
+
+#define SOAK_APPENDS 1000000
+
+/* Typical SPI NOR: 4 KiB erase, 256-byte page program, fast read. */
+static struct flashsim_timing timing = {
+    .erase_us = 45000,
+    .program_us = 700,
+    .read_setup_us = 1,
+    .read_ns_per_byte = 20,
+    .page_size = 256,
+};
+
+static const struct geometry {
+    const char *name;
+    int sector_size;
+    int sector_count;
+} geometries[] = {
+    { "4Kx16",   4096, 16 },
+    { "4Kx64",   4096, 64 },
+    { "64Kx4",  65536,  4 },
+};
+
+static const int object_sizes[] = { 4, 16, 64, 250 };
+
+static const struct layout {
+    const char *name;
+    uint32_t flags;
+    int write_buffer;
+} layouts[] = {
+    { "header", 0,                  0 },
+    { "bitmap", RINGFS_SLOT_BITMAP, 0 },
+    { "paged",  RINGFS_PAGE_ALIGN,  0 },
+    { "wbuf",   0,                  1 },
+};
+
+static struct flashsim *sim;
+
+static int op_sector_erase(struct ringfs_flash_partition *flash, ringfs_addr_t address)
+{
+    (void) flash;
+    flashsim_sector_erase(sim, address);
+    return 0;
+}
+
+static int op_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    (void) flash;
+    flashsim_program(sim, address, data, size);
+    return size;
+}
+
+static int op_read(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int size)
+{
+    (void) flash;
+    flashsim_read(sim, address, data, size);
+    return size;
+}
+
+static double per(long long value, long count)
+{
+    return count ? (double) value / count : 0;
+}
+
+static double rate(long count, long long ns)
+{
+    return ns ? count * 1e9 / ns : 0;
+}
+
+static int export_sink(void *context, const void *objects, int count, int stride)
+{
+    (void) objects;
+    (void) stride;
+    *(long *) context += count;
+    return 0;
+}
+
+static void bench(const struct geometry *geometry, int object_size, const struct layout *layout)
+{
+    static uint8_t wbuf[4096], rbuf[4096];
+    uint8_t object[256];
+
+    struct ringfs_flash_partition flash = {
+        .sector_size = geometry->sector_size,
+        .sector_offset = 0,
+        .sector_count = geometry->sector_count,
+        .page_size = timing.page_size,
+
+        .sector_erase = op_sector_erase,
+        .program = op_program,
+        .read = op_read,
+    };
+
+    struct ringfs fs;
+    if (ringfs_init_ex(&fs, &flash, 0x42, object_size, layout->flags) != 0)
+        return;
+    if (layout->write_buffer &&
+        ringfs_set_write_buffer(&fs, wbuf, timing.page_size, 0) != 0)
+        return;
+    ringfs_format(&fs);
+
+    /* Wrap around a couple of sectors so erases show up in the worst case. */
+    const long appends = ringfs_capacity(&fs) + 2 * fs.slots_per_sector;
+    long long worst = 0;
+    flashsim_reset_stats(sim);
+    for (long i = 0; i < appends; i++) {
+        memset(object, (int) i, sizeof(object));
+        const long long before = sim->stats.elapsed_ns;
+        assert(ringfs_append(&fs, object) == 0);
+        if (sim->stats.elapsed_ns - before > worst)
+            worst = sim->stats.elapsed_ns - before;
+    }
+    assert(ringfs_flush(&fs) == 0);
+    const struct flashsim_stats append = sim->stats;
+
+    flashsim_reset_stats(sim);
+    long fetches = 0;
+    while (ringfs_fetch(&fs, object) == 0)
+        fetches++;
+    const struct flashsim_stats fetch = sim->stats;
+
+    flashsim_reset_stats(sim);
+    long exports = 0;
+    assert(ringfs_rewind(&fs) == 0);
+    assert(ringfs_set_read_buffer(&fs, rbuf, sizeof(rbuf)) == 0);
+    assert(ringfs_export(&fs, export_sink, &exports, false) == fetches);
+    assert(ringfs_set_read_buffer(&fs, NULL, 0) == 0);
+    const struct flashsim_stats export = sim->stats;
+
+    /* The export left the cursor at the read head: give discard its work back. */
+    while (ringfs_fetch(&fs, object) == 0)
+        ;
+
+    flashsim_reset_stats(sim);
+    assert(ringfs_discard(&fs) == 0);
+    const struct flashsim_stats discard = sim->stats;
+
+    flashsim_reset_stats(sim);
+    assert(ringfs_scan(&fs) == 0);
+    const struct flashsim_stats scan = sim->stats;
+
+    printf("%-6s %4d %-6s | %9.0f %9.1f %6.2f %7.1f | %9.0f %6.2f %7.1f | %9.0f %6.2f | %5ld %5ld | %5ld %8.2f\n",
+            geometry->name, object_size, layout->name,
+            rate(appends, append.elapsed_ns), worst / 1e3,
+            per(append.programs, appends), per(append.program_bytes, appends),
+            rate(fetches, fetch.elapsed_ns),
+            per(fetch.reads, fetches), per(fetch.read_bytes, fetches),
+            rate(exports, export.elapsed_ns), per(export.reads, exports),
+            discard.programs, discard.reads,
+            scan.reads, scan.elapsed_ns / 1e6);
+}
+
+static void soak(void)
+{
+    const struct geometry *geometry = &geometries[0];
+    const int object_size = 16;
+    uint8_t object[16];
+
+    struct ringfs_flash_partition flash = {
+        .sector_size = geometry->sector_size,
+        .sector_offset = 0,
+        .sector_count = geometry->sector_count,
+        .page_size = timing.page_size,
+
+        .sector_erase = op_sector_erase,
+        .program = op_program,
+        .read = op_read,
+    };
+
+    sim = flashsim_open(NULL, geometry->sector_size * geometry->sector_count,
+            geometry->sector_size);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, 0x42, object_size);
+    ringfs_format(&fs);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < SOAK_APPENDS; i++) {
+        memset(object, (int) i, sizeof(object));
+        assert(ringfs_append(&fs, object) == 0);
+        /* Keep the reader half a partition behind. */
+        if (i % 64 == 63 && ringfs_count_estimate(&fs) > ringfs_capacity(&fs) / 2) {
+            for (int j = 0; j < 64; j++)
+                assert(ringfs_fetch(&fs, object) == 0);
+            assert(ringfs_discard(&fs) == 0);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("# soak: %s, %d B objects, %d appends in %.2f s (%.0f/s wall clock)\n",
+            geometry->name, object_size, SOAK_APPENDS, seconds, SOAK_APPENDS / seconds);
+    printf("# write amplification: %.2f\n",
+            (double) sim->stats.program_bytes / ((double) SOAK_APPENDS * object_size));
+    flashsim_print_stats(sim, stdout);
+
+    flashsim_close(sim);
+}
+
+int main(int argc, char **argv)
+{
+    int *const params[] = {
+        &timing.erase_us, &timing.program_us, &timing.read_setup_us, &timing.read_ns_per_byte,
+    };
+    for (int i = 1; i < argc && i <= (int) (sizeof(params) / sizeof(params[0])); i++)
+        *params[i - 1] = atoi(argv[i]);
+
+    printf("# erase %d us, program %d us/page (%d B), read %d us + %d ns/B\n",
+            timing.erase_us, timing.program_us, timing.page_size,
+            timing.read_setup_us, timing.read_ns_per_byte);
+    printf("%-6s %4s %-6s | %9s %9s %6s %7s | %9s %6s %7s | %9s %6s | %11s | %5s %8s\n",
+            "geom", "obj", "layout",
+            "append/s", "worst us", "prog/a", "B/a",
+            "fetch/s", "read/f", "B/f",
+            "export/s", "read/e",
+            "discard p/r",
+            "scan r", "scan ms");
+
+    for (size_t g = 0; g < sizeof(geometries) / sizeof(geometries[0]); g++) {
+        const struct geometry *geometry = &geometries[g];
+
+        sim = flashsim_open(NULL, geometry->sector_size * geometry->sector_count,
+                geometry->sector_size);
+        flashsim_set_timing(sim, &timing);
+
+        for (size_t o = 0; o < sizeof(object_sizes) / sizeof(object_sizes[0]); o++)
+            for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+                bench(geometry, object_sizes[o], &layouts[l]);
+
+        flashsim_close(sim);
+    }
+
+    soak();
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
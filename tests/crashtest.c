@@ -0,0 +1,510 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * RingFS power loss explorer. Runs a random workload of appends, fetches,
+ * discards and rewinds against a RAM-backed flash simulator, and cuts the
+ * power at every flash program and erase the workload issues: the operation
+ * is dropped, done only halfway, or left with a random part of its bits
+ * changed. Each image is then mounted with ringfs_scan() and checked
+ * against what the workload was told before the cut:
+ *
+ * - the mount succeeds and the objects left are a run of consecutive ones,
+ *   none of them torn;
+ * - the newest object appended is there, unless it was discarded or is
+ *   still waiting in the write buffer;
+ * - no object discarded comes back;
+ * - the partition still takes appends.
+ *
+ * The workload runs forward from a snapshot of the image and the instance
+ * taken before each step, so every crash point costs one step and one
+ * mount. Steps are split between forked workers, one per core by default;
+ * the run fails unless the workers explored every step between them.
+ *
+ * Usage: tests/crashtest [steps [seed [workers [tears]]]]
+ *
+ * tears lists the ways an operation is torn, out of "drop,half,bits".
+ * Bits tears are left out by default: sector and slot status words aren't
+ * meant to survive them, so they fail at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "ringfs.h"
+#include "flashsim.h"
+
+#define SECTOR_SIZE     256
+#define SECTOR_COUNT    8
+#define PAGE_SIZE       64
+#define VERSION         0x42
+
+/* The checkpoint sector comes right after the partition. */
+#define CHECKPOINT      SECTOR_COUNT
+
+/* Write buffer of the wbuf layout, and the most tail bytes of a variable record. */
+#define WBUF_SIZE       PAGE_SIZE
+#define TAIL_MAX        9
+
+static const struct layout {
+    const char *name;
+    uint32_t flags;
+    int erase_ahead;
+    bool checkpoint;
+    bool wbuf;
+} layouts[] = {
+    { "header",     0,                     1, false, false },
+    { "bitmap",     RINGFS_SLOT_BITMAP,    1, false, false },
+    { "paged",      RINGFS_PAGE_ALIGN,     1, false, false },
+    { "sequence",   RINGFS_SEQUENCE,       1, false, false },
+    { "groups",     RINGFS_SECTOR_GROUPS,  1, false, false },
+    { "variable",   RINGFS_VARIABLE,       1, false, false },
+    { "pool",       0,                     3, false, false },
+    { "checkpoint", 0,                     1, true,  false },
+    { "wbuf",       0,                     1, false, true  },
+};
+
+/* Ways of cutting an operation short. */
+enum tear {
+    TEAR_DROP,      /* not done at all */
+    TEAR_HALF,      /* first half done */
+    TEAR_BITS,      /* some bits done, all over */
+    TEAR_COUNT,
+};
+
+static const char *const tear_names[] = { "drop", "half", "bits" };
+
+enum step {
+    STEP_APPEND,
+    STEP_FETCH,
+    STEP_DISCARD,
+    STEP_REWIND,
+    STEP_FLUSH,
+};
+
+static const char *const step_names[] = { "append", "fetch", "discard", "rewind", "flush" };
+
+/*
+ * An object carries its number and a check of it, so a torn one shows. A
+ * variable record follows it with a tail of 0 to TAIL_MAX bytes, derived
+ * from its number as well.
+ */
+struct object {
+    uint32_t value;
+    uint32_t check;
+};
+
+/* What the workload has been told so far. */
+struct model {
+    uint32_t appended;      /* objects appended, numbered from zero */
+    uint32_t flushed;       /* objects below this one are on flash */
+    uint32_t fetched;       /* one past the last object fetched */
+    uint32_t horizon;       /* objects below this one were discarded */
+};
+
+static struct flashsim *sim;
+static uint8_t wbuf[WBUF_SIZE];
+static jmp_buf power_cut;
+static long ops;            /* programs and erases so far in the step */
+static long cut_at = -1;    /* the one to cut the power at, or -1 */
+static enum tear tear;
+static uint32_t noise;
+
+static uint32_t mix(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t object_check(uint32_t value)
+{
+    return mix(value ^ 0xC0FFEE);
+}
+
+/* Bits a cut program leaves as they were. */
+static uint8_t tear_mask(void)
+{
+    noise = mix(noise + 1);
+    return (uint8_t) noise;
+}
+
+static bool cut(void)
+{
+    return ops++ == cut_at;
+}
+
+static int op_sector_erase(struct ringfs_flash_partition *flash, ringfs_addr_t address)
+{
+    (void) flash;
+    if (cut()) {
+        uint8_t *sector = sim->data + address - address % SECTOR_SIZE;
+        if (tear == TEAR_HALF)
+            memset(sector, 0xFF, SECTOR_SIZE / 2);
+        if (tear == TEAR_BITS)
+            for (int i = 0; i < SECTOR_SIZE; i++)
+                sector[i] |= tear_mask();
+        longjmp(power_cut, 1);
+    }
+    flashsim_sector_erase(sim, address);
+    return 0;
+}
+
+static int op_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    (void) flash;
+    if (cut()) {
+        uint8_t torn[SECTOR_SIZE];
+        memcpy(torn, data, size);
+        if (tear == TEAR_HALF)
+            flashsim_program(sim, address, torn, size / 2);
+        if (tear == TEAR_BITS) {
+            for (int i = 0; i < size; i++)
+                torn[i] |= tear_mask();
+            flashsim_program(sim, address, torn, size);
+        }
+        longjmp(power_cut, 1);
+    }
+    flashsim_program(sim, address, data, size);
+    return size;
+}
+
+static int op_read(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int size)
+{
+    (void) flash;
+    flashsim_read(sim, address, data, size);
+    return size;
+}
+
+static struct ringfs_flash_partition flash = {
+    .sector_size = SECTOR_SIZE,
+    .sector_offset = 0,
+    .sector_count = SECTOR_COUNT,
+    .page_size = PAGE_SIZE,
+
+    .sector_erase = op_sector_erase,
+    .program = op_program,
+    .read = op_read,
+};
+
+static void fs_init(struct ringfs *fs, const struct layout *layout)
+{
+    const int32_t object_size = sizeof(struct object) + (layout->flags & RINGFS_VARIABLE ? TAIL_MAX : 0);
+
+    if (ringfs_init_ex(fs, &flash, VERSION, object_size, layout->flags) != 0 ||
+        (layout->erase_ahead > 1 && ringfs_set_erase_ahead(fs, layout->erase_ahead, NULL) != 0) ||
+        (layout->checkpoint && ringfs_set_checkpoint(fs, CHECKPOINT) != 0) ||
+        (layout->wbuf && ringfs_set_write_buffer(fs, wbuf, sizeof(wbuf), 0) != 0)) {
+        fprintf(stderr, "crashtest: can't set up layout %s\n", layout->name);
+        exit(2);
+    }
+}
+
+static enum step step_kind(const struct layout *layout, uint32_t seed, long step)
+{
+    const uint32_t r = mix(seed ^ mix((uint32_t) step)) % 20;
+
+    /* Buffered appends only reach the flash once in a while. */
+    if (layout->wbuf && r == 11)
+        return STEP_FLUSH;
+    return r < 12 ? STEP_APPEND : r < 17 ? STEP_FETCH : r < 19 ? STEP_DISCARD : STEP_REWIND;
+}
+
+static int append_object(struct ringfs *fs, const struct layout *layout, uint32_t value)
+{
+    uint8_t record[sizeof(struct object) + TAIL_MAX];
+    const struct object object = { value, object_check(value) };
+
+    if (!(layout->flags & RINGFS_VARIABLE))
+        return ringfs_append(fs, &object);
+
+    const int tail = value % (TAIL_MAX + 1);
+    memcpy(record, &object, sizeof(object));
+    for (int i = 0; i < tail; i++)
+        record[sizeof(object) + i] = (uint8_t) (object.check + i);
+    return ringfs_append_var(fs, record, (int32_t) sizeof(object) + tail);
+}
+
+/** Fetch an object; a variable record with the wrong tail comes back with a bad check. */
+static int fetch_object(struct ringfs *fs, const struct layout *layout, struct object *object)
+{
+    uint8_t record[sizeof(struct object) + TAIL_MAX];
+
+    if (!(layout->flags & RINGFS_VARIABLE))
+        return ringfs_fetch(fs, object);
+
+    const int size = ringfs_fetch_var(fs, record, sizeof(record));
+    if (size < 0)
+        return -1;
+    memset(object, 0, sizeof(*object));
+    memcpy(object, record, size < (int) sizeof(*object) ? size : (int) sizeof(*object));
+
+    bool intact = size == (int) sizeof(*object) + (int) (object->value % (TAIL_MAX + 1));
+    for (int i = 0; intact && i < size - (int) sizeof(*object); i++)
+        intact = record[sizeof(*object) + i] == (uint8_t) (object->check + i);
+    if (!intact)
+        object->check = ~object_check(object->value);
+    return 0;
+}
+
+/** Run a workload step, updating the model when it returns. */
+static void step_run(struct ringfs *fs, const struct layout *layout, struct model *model, enum step kind)
+{
+    struct object object;
+
+    switch (kind) {
+        case STEP_APPEND:
+            if (append_object(fs, layout, model->appended) == 0) {
+                model->appended++;
+                if (!layout->wbuf)
+                    model->flushed = model->appended;
+            }
+            break;
+        case STEP_FETCH:
+            if (fetch_object(fs, layout, &object) == 0)
+                model->fetched = object.value + 1;
+            break;
+        case STEP_DISCARD:
+            if (ringfs_discard(fs) == 0 && model->fetched > model->horizon)
+                model->horizon = model->fetched;
+            break;
+        case STEP_REWIND:
+            /* Back to the read head: a discard now drops nothing. */
+            if (ringfs_rewind(fs) == 0)
+                model->fetched = model->horizon;
+            break;
+        case STEP_FLUSH:
+            if (ringfs_flush(fs) == 0)
+                model->flushed = model->appended;
+            break;
+    }
+}
+
+/** Run a step with the power cut at one of its operations. */
+static bool step_cut(struct ringfs *fs, const struct layout *layout, struct model *model, enum step kind,
+        long at, enum tear how)
+{
+    ops = 0;
+    cut_at = at;
+    tear = how;
+    if (setjmp(power_cut)) {
+        cut_at = -1;
+        return true;
+    }
+    step_run(fs, layout, model, kind);
+    cut_at = -1;
+    return false;
+}
+
+/**
+ * Mount the image as after a reboot and check it against the model.
+ * @returns NULL if it holds up, or what's wrong.
+ */
+static const char *check(const struct layout *layout, const struct model *model, enum step kind)
+{
+    struct ringfs fs;
+    struct object object;
+
+    fs_init(&fs, layout);
+    if (ringfs_scan(&fs) != 0)
+        return "scan failed";
+
+    /* The step cut short may or may not have happened. */
+    const uint32_t newest = model->appended + (kind == STEP_APPEND);
+    const uint32_t horizon = model->horizon;
+
+    const int count = ringfs_count_exact(&fs);
+    int fetched = 0;
+    uint32_t first = 0, last = 0;
+    while (fetch_object(&fs, layout, &object) == 0) {
+        if (object.check != object_check(object.value))
+            return "torn object";
+        if (fetched == 0)
+            first = object.value;
+        else if (object.value != last + 1)
+            return "objects out of order";
+        last = object.value;
+        fetched++;
+    }
+    if (fetched != count)
+        return "count doesn't match the objects";
+
+    if (fetched > 0 && last >= newest)
+        return "object never appended";
+    if (fetched > 0 && first < horizon)
+        return "discarded object back";
+    /* The newest object flushed before the cut stays, unless discarded. */
+    if (model->flushed > 0 && model->flushed - 1 >= horizon &&
+        (fetched == 0 || last < model->flushed - 1) && kind != STEP_DISCARD)
+        return "appended object lost";
+
+    if (append_object(&fs, layout, newest) != 0 || ringfs_flush(&fs) != 0)
+        return "append after mount failed";
+    fs_init(&fs, layout);
+    if (ringfs_scan(&fs) != 0)
+        return "second scan failed";
+
+    return NULL;
+}
+
+/** What a worker reports back for a layout. */
+struct result {
+    long points;            /* crash points tried, or -1 on a failure */
+    long steps;             /* steps whose crash points it tried */
+};
+
+/**
+ * Walk the workload, trying every crash point of the steps that fall to
+ * this worker.
+ * @returns Crash points tried, or -1 on the first failure.
+ */
+static long explore(const struct layout *layout, long steps, uint32_t seed, int worker, int workers,
+        unsigned tears, long *explored)
+{
+    static uint8_t image[SECTOR_SIZE * (SECTOR_COUNT + 1)];
+    struct ringfs fs, saved_fs;
+    static uint8_t saved_wbuf[sizeof(wbuf)];
+    struct model model = { 0, 0, 0, 0 }, saved_model;
+    long points = 0;
+
+    memset(sim->data, 0xFF, sim->size);
+    fs_init(&fs, layout);
+    ringfs_format(&fs);
+
+    for (long step = 0; step < steps; step++) {
+        const enum step kind = step_kind(layout, seed, step);
+
+        if (step % workers == worker) {
+            (*explored)++;
+            memcpy(image, sim->data, sizeof(image));
+            memcpy(saved_wbuf, wbuf, sizeof(wbuf));
+            saved_fs = fs;
+            saved_model = model;
+
+            for (long at = 0; ; at++) {
+                bool was_cut = false;
+
+                for (int how = 0; how < TEAR_COUNT; how++) {
+                    if (!(tears & (1u << how)))
+                        continue;
+                    noise = mix(seed ^ (uint32_t) (step * 131 + at * 7 + how));
+                    was_cut = step_cut(&fs, layout, &model, kind, at, (enum tear) how);
+                    if (!was_cut)
+                        break;
+
+                    const char *failure = check(layout, &saved_model, kind);
+                    if (failure) {
+                        printf("# %s: %s after a %s cut at operation %ld of step %ld (%s);"
+                               " seed %u\n", layout->name, failure, tear_names[how], at, step,
+                               step_names[kind], seed);
+                        return -1;
+                    }
+                    points++;
+
+                    memcpy(sim->data, image, sizeof(image));
+                    memcpy(wbuf, saved_wbuf, sizeof(wbuf));
+                    fs = saved_fs;
+                    model = saved_model;
+                }
+                if (!was_cut)
+                    break;
+            }
+
+            memcpy(sim->data, image, sizeof(image));
+            memcpy(wbuf, saved_wbuf, sizeof(wbuf));
+            fs = saved_fs;
+            model = saved_model;
+        }
+
+        step_run(&fs, layout, &model, kind);
+    }
+
+    return points;
+}
+
+int main(int argc, char **argv)
+{
+    const long steps = argc > 1 ? atol(argv[1]) : 2000;
+    const uint32_t seed = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 0) : 1;
+    long workers = argc > 3 ? atol(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+        workers = 1;
+    unsigned tears = 0;
+    for (int how = 0; how < TEAR_COUNT; how++)
+        if (argc <= 4 ? how != TEAR_BITS : strstr(argv[4], tear_names[how]) != NULL)
+            tears |= 1u << how;
+
+    /* Each worker reports its counts here. */
+    struct result *const results = mmap(NULL, (size_t) workers * sizeof(*results), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+
+    printf("# %ld steps, seed %u, %ld workers\n", steps, seed, workers);
+    bool failed = false;
+    for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+        const struct layout *layout = &layouts[l];
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fflush(stdout);
+        for (int worker = 0; worker < workers; worker++) {
+            results[worker].points = -1;
+            results[worker].steps = 0;
+            if (fork() == 0) {
+                sim = flashsim_open(NULL, SECTOR_SIZE * (SECTOR_COUNT + 1), SECTOR_SIZE);
+                results[worker].points = explore(layout, steps, seed, worker, (int) workers, tears,
+                        &results[worker].steps);
+                flashsim_close(sim);
+                fflush(stdout);
+                _exit(0);
+            }
+        }
+
+        long points = 0, explored = 0;
+        for (int worker = 0; worker < workers; worker++) {
+            int status;
+            if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                failed = true;
+        }
+        for (int worker = 0; worker < workers; worker++) {
+            if (results[worker].points < 0)
+                failed = true;
+            else
+                points += results[worker].points;
+            explored += results[worker].steps;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        /* Every step goes to exactly one worker. */
+        if (!failed && explored != steps) {
+            printf("# %s: workers explored %ld of %ld steps\n", layout->name, explored, steps);
+            failed = true;
+        }
+
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-10s %9ld crash points in %6.2f s (%.0f/s)\n",
+                layout->name, points, seconds, points / seconds);
+    }
+
+    return failed ? 1 : 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
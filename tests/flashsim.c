@@ -12,6 +12,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "flashsim.h"
 
@@ -24,25 +26,46 @@
 
 struct flashsim *flashsim_open(const char *name, int size, int sector_size)
 {
-    struct flashsim *sim = malloc(sizeof(struct flashsim));
+    struct flashsim *sim = calloc(1, sizeof(struct flashsim));
 
     sim->size = size;
     sim->sector_size = sector_size;
-    sim->fh = fopen(name, "r+");
-    if (NULL == sim->fh)
+    sim->erase_counts = calloc(size / sector_size, sizeof(*sim->erase_counts));
+    assert(sim->erase_counts != NULL);
+
+    if (NULL == name)
     {
-    	 sim->fh = fopen(name, "w+");
+        /* RAM-backed: starts out erased and goes away on close. */
+        sim->fd = -1;
+        sim->data = malloc(size);
+        assert(sim->data != NULL);
+        memset(sim->data, 0xff, size);
+        return sim;
     }
-    assert(sim->fh != NULL);
-    assert(ftruncate(fileno(sim->fh), size) == 0);
+
+    sim->fd = open(name, O_RDWR | O_CREAT, 0644);
+    assert(sim->fd >= 0);
+    int res = ftruncate(sim->fd, size);
+    assert(res == 0);
+    sim->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sim->fd, 0);
+    assert(sim->data != MAP_FAILED);
+    (void) res;
 
     return sim;
 }
 
 void flashsim_close(struct flashsim *sim)
 {
-    fflush(sim->fh);
-    fclose(sim->fh);
+    if (sim->fd >= 0)
+    {
+        munmap(sim->data, sim->size);
+        close(sim->fd);
+    }
+    else
+    {
+        free(sim->data);
+    }
+    free(sim->erase_counts);
     free(sim);
 }
 
@@ -51,19 +74,23 @@ void flashsim_sector_erase(struct flashsim *sim, int addr)
     int sector_start = addr - (addr % sim->sector_size);
     logprintf("flashsim_erase  (0x%08x) * erasing sector at 0x%08x\n", addr, sector_start);
 
-    void *empty = malloc(sim->sector_size);
-    memset(empty, 0xff, sim->sector_size);
-
-    assert(fseek(sim->fh, sector_start, SEEK_SET) == 0);
-    assert(fwrite(empty, 1, sim->sector_size, sim->fh) == (size_t) sim->sector_size);
+    assert(sector_start >= 0 && sector_start + sim->sector_size <= sim->size);
+    memset(sim->data + sector_start, 0xff, sim->sector_size);
 
-    free(empty);
+    sim->erase_counts[sector_start / sim->sector_size]++;
+    sim->stats.erases++;
+    sim->stats.elapsed_ns += 1000LL * sim->timing.erase_us;
 }
 
 void flashsim_read(struct flashsim *sim, int addr, uint8_t *buf, int len)
 {
-    assert(fseek(sim->fh, addr, SEEK_SET) == 0);
-    assert(fread(buf, 1, len, sim->fh) == (size_t) len);
+    assert(addr >= 0 && len >= 0 && addr + len <= sim->size);
+    memcpy(buf, sim->data + addr, len);
+
+    sim->stats.reads++;
+    sim->stats.read_bytes += len;
+    sim->stats.elapsed_ns += 1000LL * sim->timing.read_setup_us +
+                             (long long) sim->timing.read_ns_per_byte * len;
 
     logprintf("flashsim_read   (0x%08x) = %d bytes [ ", addr, len);
     for (int i=0; i<len; i++) {
@@ -90,20 +117,75 @@ void flashsim_program(struct flashsim *sim, int addr, const uint8_t *buf, int le
     }
     logprintf("]\n");
 
-    uint8_t *data = malloc(len);
-
-    assert(fseek(sim->fh, addr, SEEK_SET) == 0);
-    assert(fread(data, 1, len, sim->fh) == (size_t) len);
+    assert(addr >= 0 && len >= 0 && addr + len <= sim->size);
 
-    for (int i=0; i<(int) len; i++)
+    uint8_t *data = sim->data + addr;
+    int flips = 0;
+    for (int i=0; i<len; i++)
     {
+        /* NOR can only clear bits: a 1 over a 0 doesn't stick. */
+        if (buf[i] & ~data[i])
+            flips++;
         data[i] &= buf[i];
     }
+    if (flips)
+    {
+        logprintf("flashsim_program(0x%08x) ! %d bytes can't go back to 1\n", addr, flips);
+        sim->stats.bad_programs++;
+    }
+
+    int pages = 1;
+    if (sim->timing.page_size > 0 && len > 0)
+        pages = (addr + len - 1) / sim->timing.page_size - addr / sim->timing.page_size + 1;
+
+    sim->stats.programs++;
+    sim->stats.program_pages += pages;
+    sim->stats.program_bytes += len;
+    sim->stats.elapsed_ns += 1000LL * sim->timing.program_us * pages;
+}
+
+void flashsim_set_timing(struct flashsim *sim, const struct flashsim_timing *timing)
+{
+    sim->timing = *timing;
+}
+
+void flashsim_reset_stats(struct flashsim *sim)
+{
+    memset(&sim->stats, 0, sizeof(sim->stats));
+}
+
+void flashsim_print_stats(struct flashsim *sim, FILE *out)
+{
+    const int sectors = sim->size / sim->sector_size;
+    int min = sim->erase_counts[0], max = sim->erase_counts[0];
+    long total = 0;
+
+    for (int i=0; i<sectors; i++)
+    {
+        if (sim->erase_counts[i] < min)
+            min = sim->erase_counts[i];
+        if (sim->erase_counts[i] > max)
+            max = sim->erase_counts[i];
+        total += sim->erase_counts[i];
+    }
 
-    assert(fseek(sim->fh, addr, SEEK_SET) == 0);
-    assert(fwrite(data, 1, len, sim->fh) == (size_t) len);
+    fprintf(out, "flash: %ld reads (%ld B), %ld programs (%ld B, %ld bad), %ld erases\n",
+            sim->stats.reads, sim->stats.read_bytes,
+            sim->stats.programs, sim->stats.program_bytes, sim->stats.bad_programs,
+            sim->stats.erases);
+    fprintf(out, "wear: erases per sector min %d, mean %.1f, max %d\n",
+            min, (double) total / sectors, max);
 
-    free(data);
+    /* Histogram of erase counts, in up to 8 buckets. */
+    const int width = (max - min) / 8 + 1;
+    for (int lo = min; lo <= max; lo += width)
+    {
+        int n = 0;
+        for (int i=0; i<sectors; i++)
+            if (sim->erase_counts[i] >= lo && sim->erase_counts[i] < lo + width)
+                n++;
+        fprintf(out, "  %6d..%-6d %d\n", lo, lo + width - 1, n);
+    }
 }
 
 /* vim: set ts=4 sw=4 et: */
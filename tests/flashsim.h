@@ -10,15 +10,47 @@
 #define FLASHSIM_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Modeled operation costs. All zero by default. */
+struct flashsim_timing {
+    int erase_us;           /* per sector erase */
+    int program_us;         /* per program page touched */
+    int read_setup_us;      /* per read command */
+    int read_ns_per_byte;   /* read transfer */
+    int page_size;          /* program page size; zero counts each program as one page */
+};
+
+/* Operation counters, reset with flashsim_reset_stats(). */
+struct flashsim_stats {
+    long erases;
+    long programs;
+    long reads;
+    long program_pages;
+    long program_bytes;
+    long read_bytes;
+    long bad_programs;      /* programs trying to turn a 0 bit back into 1 */
+    long long elapsed_ns;   /* modeled time spent in flash operations */
+};
+
 struct flashsim {
     int size;
     int sector_size;
 
-    FILE *fh;
+    int fd;
+    uint8_t *data;          /* mapped file, or RAM */
+
+    struct flashsim_timing timing;
+    struct flashsim_stats stats;
+    int *erase_counts;      /* per sector, since open */
 };
 
+/* A NULL name gives a RAM-backed simulator that starts out erased. */
 struct flashsim *flashsim_open(const char *name, int size, int sector_size);
 void flashsim_close(struct flashsim *sim);
 
@@ -26,6 +58,14 @@ void flashsim_sector_erase(struct flashsim *sim, int addr);
 void flashsim_read(struct flashsim *sim, int addr, uint8_t *buf, int len);
 void flashsim_program(struct flashsim *sim, int addr, const uint8_t *buf, int len);
 
+void flashsim_set_timing(struct flashsim *sim, const struct flashsim_timing *timing);
+void flashsim_reset_stats(struct flashsim *sim);
+void flashsim_print_stats(struct flashsim *sim, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
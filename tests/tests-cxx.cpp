@@ -0,0 +1,154 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <check.h>
+
+#include "ringfs.hpp"
+#include "flashsim.h"
+
+/* C++ code that includes ringfs.hpp can still name the instance struct ringfs. */
+static_assert(std::is_same<struct ringfs, ringfs_t>::value, "ringfs_t is struct ringfs");
+
+/* Same partition as the C test suite. */
+
+static struct flashsim *sim;
+
+static int op_sector_erase(struct ringfs_flash_partition *flash, ringfs_addr_t address)
+{
+    (void) flash;
+    flashsim_sector_erase(sim, address);
+    return 0;
+}
+
+static int op_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    (void) flash;
+    flashsim_program(sim, address, static_cast<const uint8_t *>(data), size);
+    return size;
+}
+
+static int op_read(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int size)
+{
+    (void) flash;
+    flashsim_read(sim, address, static_cast<uint8_t *>(data), size);
+    return size;
+}
+
+static struct ringfs_flash_partition flash = []{
+    struct ringfs_flash_partition partition = {};
+    partition.sector_size = 32;
+    partition.sector_offset = 4;
+    partition.sector_count = 6;
+    partition.sector_erase = op_sector_erase;
+    partition.program = op_program;
+    partition.read = op_read;
+    return partition;
+}();
+
+static void fixture_flashsim_setup(void)
+{
+    sim = flashsim_open("tests/ringfs-cxx.sim",
+            flash.sector_size * (flash.sector_offset + flash.sector_count),
+            flash.sector_size);
+}
+
+static void fixture_flashsim_teardown(void)
+{
+    flashsim_close(sim);
+    sim = NULL;
+}
+
+struct sample
+{
+    uint16_t id;
+    uint16_t value;
+};
+
+typedef ringfs_cxx::Ring<sample, 32, 6> ring_t;
+
+static_assert(ring_t::slots_per_sector == 3, "slots per sector");
+static_assert(ring_t::capacity == 15, "capacity");
+
+START_TEST(test_ring_geometry)
+{
+    printf("# test_ring_geometry\n");
+
+    ringfs_cxx::Ring<sample, 64, 6> wrong_size;
+    ck_assert(!wrong_size.init(flash, 0x42));
+    ringfs_cxx::Ring<sample, 32, 4> wrong_count;
+    ck_assert(!wrong_count.init(flash, 0x42));
+
+    ring_t ring;
+    ck_assert(ring.init(flash, 0x42));
+    ck_assert_int_eq(ring_t::capacity, ringfs_capacity(ring.get()));
+}
+END_TEST
+
+START_TEST(test_ring_typed)
+{
+    printf("# test_ring_typed\n");
+
+    ring_t ring;
+    ck_assert(ring.init(flash, 0x42));
+    ck_assert(ring.format());
+    ck_assert(!ring.fetch());
+
+    printf("## append and fetch\n");
+    for (uint16_t i=0; i<5; i++)
+        ck_assert(ring.append(sample { i, (uint16_t)(i * 10) }));
+    ck_assert_int_eq(ring.count_estimate(), 5);
+    std::optional<sample> object = ring.fetch();
+    ck_assert(object);
+    ck_assert_int_eq(object->id, 0);
+    ck_assert_int_eq(object->value, 0);
+
+    printf("## iterate over the rest\n");
+    uint16_t next = 1;
+    for (const sample &s : ring) {
+        ck_assert_int_eq(s.id, next);
+        ck_assert_int_eq(s.value, next * 10);
+        next++;
+    }
+    ck_assert_int_eq(next, 5);
+    ck_assert(ring.begin() == ring.end());
+
+    printf("## count across the wraparound\n");
+    ck_assert(ring.discard());
+    for (uint16_t i=0; i<ring_t::capacity + 4; i++)
+        ck_assert(ring.append(sample { i, 0 }));
+    ck_assert_int_eq(ring.count_estimate(), ringfs_count_estimate(ring.get()));
+    ck_assert(ring.rewind());
+    ck_assert(ring.scan());
+    ck_assert_int_eq(ring.count_estimate(), ringfs_count_estimate(ring.get()));
+}
+END_TEST
+
+static Suite *ringfs_cxx_suite(void)
+{
+    Suite *s = suite_create("ringfs-cxx");
+    TCase *tc = tcase_create("ring");
+    tcase_add_checked_fixture(tc, fixture_flashsim_setup, fixture_flashsim_teardown);
+    tcase_add_test(tc, test_ring_geometry);
+    tcase_add_test(tc, test_ring_typed);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    SRunner *sr = srunner_create(ringfs_cxx_suite());
+    srunner_run_all(sr, CK_NORMAL);
+    const int number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
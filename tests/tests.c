@@ -12,9 +12,13 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
 #include <check.h>
 
 #include "ringfs.h"
+#include "ringfs_queue.h"
+#include "ringfs_pack.h"
+#include "ringfs_stripe.h"
 #include "flashsim.h"
 
 /* Flashsim tests. */
@@ -63,24 +67,30 @@ END_TEST
 /* Flash simulator + MTD partition fixture. */
 
 static struct flashsim *sim;
+static int read_count;
+static int program_count;
+static int erase_count;
 
-static int op_sector_erase(struct ringfs_flash_partition *flash, int address)
+static int op_sector_erase(struct ringfs_flash_partition *flash, ringfs_addr_t address)
 {
     (void) flash;
+    erase_count++;
     flashsim_sector_erase(sim, address);
     return 0;
 }
 
-static int op_program(struct ringfs_flash_partition *flash, int address, const void *data, int size)
+static int op_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
 {
     (void) flash;
+    program_count++;
     flashsim_program(sim, address, data, size);
     return size;
 }
 
-static int op_read(struct ringfs_flash_partition *flash, int address, void *data, int size)
+static int op_read(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int size)
 {
     (void) flash;
+    read_count++;
     flashsim_read(sim, address, data, size);
     return size;
 }
@@ -127,6 +137,11 @@ static void assert_loc_equiv_to_offset(const struct ringfs *fs, const struct rin
     ck_assert_int_eq(offset, loc_offset);
 }
 
+static bool loc_equal(const struct ringfs_loc *a, const struct ringfs_loc *b)
+{
+    return a->sector == b->sector && a->slot == b->slot;
+}
+
 static void assert_scan_integrity(const struct ringfs *fs)
 {
     struct ringfs newfs;
@@ -412,6 +427,2293 @@ START_TEST(test_ringfs_overflow)
 }
 END_TEST
 
+START_TEST(test_ringfs_sector_table)
+{
+    printf("# test_ringfs_sector_table\n");
+
+    uint32_t table[6];
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_sector_table(&fs, table, 5) != 0);
+    ck_assert(ringfs_set_sector_table(&fs, table, 6) == 0);
+    ringfs_format(&fs);
+
+    printf("## appends should not read sector headers\n");
+    int capacity = ringfs_capacity(&fs);
+    read_count = 0;
+    for (int i=0; i<capacity + 2*fs.slots_per_sector; i++)
+        ringfs_append(&fs, (int[]) { i });
+    ck_assert_int_eq(read_count, 0);
+    assert_scan_integrity(&fs);
+
+    printf("## table should mirror the flash\n");
+    for (int sector=0; sector<flash.sector_count; sector++) {
+        uint32_t status;
+        flash.read(&flash, (flash.sector_offset+sector+1)*flash.sector_size - SECTOR_HEADER_SIZE,
+                &status, sizeof(status));
+        ck_assert_int_eq(table[sector], status);
+    }
+}
+END_TEST
+
+START_TEST(test_ringfs_count_table)
+{
+    printf("# test_ringfs_count_table\n");
+
+    struct ringfs fs, reference;
+    int32_t counts[6];
+    int obj;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_count_table(&fs, counts, flash.sector_count-1) != 0);
+    ck_assert(ringfs_set_count_table(&fs, counts, flash.sector_count) == 0);
+    ringfs_format(&fs);
+    ringfs_init(&reference, &flash, DEFAULT_VERSION, sizeof(object_t));
+
+    srand(9);
+    for (int i=0; i<2000; i++) {
+        switch (rand() % 8) {
+            case 0: case 1: case 2:
+                ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+                break;
+            case 3: {
+                int batch[4] = { i, i, i, i };
+                ck_assert(ringfs_append_batch(&fs, batch, 1 + rand() % 4) == 0);
+                break;
+            }
+            case 4:
+                ringfs_fetch(&fs, &obj);
+                break;
+            case 5:
+                ringfs_discard(&fs);
+                break;
+            case 6:
+                ringfs_item_discard(&fs);
+                break;
+            case 7:
+                if (rand() % 4 == 0)
+                    ck_assert(ringfs_scan(&fs) == 0);
+                else
+                    ringfs_rewind(&fs);
+                break;
+        }
+
+        reference.read = fs.read;
+        reference.write = fs.write;
+        read_count = 0;
+        int count = ringfs_count_exact(&fs);
+        if (read_count == 0)
+            ck_assert_int_eq(ringfs_count_exact(&reference), count);
+        int total = 0;
+        for (int sector=0; sector<flash.sector_count; sector++)
+            total += counts[sector];
+        ck_assert_int_eq(total, count);
+    }
+}
+END_TEST
+
+START_TEST(test_ringfs_append_batch)
+{
+    printf("# test_ringfs_append_batch\n");
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    int capacity = ringfs_capacity(&fs);
+    int objects[capacity*2];
+    for (int i=0; i<capacity*2; i++)
+        objects[i] = 0x100 + i;
+
+    printf("## batch append fewer programs than single appends\n");
+    ringfs_format(&fs);
+    program_count = 0;
+    ck_assert(ringfs_append_batch(&fs, objects, 10) == 0);
+    ck_assert_int_lt(program_count, 3*10);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 10);
+    assert_scan_integrity(&fs);
+    for (int i=0; i<10; i++) {
+        int obj;
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, objects[i]);
+    }
+    struct ringfs_loc write = fs.write;
+
+    printf("## same end state as single appends\n");
+    ringfs_format(&fs);
+    for (int i=0; i<10; i++)
+        ringfs_append(&fs, &objects[i]);
+    ck_assert_int_eq(fs.write.sector, write.sector);
+    ck_assert_int_eq(fs.write.slot, write.slot);
+
+    printf("## overflowing batch\n");
+    ringfs_format(&fs);
+    ck_assert(ringfs_append_batch(&fs, objects, 1) == 0);
+    ck_assert(ringfs_append_batch(&fs, objects+1, capacity*2-1) == 0);
+    assert_scan_integrity(&fs);
+    int count = ringfs_count_exact(&fs);
+    ck_assert_int_gt(count, capacity - fs.slots_per_sector);
+    ck_assert_int_le(count, capacity);
+    for (int i=capacity*2-count; i<capacity*2; i++) {
+        int obj;
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, objects[i]);
+    }
+    ck_assert(ringfs_fetch(&fs, (int[1]) {0}) < 0);
+}
+END_TEST
+
+START_TEST(test_ringfs_read_buffer)
+{
+    printf("# test_ringfs_read_buffer\n");
+
+    uint8_t buffer[3*(SLOT_HEADER_SIZE+sizeof(object_t))];
+    struct ringfs fs;
+    int obj;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_read_buffer(&fs, buffer, SLOT_HEADER_SIZE) != 0);
+    ck_assert(ringfs_set_read_buffer(&fs, buffer, sizeof(buffer)) == 0);
+    ringfs_format(&fs);
+
+    printf("## fetch in runs\n");
+    for (int i=0; i<10; i++)
+        ringfs_append(&fs, (int[]) { 0x11*(i+1) });
+    read_count = 0;
+    for (int i=0; i<10; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, 0x11*(i+1));
+    }
+    ck_assert(ringfs_fetch(&fs, &obj) < 0);
+    ck_assert_int_le(read_count, 4);
+
+    printf("## appends after a partial run are visible\n");
+    ringfs_append(&fs, (int[]) { 0x42 });
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 0x42);
+
+    printf("## discards are mirrored into the buffer\n");
+    ringfs_format(&fs);
+    for (int i=0; i<3; i++)
+        ringfs_append(&fs, (int[]) { 0x11*(i+1) });
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert(ringfs_rewind(&fs) == 0);
+    fs.cursor.slot = 0;
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 0x22);
+
+    printf("## erased sectors drop the buffer\n");
+    int capacity = ringfs_capacity(&fs);
+    for (int round=0; round<3; round++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        for (int i=0; i<capacity; i++)
+            ringfs_append(&fs, (int[]) { round*capacity + i });
+        ck_assert(ringfs_rewind(&fs) == 0);
+
+        struct ringfs plainfs;
+        ringfs_init(&plainfs, &flash, DEFAULT_VERSION, sizeof(object_t));
+        ck_assert(ringfs_scan(&plainfs) == 0);
+        int expected;
+        while (ringfs_fetch(&plainfs, &expected) == 0) {
+            ck_assert(ringfs_fetch(&fs, &obj) == 0);
+            ck_assert_int_eq(obj, expected);
+        }
+        ck_assert(ringfs_fetch(&fs, &obj) < 0);
+        ck_assert(ringfs_rewind(&fs) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_ringfs_scan_bisect)
+{
+    printf("# test_ringfs_scan_bisect\n");
+
+    struct ringfs fs;
+    int obj;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+
+    /* deterministic pseudo-random mix of operations */
+    uint32_t seed = 12345;
+    for (int i=0; i<500; i++) {
+        seed = seed * 1103515245 + 12345;
+        switch ((seed >> 16) % 8) {
+            case 0: case 1: case 2: ringfs_append(&fs, (int[]) { i }); break;
+            case 3: case 4: ringfs_fetch(&fs, &obj); break;
+            case 5: ringfs_discard(&fs); break;
+            case 6: ringfs_rewind(&fs); break;
+            case 7:
+                if (!loc_equal(&fs.read, &fs.cursor))
+                    ringfs_item_discard(&fs);
+                break;
+        }
+
+        struct ringfs bisectfs, linearfs;
+        ringfs_init(&bisectfs, &flash, DEFAULT_VERSION, sizeof(object_t));
+        ringfs_init_ex(&linearfs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_LINEAR_SCAN);
+        ck_assert(ringfs_scan(&bisectfs) == 0);
+        ck_assert(ringfs_scan(&linearfs) == 0);
+        ck_assert_int_eq(bisectfs.write.sector, linearfs.write.sector);
+        ck_assert_int_eq(bisectfs.write.slot, linearfs.write.slot);
+        ck_assert_int_eq(bisectfs.read.sector, linearfs.read.sector);
+        ck_assert_int_eq(bisectfs.read.slot, linearfs.read.slot);
+        ck_assert_int_eq(bisectfs.write.sector, fs.write.sector);
+        ck_assert_int_eq(bisectfs.write.slot, fs.write.slot);
+    }
+}
+END_TEST
+
+static void assert_scan_equal(struct ringfs *fs, struct ringfs *reference)
+{
+    ck_assert_int_eq(fs->write.sector, reference->write.sector);
+    ck_assert_int_eq(fs->write.slot, reference->write.slot);
+    ck_assert_int_eq(fs->read.sector, reference->read.sector);
+    ck_assert_int_eq(fs->read.slot, reference->read.slot);
+}
+
+START_TEST(test_ringfs_checkpoint)
+{
+    printf("# test_ringfs_checkpoint\n");
+
+    const int checkpoint_sector = 2;
+    struct ringfs fs, reference;
+    int obj;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_checkpoint(&fs, flash.sector_offset) != 0);
+    ck_assert(ringfs_set_checkpoint(&fs, checkpoint_sector) == 0);
+    ringfs_format(&fs);
+
+    printf("## mount from the checkpoint after random operations\n");
+    uint32_t seed = 4321;
+    for (int i=0; i<300; i++) {
+        seed = seed * 1103515245 + 12345;
+        switch ((seed >> 16) % 6) {
+            case 0: case 1: case 2: ringfs_append(&fs, (int[]) { i }); break;
+            case 3: ringfs_fetch(&fs, &obj); break;
+            case 4: ringfs_discard(&fs); break;
+            case 5: ringfs_rewind(&fs); break;
+        }
+
+        struct ringfs newfs, fullfs;
+        ringfs_init(&newfs, &flash, DEFAULT_VERSION, sizeof(object_t));
+        ringfs_set_checkpoint(&newfs, checkpoint_sector);
+        ringfs_init(&fullfs, &flash, DEFAULT_VERSION, sizeof(object_t));
+        ringfs_init_ex(&reference, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_LINEAR_SCAN);
+        ck_assert(ringfs_scan(&reference) == 0);
+        read_count = 0;
+        ck_assert(ringfs_scan(&fullfs) == 0);
+        int full_reads = read_count;
+        read_count = 0;
+        ck_assert(ringfs_scan(&newfs) == 0);
+        ck_assert_int_le(read_count, full_reads);
+        assert_scan_equal(&newfs, &reference);
+    }
+
+    printf("## stale checkpoint: write head moved on without recording\n");
+    for (int lag=1; lag<=flash.sector_count; lag++) {
+        struct ringfs plainfs, newfs;
+        ringfs_init(&plainfs, &flash, DEFAULT_VERSION, sizeof(object_t));
+        ck_assert(ringfs_scan(&plainfs) == 0);
+        for (int i=0; i<lag*plainfs.slots_per_sector; i++)
+            ringfs_append(&plainfs, (int[]) { i });
+
+        ringfs_init(&newfs, &flash, DEFAULT_VERSION, sizeof(object_t));
+        ringfs_set_checkpoint(&newfs, checkpoint_sector);
+        ck_assert(ringfs_scan(&newfs) == 0);
+        assert_scan_equal(&newfs, &plainfs);
+
+        /* the scan above refreshed the checkpoint */
+        ck_assert(ringfs_scan(&newfs) == 0);
+        assert_scan_equal(&newfs, &plainfs);
+    }
+
+    printf("## formatting a partition invalidates the checkpoint\n");
+    struct ringfs plainfs;
+    ringfs_init(&plainfs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&plainfs);
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_set_checkpoint(&fs, checkpoint_sector);
+    ck_assert(ringfs_scan(&fs) == 0);
+    assert_scan_equal(&fs, &plainfs);
+}
+END_TEST
+
+START_TEST(test_ringfs_discard_sectors)
+{
+    printf("# test_ringfs_discard_sectors\n");
+
+    struct ringfs fs;
+    int obj;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+
+    for (int i=0; i<3*fs.slots_per_sector; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+
+    printf("## whole sectors cost one program each\n");
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    for (int i=1; i<2*fs.slots_per_sector+1; i++)
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    program_count = 0;
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert_int_eq(program_count, 2 + 1);
+    assert_loc_equiv_to_offset(&fs, &fs.read, 2*fs.slots_per_sector+1);
+    assert_scan_integrity(&fs);
+
+    struct ringfs linearfs;
+    ringfs_init_ex(&linearfs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_LINEAR_SCAN);
+    ck_assert(ringfs_scan(&linearfs) == 0);
+    ck_assert(loc_equal(&linearfs.read, &fs.read));
+    ck_assert_int_eq(ringfs_count_exact(&linearfs), fs.slots_per_sector-1);
+
+    printf("## item discard retires the sector it finishes\n");
+    for (int i=0; i<fs.slots_per_sector-1; i++)
+        ck_assert(ringfs_item_discard(&fs) == 0);
+    ck_assert_int_eq(fs.read.slot, 0);
+    assert_scan_integrity(&fs);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+
+    printf("## wraparound\n");
+    for (int i=0; i<2*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+        if (i % 5 == 4) {
+            ck_assert(ringfs_fetch(&fs, &obj) == 0);
+            ck_assert(ringfs_fetch(&fs, &obj) == 0);
+            ck_assert(ringfs_discard(&fs) == 0);
+        }
+        assert_scan_integrity(&fs);
+    }
+}
+END_TEST
+
+START_TEST(test_ringfs_slot_bitmap)
+{
+    printf("# test_ringfs_slot_bitmap\n");
+
+    struct ringfs fs, scanned;
+    int obj;
+    ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_SLOT_BITMAP);
+    /* 5 objects + 4 bytes of bitmap fit next to the sector header. */
+    ck_assert_int_eq(fs.slots_per_sector, 5);
+    ringfs_format(&fs);
+
+    printf("## layouts don't mix\n");
+    ringfs_init(&scanned, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&scanned) != 0);
+
+    printf("## append, fetch, discard, rescan\n");
+    srand(10);
+    int head = 0, total = 0;
+    for (int i=0; i<500; i++) {
+        switch (rand() % 4) {
+            case 0: case 1:
+                ck_assert(ringfs_append(&fs, (int[]) { total++ }) == 0);
+                break;
+            case 2: {
+                int batch[3] = { total, total+1, total+2 };
+                ck_assert(ringfs_append_batch(&fs, batch, 3) == 0);
+                total += 3;
+                break;
+            }
+            case 3:
+                ck_assert(ringfs_discard(&fs) == 0);
+                break;
+        }
+        if (ringfs_fetch(&fs, &obj) == 0) {
+            ck_assert_int_ge(obj, head);
+            head = obj + 1;
+        }
+
+        ringfs_init_ex(&scanned, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_SLOT_BITMAP);
+        ck_assert(ringfs_scan(&scanned) == 0);
+        ck_assert(loc_equal(&scanned.read, &fs.read));
+        ck_assert(loc_equal(&scanned.write, &fs.write));
+        ck_assert_int_eq(ringfs_count_exact(&scanned), ringfs_count_exact(&fs));
+    }
+
+    printf("## torn append\n");
+    ck_assert(ringfs_append(&fs, (int[]) { 1234 }) == 0);
+    struct ringfs_loc torn = fs.write;
+    ck_assert_int_lt(torn.slot, fs.slots_per_sector - 1);
+    /* payload programmed, power lost before the commit */
+    int junk = 0x5a5a5a5a;
+    flashsim_program(sim, (flash.sector_offset + torn.sector) * flash.sector_size +
+            torn.slot * (int) sizeof(object_t), (uint8_t *) &junk, sizeof(junk));
+    ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_SLOT_BITMAP);
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert_int_eq(fs.write.sector, torn.sector);
+    ck_assert_int_eq(fs.write.slot, torn.slot + 1);
+    int count = ringfs_count_exact(&fs);
+    ck_assert(ringfs_append(&fs, (int[]) { 5678 }) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), count + 1);
+    while (ringfs_fetch(&fs, &obj) == 0)
+        ck_assert(obj != junk);
+    ck_assert_int_eq(obj, 5678);
+
+    printf("## torn append in the last slot\n");
+    while (fs.write.slot != fs.slots_per_sector - 1)
+        ck_assert(ringfs_append(&fs, (int[]) { 1234 }) == 0);
+    torn = fs.write;
+    flashsim_program(sim, (flash.sector_offset + torn.sector) * flash.sector_size +
+            torn.slot * (int) sizeof(object_t), (uint8_t *) &junk, sizeof(junk));
+    ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_SLOT_BITMAP);
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert_int_eq(fs.write.sector, (torn.sector + 1) % flash.sector_count);
+    ck_assert_int_eq(fs.write.slot, 0);
+    ck_assert(ringfs_append(&fs, (int[]) { 9012 }) == 0);
+    while (ringfs_fetch(&fs, &obj) == 0)
+        ck_assert(obj != junk);
+    ck_assert_int_eq(obj, 9012);
+}
+END_TEST
+
+static int make_record(uint8_t *record, int seq)
+{
+    int size = 1 + seq % 13;
+    for (int i=0; i<size; i++)
+        record[i] = (uint8_t) (seq + i);
+    return size;
+}
+
+START_TEST(test_ringfs_variable)
+{
+    printf("# test_ringfs_variable\n");
+
+    struct ringfs fs, scanned;
+    uint8_t record[16], buf[16];
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, 32, RINGFS_VARIABLE) != 0);
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, 16, RINGFS_VARIABLE | RINGFS_SLOT_BITMAP) != 0);
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, 16, RINGFS_VARIABLE) == 0);
+    ck_assert(ringfs_set_read_buffer(&fs, buf, sizeof(buf)-1) != 0);
+    ringfs_format(&fs);
+    ck_assert(ringfs_append_var(&fs, record, 0) != 0);
+    ck_assert(ringfs_append_var(&fs, record, 17) != 0);
+
+    printf("## layouts don't mix\n");
+    ringfs_init(&scanned, &flash, DEFAULT_VERSION, 16);
+    ck_assert(ringfs_scan(&scanned) != 0);
+    ringfs_format(&scanned);
+    ck_assert(ringfs_scan(&fs) != 0);
+    ringfs_format(&fs);
+
+    printf("## records come back in order, with their sizes\n");
+    int head = 0, total = 0;
+    srand(11);
+    for (int i=0; i<1000; i++) {
+        switch (rand() % 5) {
+            case 0: case 1: {
+                int size = make_record(record, total++);
+                ck_assert(ringfs_append_var(&fs, record, size) == 0);
+                break;
+            }
+            case 2: {
+                int size = ringfs_fetch_var(&fs, buf, sizeof(buf));
+                if (size >= 0) {
+                    int seq = buf[0];
+                    while ((uint8_t) head != seq)
+                        head++;
+                    ck_assert_int_eq(size, make_record(record, head));
+                    ck_assert(memcmp(buf, record, (size_t) size) == 0);
+                    head++;
+                }
+                break;
+            }
+            case 3:
+                ck_assert(ringfs_discard(&fs) == 0);
+                break;
+            case 4:
+                ringfs_item_discard(&fs);
+                break;
+        }
+
+        ringfs_init_ex(&scanned, &flash, DEFAULT_VERSION, 16, RINGFS_VARIABLE);
+        ck_assert(ringfs_scan(&scanned) == 0);
+        ck_assert(loc_equal(&scanned.write, &fs.write));
+        ck_assert_int_eq(ringfs_count_exact(&scanned), ringfs_count_exact(&fs));
+        /* the read head may sit on an erased sector tail, compare contents */
+        struct ringfs copy = fs;
+        ringfs_rewind(&copy);
+        uint8_t expected[16];
+        int size = ringfs_fetch_var(&copy, expected, sizeof(expected));
+        ck_assert_int_eq(ringfs_fetch_var(&scanned, buf, sizeof(buf)), size);
+        if (size > 0)
+            ck_assert(memcmp(buf, expected, (size_t) size) == 0);
+    }
+
+    printf("## buffer too small\n");
+    ringfs_format(&fs);
+    ck_assert(ringfs_append_var(&fs, record, 12) == 0);
+    ck_assert_int_eq(ringfs_fetch_var(&fs, buf, 11), -1);
+    ck_assert_int_eq(ringfs_fetch_var(&fs, buf, 12), 12);
+
+    printf("## records don't span sectors\n");
+    ringfs_format(&fs);
+    /* 24 bytes of room: 16 + 16 don't fit, the second record moves on */
+    ck_assert(ringfs_append_var(&fs, record, 9) == 0);
+    ck_assert(ringfs_append_var(&fs, record, 9) == 0);
+    ck_assert_int_eq(fs.write.sector, 1);
+    ck_assert_int_eq(fs.write.slot, 16);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 2);
+    ck_assert_int_eq(ringfs_fetch_var(&fs, buf, sizeof(buf)), 9);
+    ck_assert_int_eq(ringfs_fetch_var(&fs, buf, sizeof(buf)), 9);
+    ck_assert_int_eq(ringfs_fetch_var(&fs, buf, sizeof(buf)), -1);
+
+    printf("## fixed-size API\n");
+    ringfs_format(&fs);
+    memset(record, 0x42, sizeof(record));
+    ck_assert(ringfs_append(&fs, record) == 0);
+    ck_assert(ringfs_fetch(&fs, buf) == 0);
+    ck_assert(memcmp(buf, record, 16) == 0);
+}
+END_TEST
+
+/* Page-crossing detector for the write buffer test. */
+static int page_crossings;
+
+static int op_paged_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    if (address % flash->page_size + size > flash->page_size)
+        page_crossings++;
+    return op_program(flash, address, data, size);
+}
+
+/* Power lost after a flush's run: the slot header commits never land. */
+static int op_uncommitted_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    if (size == sizeof(word) && word == 0xFFFF0000 &&
+            address % flash->sector_size < flash->sector_size - SECTOR_HEADER_SIZE)
+        return size;
+    return op_paged_program(flash, address, data, size);
+}
+
+START_TEST(test_ringfs_write_buffer)
+{
+    printf("# test_ringfs_write_buffer\n");
+
+    /* 16-byte pages: two 8-byte slots each, the third one sits alone. */
+    struct ringfs_flash_partition paged_flash = flash;
+    paged_flash.page_size = 16;
+    paged_flash.program = op_paged_program;
+    page_crossings = 0;
+
+    struct ringfs fs;
+    uint8_t wbuf[16];
+    int obj;
+    ringfs_init(&fs, &paged_flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_write_buffer(&fs, wbuf, 8, 0) != 0);
+    ck_assert(ringfs_set_write_buffer(&fs, wbuf, sizeof(wbuf), 10) == 0);
+    ringfs_format(&fs);
+
+    printf("## one payload program per page\n");
+    program_count = 0;
+    ck_assert(ringfs_append(&fs, (int[]) { 1 }) == 0);
+    ck_assert_int_eq(program_count, 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+    ck_assert(ringfs_append(&fs, (int[]) { 2 }) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 2);
+    /* sector header + one page + two commits */
+    ck_assert_int_eq(program_count, 4);
+
+    printf("## flush on idle\n");
+    ck_assert(ringfs_append(&fs, (int[]) { 3 }) == 0);
+    ck_assert(ringfs_append(&fs, (int[]) { 4 }) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 3);
+    ck_assert_int_eq(ringfs_idle(&fs, 5), 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 3);
+    ck_assert_int_eq(ringfs_idle(&fs, 5), 1);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 4);
+    ck_assert_int_eq(ringfs_idle(&fs, 100), 0);
+    for (int i=1; i<=4; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+
+    printf("## mixed with batches and wraparound\n");
+    int total = 5, head = 5;
+    srand(12);
+    for (int i=0; i<300; i++) {
+        switch (rand() % 6) {
+            case 0: case 1: case 2:
+                ck_assert(ringfs_append(&fs, (int[]) { total++ }) == 0);
+                break;
+            case 3: {
+                int batch[2] = { total, total+1 };
+                ck_assert(ringfs_append_batch(&fs, batch, 2) == 0);
+                total += 2;
+                break;
+            }
+            case 4:
+                ck_assert(ringfs_flush(&fs) == 0);
+                assert_scan_integrity(&fs);
+                break;
+            case 5:
+                while (ringfs_fetch(&fs, &obj) == 0) {
+                    ck_assert_int_ge(obj, head);
+                    head = obj + 1;
+                }
+                ringfs_discard(&fs);
+                break;
+        }
+    }
+    ck_assert(ringfs_flush(&fs) == 0);
+    while (ringfs_fetch(&fs, &obj) == 0)
+        head = obj + 1;
+    ck_assert_int_eq(head, total);
+    ck_assert_int_eq(page_crossings, 0);
+
+    printf("## a torn flush leaves uncommitted slots\n");
+    struct ringfs scanned;
+    const int kept = ringfs_count_exact(&fs);
+    paged_flash.program = op_uncommitted_program;
+    ck_assert(ringfs_append(&fs, (int[]) { total }) == 0);
+    ck_assert(ringfs_append(&fs, (int[]) { total+1 }) == 0);
+    ck_assert(ringfs_flush(&fs) == 0);
+    paged_flash.program = op_paged_program;
+    ringfs_init(&scanned, &paged_flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&scanned) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&scanned), kept);
+    ck_assert(ringfs_append(&scanned, (int[]) { total+2 }) == 0);
+    for (int i=0; i<kept; i++) {
+        ck_assert(ringfs_fetch(&scanned, &obj) == 0);
+        ck_assert_int_lt(obj, total);
+    }
+    ck_assert(ringfs_fetch(&scanned, &obj) == 0);
+    ck_assert_int_eq(obj, total+2);
+
+    printf("## chunks packed by the deprecated cache\n");
+    ringfs_init(&fs, &paged_flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert_int_eq(ringfs_append_to_cache(&fs, (uint16_t[]) { 0 }, 2), -1);
+    ck_assert(ringfs_set_write_buffer(&fs, wbuf, sizeof(wbuf), 0) == 0);
+    ringfs_format(&fs);
+    ck_assert_int_eq(ringfs_append_to_cache(&fs, (uint8_t[5]) { 0 }, 5), -1);
+    for (uint16_t chunk=0; chunk<10; chunk++)
+        ck_assert_int_eq(ringfs_append_to_cache(&fs, &chunk, sizeof(chunk)), sizeof(chunk));
+    ck_assert(ringfs_flush(&fs) == 0);
+    /* The last object is still being filled. */
+    ck_assert_int_eq(ringfs_count_exact(&fs), 4);
+    for (int i=0; i<4; i++) {
+        uint16_t packed[2];
+        ck_assert(ringfs_fetch(&fs, packed) == 0);
+        ck_assert_int_eq(packed[0], 2*i);
+        ck_assert_int_eq(packed[1], 2*i+1);
+    }
+}
+END_TEST
+
+/* Memory-mapped flash simulation: maps are served from a RAM window. */
+static uint8_t map_window[64];
+static int map_count;
+
+static const void *op_map(struct ringfs_flash_partition *flash, ringfs_addr_t address, int size)
+{
+    (void) flash;
+    if (size > (int) sizeof(map_window))
+        return NULL;
+    map_count++;
+    flashsim_read(sim, address, map_window, size);
+    return map_window;
+}
+
+START_TEST(test_ringfs_peek)
+{
+    printf("# test_ringfs_peek\n");
+
+    struct ringfs_flash_partition mapped_flash = flash;
+    mapped_flash.map = op_map;
+
+    struct ringfs fs;
+    const void *ptr;
+    uint8_t buf[16];
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    for (int i=0; i<10; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    ck_assert(ringfs_fetch(&fs, buf) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+
+    printf("## no map, no buffer\n");
+    ck_assert_int_eq(ringfs_peek(&fs, &ptr), -1);
+
+    printf("## copy fallback\n");
+    ck_assert(ringfs_set_read_buffer(&fs, buf, sizeof(buf)) == 0);
+    for (int i=1; i<5; i++) {
+        ck_assert_int_eq(ringfs_peek(&fs, &ptr), sizeof(object_t));
+        ck_assert_int_eq(*(const int *) ptr, i);
+        ck_assert_int_eq(ringfs_peek(&fs, &ptr), sizeof(object_t));
+        ck_assert_int_eq(*(const int *) ptr, i);
+        ck_assert_int_eq(ringfs_advance(&fs), sizeof(object_t));
+    }
+    ck_assert_int_eq(ringfs_count_exact(&fs), 9);
+
+    printf("## mapped\n");
+    fs.flash = &mapped_flash;
+    ck_assert(ringfs_set_read_buffer(&fs, NULL, 0) == 0);
+    map_count = 0;
+    for (int i=5; i<10; i++) {
+        ck_assert_int_eq(ringfs_peek(&fs, &ptr), sizeof(object_t));
+        ck_assert_int_eq(*(const int *) ptr, i);
+        ck_assert_int_eq(ringfs_advance(&fs), sizeof(object_t));
+    }
+    ck_assert_int_eq(map_count, 5);
+    ck_assert_int_eq(ringfs_peek(&fs, &ptr), -1);
+    ck_assert_int_eq(ringfs_advance(&fs), -1);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+
+    printf("## variable-size records\n");
+    ringfs_init_ex(&fs, &mapped_flash, DEFAULT_VERSION, 16, RINGFS_VARIABLE);
+    ringfs_format(&fs);
+    ck_assert(ringfs_append_var(&fs, "hello", 5) == 0);
+    ck_assert(ringfs_append_var(&fs, "hi", 2) == 0);
+    ck_assert_int_eq(ringfs_peek(&fs, &ptr), 5);
+    ck_assert(memcmp(ptr, "hello", 5) == 0);
+    ck_assert_int_eq(ringfs_advance(&fs), 5);
+    fs.flash->map = NULL;
+    ck_assert(ringfs_set_read_buffer(&fs, buf, sizeof(buf)) == 0);
+    ck_assert_int_eq(ringfs_peek(&fs, &ptr), 2);
+    ck_assert(memcmp(ptr, "hi", 2) == 0);
+}
+END_TEST
+
+static int export_values[32];
+static int export_count;
+static int export_runs;
+static int export_limit;    /* runs taken before the sink stops the export, or -1 */
+
+static void export_reset(int limit)
+{
+    export_count = 0;
+    export_runs = 0;
+    export_limit = limit;
+}
+
+static int export_sink(void *context, const void *objects, int count, int stride)
+{
+    ck_assert_int_eq(stride, *(const int *) context);
+    if (export_runs == export_limit)
+        return -1;
+    for (int i=0; i<count; i++)
+        export_values[export_count++] = *(const int *) ((const uint8_t *) objects + i * stride);
+    export_runs++;
+    return 0;
+}
+
+static void assert_exported(const int *values, int count)
+{
+    ck_assert_int_eq(export_count, count);
+    for (int i=0; i<count; i++)
+        ck_assert_int_eq(export_values[i], values[i]);
+}
+
+START_TEST(test_ringfs_export)
+{
+    printf("# test_ringfs_export\n");
+
+    struct ringfs_flash_partition mapped_flash = flash;
+    mapped_flash.map = op_map;
+
+    struct ringfs fs, scanned;
+    int counts[6], obj;
+    uint8_t buf[16];
+    int stride = SLOT_HEADER_SIZE + sizeof(object_t);
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_count_table(&fs, counts, flash.sector_count) == 0);
+    ringfs_format(&fs);
+    for (int i=0; i<10; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    /* a garbage slot in the middle: sector 1, slot 1 */
+    uint32_t garbage = 0;
+    flashsim_program(sim, (flash.sector_offset + 1) * flash.sector_size + stride, (uint8_t *) &garbage,
+            sizeof(garbage));
+    ck_assert(ringfs_scan(&fs) == 0);
+    const int all[] = { 0, 1, 2, 3, 5, 6, 7, 8, 9 };
+
+    printf("## one read per sector, runs split at the garbage\n");
+    read_count = 0;
+    export_reset(-1);
+    ck_assert_int_eq(ringfs_export(&fs, export_sink, &stride, false), 9);
+    assert_exported(all, 9);
+    ck_assert_int_eq(export_runs, 5);
+    ck_assert_int_eq(read_count, 4);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 0);
+    ck_assert(ringfs_rewind(&fs) == 0);
+
+    printf("## read buffer\n");
+    ck_assert(ringfs_set_read_buffer(&fs, buf, sizeof(buf)) == 0);
+    export_reset(-1);
+    ck_assert_int_eq(ringfs_export(&fs, export_sink, &stride, false), 9);
+    assert_exported(all, 9);
+    ck_assert(ringfs_set_read_buffer(&fs, NULL, 0) == 0);
+
+    printf("## mapped\n");
+    fs.flash = &mapped_flash;
+    read_count = 0;
+    map_count = 0;
+    export_reset(-1);
+    ck_assert_int_eq(ringfs_export(&fs, export_sink, &stride, false), 9);
+    assert_exported(all, 9);
+    ck_assert_int_eq(read_count, 0);
+    ck_assert_int_eq(map_count, 4);
+    fs.flash = &flash;
+
+    printf("## sink stops, the runs taken are discarded\n");
+    export_reset(1);
+    ck_assert_int_eq(ringfs_export(&fs, export_sink, &stride, true), 3);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 6);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 3);
+    assert_scan_integrity(&fs);
+
+    printf("## cursor left ahead of the discard\n");
+    for (int i=0; i<3; i++)
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 7);
+    export_reset(2);
+    ck_assert_int_eq(ringfs_export(&fs, export_sink, &stride, true), 2);
+    assert_exported((int[]) { 3, 5 }, 2);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 4);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 2);
+    assert_scan_integrity(&fs);
+
+    printf("## everything\n");
+    export_reset(-1);
+    ck_assert_int_eq(ringfs_export(&fs, export_sink, &stride, true), 2);
+    assert_exported((int[]) { 8, 9 }, 2);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+    ringfs_init(&scanned, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&scanned) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&scanned), 0);
+    export_reset(-1);
+    ck_assert_int_eq(ringfs_export(&fs, export_sink, &stride, true), 0);
+    ck_assert_int_eq(export_runs, 0);
+
+    printf("## bitmap layout: payloads back to back\n");
+    stride = sizeof(object_t);
+    ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_SLOT_BITMAP);
+    ringfs_format(&fs);
+    for (int i=0; i<10; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    export_reset(-1);
+    ck_assert_int_eq(ringfs_export(&fs, export_sink, &stride, false), 10);
+    assert_exported((int[]) { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 }, 10);
+    ck_assert_int_eq(export_runs, 2);
+
+    printf("## not for variable-size records\n");
+    ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, 16, RINGFS_VARIABLE);
+    ringfs_format(&fs);
+    ck_assert_int_eq(ringfs_export(&fs, export_sink, &stride, false), -1);
+}
+END_TEST
+
+/* Erase requests handed over by the pool: all of them counted, the first few kept. */
+static int pending_erases[8];
+static int pending_count;
+static int erase_requests;
+
+static void erase_callback(const int32_t sector)
+{
+    erase_requests++;
+    if (pending_count < (int) (sizeof(pending_erases) / sizeof(pending_erases[0])))
+        pending_erases[pending_count++] = sector;
+}
+
+START_TEST(test_ringfs_page_align)
+{
+    printf("# test_ringfs_page_align\n");
+
+    /* 6-byte slots on 16-byte pages: packed, every other one straddles. */
+    struct ringfs_flash_partition paged_flash = flash;
+    paged_flash.page_size = 16;
+    paged_flash.program = op_paged_program;
+    page_crossings = 0;
+
+    struct ringfs fs;
+    uint16_t obj;
+    ck_assert(ringfs_init_ex(&fs, &paged_flash, DEFAULT_VERSION, 2, RINGFS_PAGE_ALIGN | RINGFS_SLOT_BITMAP) != 0);
+    ck_assert(ringfs_init_ex(&fs, &paged_flash, DEFAULT_VERSION, 2, RINGFS_PAGE_ALIGN) == 0);
+    ck_assert_int_eq(fs.slots_per_sector, 3);
+    ringfs_format(&fs);
+
+    printf("## no slot crosses a page\n");
+    for (int i=0; i<6; i++)
+        ck_assert(ringfs_append(&fs, (uint16_t[]) { 0x100 + i }) == 0);
+    ck_assert_int_eq(page_crossings, 0);
+    /* The third slot starts the sector's second page. */
+    flashsim_read(sim, flash.sector_offset * flash.sector_size + 16 + 4, (uint8_t *) &obj, sizeof(obj));
+    ck_assert_int_eq(obj, 0x102);
+
+    printf("## slots don't move across a rescan\n");
+    ck_assert(ringfs_scan(&fs) == 0);
+    for (int i=0; i<6; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, 0x100 + i);
+    }
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+
+    printf("## doesn't mount as the packed layout\n");
+    ringfs_init(&fs, &paged_flash, DEFAULT_VERSION, 2);
+    ck_assert(ringfs_scan(&fs) != 0);
+
+    printf("## packed programs are split at pages\n");
+    ringfs_format(&fs);
+    for (int i=0; i<8; i++)
+        ck_assert(ringfs_append(&fs, (uint16_t[]) { i }) == 0);
+    ck_assert_int_eq(page_crossings, 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 0);
+}
+END_TEST
+
+/* Vectored ops for the scatter-gather test. */
+static int programv_count, readv_count;
+
+static int op_programv(struct ringfs_flash_partition *flash, const struct ringfs_iovec *iov, int count)
+{
+    (void) flash;
+    programv_count++;
+    for (int i=0; i<count; i++)
+        flashsim_program(sim, iov[i].address, iov[i].data, iov[i].size);
+    return 0;
+}
+
+static int op_readv(struct ringfs_flash_partition *flash, const struct ringfs_read_iovec *iov, int count)
+{
+    (void) flash;
+    readv_count++;
+    for (int i=0; i<count; i++)
+        flashsim_read(sim, iov[i].address, iov[i].data, iov[i].size);
+    return 0;
+}
+
+START_TEST(test_ringfs_vectored)
+{
+    printf("# test_ringfs_vectored\n");
+
+    struct ringfs_flash_partition vectored_flash = flash;
+    vectored_flash.programv = op_programv;
+    vectored_flash.readv = op_readv;
+
+    struct ringfs fs;
+    int obj;
+    ringfs_init(&fs, &vectored_flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+
+    printf("## one transaction per append and fetch\n");
+    ck_assert(ringfs_append(&fs, (int[]) { 41 }) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    programv_count = readv_count = program_count = read_count = 0;
+    ck_assert(ringfs_append(&fs, (int[]) { 42 }) == 0);
+    ck_assert_int_eq(programv_count, 1);
+    ck_assert_int_eq(program_count, 0);
+    read_count = 0;
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 42);
+    ck_assert_int_eq(readv_count, 1);
+    ck_assert_int_eq(read_count, 0);
+
+    printf("## batch commits are grouped per sector\n");
+    /* Two slots written, one left in this sector: runs of 1 and 3. */
+    int objs[4] = { 100, 101, 102, 103 };
+    programv_count = 0;
+    ck_assert(ringfs_append_batch(&fs, objs, 4) == 0);
+    ck_assert_int_eq(programv_count, 2);
+
+    printf("## survives a rescan\n");
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 41);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 42);
+    for (int i=0; i<4; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, 100 + i);
+    }
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+
+    printf("## variable-size records\n");
+    char buf[16];
+    ringfs_init_ex(&fs, &vectored_flash, DEFAULT_VERSION, 16, RINGFS_VARIABLE);
+    ringfs_format(&fs);
+    ck_assert(ringfs_append_var(&fs, "hello", 5) == 0);
+    programv_count = program_count = 0;
+    ck_assert(ringfs_append_var(&fs, "hi", 2) == 0);
+    ck_assert_int_eq(programv_count, 1);
+    ck_assert_int_eq(program_count, 0);
+    ck_assert_int_eq(ringfs_fetch_var(&fs, buf, sizeof(buf)), 5);
+    ck_assert(memcmp(buf, "hello", 5) == 0);
+    ck_assert_int_eq(ringfs_fetch_var(&fs, buf, sizeof(buf)), 2);
+    ck_assert(memcmp(buf, "hi", 2) == 0);
+}
+END_TEST
+
+#ifdef RINGFS_STATS
+/* Fake clock: every flash operation takes exactly one tick. */
+static uint32_t ticks;
+
+static uint32_t op_timestamp(void)
+{
+    return ticks++;
+}
+
+START_TEST(test_ringfs_stats)
+{
+    printf("# test_ringfs_stats\n");
+
+    struct ringfs fs;
+    struct ringfs_stats stats;
+    int obj;
+    memset(&stats, 0, sizeof(stats));
+    stats.timestamp = op_timestamp;
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_SPSC) == 0);
+    ck_assert(ringfs_set_stats(&fs, &stats) != 0);
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_stats(&fs, &stats) == 0);
+
+    printf("## ops are counted per call\n");
+    ringfs_format(&fs);
+    ck_assert_int_eq(stats.ops[RINGFS_CALL_FORMAT][RINGFS_OP_ERASE], flash.sector_count);
+    ck_assert_int_eq(stats.ops[RINGFS_CALL_APPEND][RINGFS_OP_PROGRAM], 0);
+    for (int i=0; i<3; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    ck_assert_int_gt(stats.ops[RINGFS_CALL_APPEND][RINGFS_OP_PROGRAM], 0);
+    ck_assert_int_eq(stats.append_erases, 0);
+    ck_assert_int_eq(stats.header_bytes, 3 * 2 * 4);
+    ck_assert_int_eq(stats.payload_bytes, 3 * sizeof(object_t));
+
+    printf("## skipped slots\n");
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert_int_eq(stats.scan_skipped, 1);
+    fs.cursor.slot = 0;
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 1);
+    ck_assert_int_eq(stats.fetch_skipped, 1);
+
+    printf("## appends erase inline on wraparound\n");
+    for (int i=0; i<ringfs_capacity(&fs); i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    ck_assert_int_gt(stats.append_erases, 0);
+    ck_assert_int_eq(stats.append_erases, stats.ops[RINGFS_CALL_APPEND][RINGFS_OP_ERASE]);
+
+    printf("## and so do variable-size appends\n");
+    struct ringfs var_fs;
+    ringfs_init_ex(&var_fs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_VARIABLE);
+    ck_assert(ringfs_set_stats(&var_fs, &stats) == 0);
+    ringfs_format(&var_fs);
+    const uint32_t erases = stats.append_erases;
+    for (int i=0; i<2*ringfs_capacity(&var_fs); i++)
+        ck_assert(ringfs_append_var(&var_fs, &i, sizeof(i)) == 0);
+    ck_assert_int_gt(stats.ops[RINGFS_CALL_APPEND_VAR][RINGFS_OP_ERASE], 0);
+    ck_assert_int_eq(stats.append_erases - erases, stats.ops[RINGFS_CALL_APPEND_VAR][RINGFS_OP_ERASE]);
+
+    printf("## latency histograms\n");
+    uint32_t reads = 0, timed = 0;
+    for (int call=0; call<RINGFS_CALL_COUNT; call++)
+        reads += stats.ops[call][RINGFS_OP_READ];
+    for (int bucket=0; bucket<RINGFS_STATS_BUCKETS; bucket++)
+        timed += stats.latency[RINGFS_OP_READ][bucket];
+    ck_assert_int_eq(timed, reads);
+    ck_assert_int_eq(stats.latency[RINGFS_OP_READ][1], reads);
+    ck_assert_int_eq(stats.latency_max[RINGFS_OP_READ], 1);
+}
+END_TEST
+#endif
+
+START_TEST(test_ringfs_sequence)
+{
+    printf("# test_ringfs_sequence\n");
+
+    struct ringfs fs;
+    uint32_t seq;
+    int obj;
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t),
+                RINGFS_SEQUENCE | RINGFS_VARIABLE) != 0);
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t), 0) == 0);
+    ringfs_format(&fs);
+    ck_assert(ringfs_tell_seq(&fs, &seq) != 0);
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_SEQUENCE) == 0);
+    ck_assert(ringfs_scan(&fs) != 0);
+    /* The number takes a word next to the sector header. */
+    ck_assert_int_eq(fs.slots_per_sector, (flash.sector_size - SECTOR_HEADER_SIZE - 4) /
+                     (SLOT_HEADER_SIZE + (int) sizeof(object_t)));
+    ringfs_format(&fs);
+
+    printf("## objects are numbered from zero\n");
+    ck_assert(ringfs_tell_seq(&fs, &seq) == 0);
+    ck_assert_int_eq(seq, 0);
+    for (int i=0; i<7; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_tell_seq(&fs, &seq) == 0);
+    ck_assert_int_eq(seq, 2);
+
+    printf("## seek\n");
+    for (int i=0; i<7; i++) {
+        ck_assert(ringfs_seek_seq(&fs, (uint32_t) i) == 0);
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_seek_seq(&fs, 7) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+    ck_assert(ringfs_seek_seq(&fs, 8) != 0);
+
+    printf("## numbers survive overruns and remounts\n");
+    const int total = 3 * ringfs_capacity(&fs) + 1;
+    for (int i=7; i<total; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    ck_assert(ringfs_scan(&fs) == 0);
+    uint32_t first;
+    ck_assert(ringfs_tell_seq(&fs, &first) == 0);
+    ck_assert_int_gt(first, 0);
+    ck_assert(ringfs_seek_seq(&fs, first - 1) != 0);
+    for (uint32_t s=first; s<(uint32_t) total; s++) {
+        ck_assert(ringfs_seek_seq(&fs, s) == 0);
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, s);
+    }
+
+    printf("## an unnumbered write sector follows the last one\n");
+    while (fs.write.slot != 0)
+        ck_assert(ringfs_append(&fs, (int[]) { total }) == 0);
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert(ringfs_append(&fs, (int[]) { -1 }) == 0);
+    ck_assert(ringfs_seek_seq(&fs, fs.seq_base) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, -1);
+    ck_assert_int_eq(fs.seq_base % fs.slots_per_sector, 0);
+}
+END_TEST
+
+START_TEST(test_ringfs_key_range)
+{
+    printf("# test_ringfs_key_range\n");
+
+    struct ringfs fs;
+    int obj;
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t),
+                RINGFS_KEY_RANGE | RINGFS_SPSC) != 0);
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t), 0) == 0);
+    ck_assert(ringfs_set_key(&fs, 0, 4) != 0);
+    ck_assert(ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_KEY_RANGE) == 0);
+    ck_assert(ringfs_set_key(&fs, 1, 4) != 0);
+    ck_assert(ringfs_set_key(&fs, 0, 3) != 0);
+    ck_assert(ringfs_query_range(&fs, 0, 1, &obj) != 0);
+    ck_assert(ringfs_set_key(&fs, 0, 4) == 0);
+    /* The range takes two words next to the sector header. */
+    ck_assert_int_eq(fs.slots_per_sector, (flash.sector_size - SECTOR_HEADER_SIZE - 8) /
+                     (SLOT_HEADER_SIZE + (int) sizeof(object_t)));
+    ringfs_format(&fs);
+
+    printf("## only keys in range are returned\n");
+    const int total = ringfs_capacity(&fs) + fs.slots_per_sector / 2;
+    for (int i=0; i<total; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    const int first = total - ringfs_count_estimate(&fs);
+    const int lo = total - 2 * fs.slots_per_sector, hi = lo + 3;
+    for (int i=lo; i<=hi; i++) {
+        ck_assert(ringfs_query_range(&fs, (uint32_t) lo, (uint32_t) hi, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_query_range(&fs, (uint32_t) lo, (uint32_t) hi, &obj) != 0);
+    ck_assert(ringfs_query_range(&fs, 1, 0, &obj) != 0);
+
+    printf("## sectors out of range aren't read\n");
+    ringfs_rewind(&fs);
+    read_count = 0;
+    ck_assert(ringfs_query_range(&fs, (uint32_t) total - 1, (uint32_t) total - 1, &obj) == 0);
+    ck_assert_int_eq(obj, total - 1);
+    const int query_reads = read_count;
+    ringfs_rewind(&fs);
+    read_count = 0;
+    while (ringfs_fetch(&fs, &obj) == 0)
+        ;
+    ck_assert_int_lt(query_reads, read_count);
+    ringfs_rewind(&fs);
+    ck_assert(ringfs_query_range(&fs, 0, (uint32_t) first - 1, &obj) != 0);
+    ringfs_rewind(&fs);
+    ck_assert(ringfs_query_range(&fs, 0, UINT32_MAX, &obj) == 0);
+    ck_assert_int_eq(obj, first);
+
+    printf("## the range is rebuilt after a remount\n");
+    ck_assert(ringfs_scan(&fs) == 0);
+    while (fs.write.slot != 0)
+        ck_assert(ringfs_append(&fs, (int[]) { 1000000 }) == 0);
+    ck_assert(ringfs_append(&fs, (int[]) { 0 }) == 0);
+    ringfs_rewind(&fs);
+    ck_assert(ringfs_query_range(&fs, 1000000, 1000000, &obj) == 0);
+    ck_assert_int_eq(obj, 1000000);
+    ck_assert(ringfs_query_range(&fs, 0, 0, &obj) == 0);
+    ck_assert_int_eq(fs.cursor.sector, fs.write.sector);
+    ringfs_rewind(&fs);
+    ck_assert(ringfs_query_range(&fs, (uint32_t) total - 1, (uint32_t) total - 1, &obj) == 0);
+    ck_assert_int_eq(obj, total - 1);
+}
+END_TEST
+
+static void assert_group_scan(struct ringfs_flash_partition *part, struct ringfs *fs)
+{
+    struct ringfs groupfs, linearfs;
+    ringfs_init_ex(&groupfs, part, DEFAULT_VERSION, sizeof(object_t), RINGFS_SECTOR_GROUPS);
+    ringfs_init_ex(&linearfs, part, DEFAULT_VERSION, sizeof(object_t),
+            RINGFS_SECTOR_GROUPS | RINGFS_LINEAR_SCAN);
+    ck_assert(ringfs_scan(&groupfs) == 0);
+    ck_assert(ringfs_scan(&linearfs) == 0);
+    assert_scan_equal(&groupfs, &linearfs);
+    assert_scan_equal(&groupfs, fs);
+}
+
+START_TEST(test_ringfs_sector_groups)
+{
+    printf("# test_ringfs_sector_groups\n");
+
+    /* The whole simulator: 10 sectors in groups of 4, 4 and 2. */
+    struct ringfs_flash_partition part = flash;
+    part.sector_offset = 0;
+    part.sector_count = 10;
+    const int group_offs = part.sector_size - SECTOR_HEADER_SIZE - 4;
+
+    struct ringfs fs;
+    int obj;
+    ck_assert(ringfs_init_ex(&fs, &part, DEFAULT_VERSION, sizeof(object_t),
+                RINGFS_SECTOR_GROUPS | RINGFS_SPSC) != 0);
+    part.sector_count = 2;
+    ck_assert(ringfs_init_ex(&fs, &part, DEFAULT_VERSION, sizeof(object_t), RINGFS_SECTOR_GROUPS) != 0);
+    part.sector_count = 10;
+    ck_assert(ringfs_init_ex(&fs, &part, DEFAULT_VERSION, sizeof(object_t), RINGFS_SECTOR_GROUPS) == 0);
+    ck_assert_int_eq(fs.group_size, 4);
+    ringfs_format(&fs);
+    assert_group_scan(&part, &fs);
+
+    printf("## same heads as a full scan\n");
+    uint32_t seed = 2468;
+    for (int i=0; i<600; i++) {
+        seed = seed * 1103515245 + 12345;
+        switch ((seed >> 16) % 8) {
+            case 0: case 1: case 2: case 3: ringfs_append(&fs, (int[]) { i }); break;
+            case 4: ringfs_fetch(&fs, &obj); break;
+            case 5: ringfs_discard(&fs); break;
+            case 6: ringfs_rewind(&fs); break;
+            case 7:
+                if (!loc_equal(&fs.read, &fs.cursor))
+                    ringfs_item_discard(&fs);
+                break;
+        }
+        assert_group_scan(&part, &fs);
+    }
+
+    printf("## power loss before the previous group is closed\n");
+    ringfs_format(&fs);
+    while (fs.write.sector != fs.group_size)
+        ck_assert(ringfs_append(&fs, (int[]) { 0 }) == 0);
+    ck_assert(ringfs_append(&fs, (int[]) { 1 }) == 0);
+    ck_assert(sim->data[group_offs] != 0xFF);
+    memset(&sim->data[group_offs], 0xFF, 4);
+    assert_group_scan(&part, &fs);
+    ck_assert(sim->data[group_offs] != 0xFF);
+
+    printf("## groups that don't add up fall back to a full scan\n");
+    for (int i=0; i<2*ringfs_capacity(&fs); i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    for (int leader=0; leader<part.sector_count; leader+=fs.group_size)
+        memset(&sim->data[leader*part.sector_size + group_offs], 0xFF, 4);
+    assert_group_scan(&part, &fs);
+    for (int i=2*ringfs_capacity(&fs)-ringfs_count_exact(&fs); i<2*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+
+    printf("## fewer header reads on a large partition\n");
+    struct flashsim *small = sim;
+    sim = flashsim_open(NULL, 32 * 400, 32);
+    part.sector_count = 400;
+    ringfs_init_ex(&fs, &part, DEFAULT_VERSION, sizeof(object_t), RINGFS_SECTOR_GROUPS);
+    ringfs_format(&fs);
+    for (int i=0; i<3*ringfs_capacity(&fs)/2; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    struct ringfs groupfs, linearfs;
+    ringfs_init_ex(&groupfs, &part, DEFAULT_VERSION, sizeof(object_t), RINGFS_SECTOR_GROUPS);
+    ringfs_init_ex(&linearfs, &part, DEFAULT_VERSION, sizeof(object_t),
+            RINGFS_SECTOR_GROUPS | RINGFS_LINEAR_SCAN);
+    read_count = 0;
+    ck_assert(ringfs_scan(&groupfs) == 0);
+    const int group_reads = read_count;
+    read_count = 0;
+    ck_assert(ringfs_scan(&linearfs) == 0);
+    assert_scan_equal(&groupfs, &linearfs);
+    ck_assert_int_lt(4 * group_reads, read_count);
+    flashsim_close(sim);
+    sim = small;
+}
+END_TEST
+
+START_TEST(test_ringfs_cursors)
+{
+    printf("# test_ringfs_cursors\n");
+
+    struct ringfs fs;
+    struct ringfs_cursor uplink, dump;
+    int obj;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    ck_assert(ringfs_cursor_open(&fs, &uplink) == 0);
+    ck_assert(ringfs_cursor_open(&fs, &dump) == 0);
+    for (int i=0; i<6; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+
+    printf("## each cursor reads everything\n");
+    for (int i=0; i<6; i++) {
+        ck_assert(ringfs_cursor_fetch(&fs, &uplink, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_cursor_fetch(&fs, &uplink, &obj) != 0);
+    for (int i=0; i<2; i++) {
+        ck_assert(ringfs_cursor_fetch(&fs, &dump, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+
+    printf("## the read head follows the slowest cursor\n");
+    ck_assert(ringfs_cursor_discard(&fs, &uplink) == 0);
+    ck_assert_int_eq(ringfs_count_estimate(&fs), 6);
+    ck_assert(ringfs_cursor_discard(&fs, &dump) == 0);
+    ck_assert_int_eq(ringfs_count_estimate(&fs), 4);
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_estimate(&fs), 4);
+
+    printf("## rewind to the last discard\n");
+    ck_assert(ringfs_cursor_open(&fs, &dump) != 0);
+    ck_assert(ringfs_cursor_fetch(&fs, &dump, &obj) == 0);
+    ck_assert(ringfs_cursor_discard(&fs, &dump) == 0);
+    ck_assert(ringfs_cursor_fetch(&fs, &dump, &obj) == 0);
+    ck_assert(ringfs_cursor_rewind(&fs, &dump) == 0);
+    ck_assert(ringfs_cursor_fetch(&fs, &dump, &obj) == 0);
+    ck_assert_int_eq(obj, 3);
+    ck_assert(ringfs_cursor_fetch(&fs, &uplink, &obj) == 0);
+    ck_assert_int_eq(obj, 2);
+
+    printf("## closing a cursor lets the others discard\n");
+    ck_assert(ringfs_cursor_close(&fs, &uplink) == 0);
+    ck_assert(ringfs_cursor_close(&fs, &uplink) != 0);
+    ck_assert(ringfs_cursor_discard(&fs, &dump) == 0);
+    ck_assert_int_eq(ringfs_count_estimate(&fs), 2);
+
+    printf("## overruns move every cursor\n");
+    ck_assert(ringfs_cursor_open(&fs, &uplink) == 0);
+    const int total = ringfs_capacity(&fs) + fs.slots_per_sector;
+    for (int i=6; i<total; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    struct ringfs_cursor *cursors[] = { &uplink, &dump };
+    for (int c=0; c<2; c++) {
+        int last = -1;
+        while (ringfs_cursor_fetch(&fs, cursors[c], &obj) == 0) {
+            ck_assert_int_gt(obj, last);
+            last = obj;
+        }
+        ck_assert_int_eq(last, total - 1);
+        ck_assert(ringfs_cursor_discard(&fs, cursors[c]) == 0);
+    }
+    ck_assert_int_eq(ringfs_count_estimate(&fs), 0);
+
+    printf("## the built-in discard pulls cursors along\n");
+    ck_assert(ringfs_append(&fs, (int[]) { 42 }) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert(ringfs_cursor_fetch(&fs, &uplink, &obj) != 0);
+    ck_assert(ringfs_cursor_rewind(&fs, &dump) == 0);
+    ck_assert(ringfs_cursor_fetch(&fs, &dump, &obj) != 0);
+}
+END_TEST
+
+/* Same geometry as the fixture, with the bus lock a two-task driver needs. */
+static pthread_mutex_t spsc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int op_locked_sector_erase(struct ringfs_flash_partition *flash, ringfs_addr_t address)
+{
+    (void) flash;
+    pthread_mutex_lock(&spsc_lock);
+    erase_count++;
+    flashsim_sector_erase(sim, address);
+    pthread_mutex_unlock(&spsc_lock);
+    return 0;
+}
+
+static int op_locked_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    (void) flash;
+    pthread_mutex_lock(&spsc_lock);
+    flashsim_program(sim, address, data, size);
+    pthread_mutex_unlock(&spsc_lock);
+    return size;
+}
+
+static int op_locked_read(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int size)
+{
+    (void) flash;
+    pthread_mutex_lock(&spsc_lock);
+    flashsim_read(sim, address, data, size);
+    pthread_mutex_unlock(&spsc_lock);
+    return size;
+}
+
+static struct ringfs_flash_partition locked_flash = {
+    .sector_size = 32,
+    .sector_offset = 4,
+    .sector_count = 6,
+
+    .sector_erase = op_locked_sector_erase,
+    .program = op_locked_program,
+    .read = op_locked_read,
+};
+
+#define SPSC_OBJECTS 20000
+
+static void *spsc_producer(void *arg)
+{
+    struct ringfs *fs = arg;
+    /* An append fails while the consumer is in the sector it has to erase. */
+    for (int i=0; i<SPSC_OBJECTS; i++)
+        while (ringfs_append(fs, &i) != 0)
+            ;
+    return NULL;
+}
+
+START_TEST(test_ringfs_spsc)
+{
+    printf("# test_ringfs_spsc\n");
+
+    struct ringfs fs;
+    uint8_t buffer[64];
+    int obj;
+    ck_assert(ringfs_init_ex(&fs, &locked_flash, DEFAULT_VERSION, sizeof(object_t),
+                RINGFS_SPSC | RINGFS_SLOT_BITMAP) != 0);
+    ck_assert(ringfs_init_ex(&fs, &locked_flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_SPSC) == 0);
+    ck_assert(ringfs_set_read_buffer(&fs, buffer, sizeof(buffer)) != 0);
+    ck_assert(ringfs_set_erase_ahead(&fs, 2, NULL) != 0);
+    ck_assert(ringfs_format(&fs) == 0);
+
+    printf("## overrun: the consumer catches up on its own\n");
+    const int total = ringfs_capacity(&fs) + 2 * fs.slots_per_sector;
+    for (int i=0; i<total; i++)
+        ck_assert(ringfs_append(&fs, &i) == 0);
+    ck_assert_int_le(ringfs_count_estimate(&fs), ringfs_capacity(&fs));
+    int last = -1;
+    while (ringfs_fetch(&fs, &obj) == 0) {
+        ck_assert_int_gt(obj, last);
+        last = obj;
+    }
+    ck_assert_int_eq(last, total - 1);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_estimate(&fs), 0);
+    const void *object;
+    ck_assert(ringfs_peek(&fs, &object) < 0);
+
+    printf("## the producer never waits for a pinned sector\n");
+    do
+        ck_assert(ringfs_append(&fs, &total) == 0);
+    while (fs.write.slot != 0);
+    /* the next append reclaims the sector after, mid-fetch for the consumer */
+    const uint32_t reclaims = fs.spsc.reclaims;
+    fs.spsc.pin = (fs.write.sector + 1) % locked_flash.sector_count;
+    erase_count = 0;
+    ck_assert(ringfs_append(&fs, &total) != 0);
+    ck_assert(ringfs_append(&fs, &total) != 0);
+    ck_assert_int_eq(erase_count, 0);
+    ck_assert_int_eq(fs.spsc.reclaims, reclaims + 1);
+    fs.spsc.pin = -1;
+    ck_assert(ringfs_append(&fs, &total) == 0);
+    ck_assert_int_eq(erase_count, 1);
+    ck_assert_int_eq(fs.spsc.reclaims, reclaims + 1);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, total);
+
+    printf("## concurrent producer and consumer\n");
+    ck_assert(ringfs_format(&fs) == 0);
+    pthread_t producer;
+    ck_assert(pthread_create(&producer, NULL, spsc_producer, &fs) == 0);
+    last = -1;
+    int fetched = 0;
+    while (last != SPSC_OBJECTS - 1) {
+        if (ringfs_fetch(&fs, &obj) != 0)
+            continue;
+        ck_assert_int_gt(obj, last);
+        last = obj;
+        if (++fetched % 4 == 0)
+            ck_assert(ringfs_discard(&fs) == 0);
+        else
+            ck_assert(ringfs_item_discard(&fs) == 0);
+    }
+    ck_assert(pthread_join(producer, NULL) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+    printf("## fetched %d of %d\n", fetched, SPSC_OBJECTS);
+
+    /* Both sides idle: a scan agrees with what was left. */
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+}
+END_TEST
+
+#define QUEUE_PRODUCERS 3
+#define QUEUE_OBJECTS 5000
+
+static void *queue_producer(void *arg)
+{
+    struct ringfs_queue *q = arg;
+    static int next_id;
+    const int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED) % QUEUE_PRODUCERS;
+    for (int i=0; i<QUEUE_OBJECTS; i++) {
+        const int obj = id << 24 | i;
+        while (ringfs_queue_push(q, &obj) != 0)
+            ;
+    }
+    return NULL;
+}
+
+/* Pushes into a queue from the first program after it's armed, as an ISR would. */
+static struct ringfs_queue *pushing_queue;
+static int pushing_result;
+
+static int op_pushing_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    if (pushing_queue) {
+        const int obj = 100;
+        pushing_result = ringfs_queue_push(pushing_queue, &obj);
+        pushing_queue = NULL;
+    }
+    return op_program(flash, address, data, size);
+}
+
+START_TEST(test_ringfs_queue)
+{
+    printf("# test_ringfs_queue\n");
+
+    struct ringfs fs;
+    struct ringfs_queue q;
+    uint8_t buffer[RINGFS_QUEUE_BUFFER_SIZE(8, sizeof(object_t))];
+    int obj;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    ck_assert(ringfs_queue_init(&q, &fs, buffer, 6, 0) != 0);
+    ck_assert(ringfs_queue_init(&q, &fs, buffer, 8, 0) == 0);
+
+    printf("## overflow rejects new objects\n");
+    for (int i=0; i<10; i++)
+        ck_assert_int_eq(ringfs_queue_push(&q, &i), i < 8 ? 0 : -1);
+    ck_assert_int_eq(ringfs_queue_depth(&q), 8);
+    ck_assert_int_eq(q.stats.pushed, 8);
+    ck_assert_int_eq(q.stats.rejected, 2);
+    ck_assert_int_eq(q.stats.high_water, 8);
+
+    printf("## group commit, split at the queue wraparound\n");
+    ck_assert_int_eq(ringfs_queue_flush(&q, 3), 3);
+    for (int i=10; i<13; i++)
+        ck_assert(ringfs_queue_push(&q, &i) == 0);
+    ck_assert_int_eq(ringfs_queue_flush(&q, 100), 8);
+    ck_assert_int_eq(q.stats.commits, 3);
+    ck_assert_int_eq(q.stats.committed, 11);
+    ck_assert_int_eq(ringfs_queue_depth(&q), 0);
+    const int expected[] = { 0, 1, 2, 3, 4, 5, 6, 7, 10, 11, 12 };
+    for (int i=0; i<11; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, expected[i]);
+    }
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+
+    printf("## overflow drops the oldest objects\n");
+    ck_assert(ringfs_queue_init(&q, &fs, buffer, 8, RINGFS_QUEUE_DROP_OLDEST) == 0);
+    for (int i=0; i<12; i++)
+        ck_assert(ringfs_queue_push(&q, &i) == 0);
+    ck_assert_int_eq(q.stats.dropped, 4);
+    ck_assert_int_eq(q.stats.rejected, 0);
+    ck_assert_int_eq(ringfs_queue_emergency_flush(&q), 8);
+    for (int i=4; i<12; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_discard(&fs) == 0);
+
+    printf("## emergency flush refuses to interrupt a drain\n");
+    ck_assert(ringfs_queue_push(&q, &obj) == 0);
+    q.busy = 1;
+    ck_assert(ringfs_queue_emergency_flush(&q) < 0);
+    q.busy = 0;
+    ck_assert_int_eq(ringfs_queue_emergency_flush(&q), 1);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+
+    printf("## a push during a drain doesn't drop what it can't replace\n");
+    struct ringfs_flash_partition pushing_flash = flash;
+    pushing_flash.program = op_pushing_program;
+    ringfs_init(&fs, &pushing_flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert(ringfs_queue_init(&q, &fs, buffer, 8, RINGFS_QUEUE_DROP_OLDEST) == 0);
+    for (int i=0; i<8; i++)
+        ck_assert(ringfs_queue_push(&q, &i) == 0);
+    pushing_queue = &q;
+    ck_assert_int_eq(ringfs_queue_flush(&q, 2), 2);
+    ck_assert_int_eq(pushing_result, -1);
+    ck_assert_int_eq(q.stats.dropped, 0);
+    ck_assert_int_eq(q.stats.rejected, 1);
+    ck_assert_int_eq(ringfs_queue_depth(&q), 6);
+    obj = 100;
+    ck_assert(ringfs_queue_push(&q, &obj) == 0);
+    ck_assert_int_eq(ringfs_queue_flush(&q, 100), 7);
+    const int survivors[] = { 0, 1, 2, 3, 4, 5, 6, 7, 100 };
+    for (int i=0; i<9; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, survivors[i]);
+    }
+    ck_assert(ringfs_discard(&fs) == 0);
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&fs) == 0);
+
+    printf("## concurrent producers keep their own order\n");
+    ck_assert(ringfs_queue_init(&q, &fs, buffer, 8, 0) == 0);
+    pthread_t producers[QUEUE_PRODUCERS];
+    for (int i=0; i<QUEUE_PRODUCERS; i++)
+        ck_assert(pthread_create(&producers[i], NULL, queue_producer, &q) == 0);
+    int next[QUEUE_PRODUCERS] = { 0 };
+    int received = 0;
+    while (received < QUEUE_PRODUCERS * QUEUE_OBJECTS) {
+        ck_assert(ringfs_queue_flush(&q, fs.slots_per_sector) >= 0);
+        while (ringfs_fetch(&fs, &obj) == 0) {
+            const int id = obj >> 24;
+            ck_assert_int_lt(id, QUEUE_PRODUCERS);
+            ck_assert_int_eq(obj & 0xffffff, next[id]);
+            next[id]++;
+            received++;
+        }
+        ck_assert(ringfs_discard(&fs) == 0);
+    }
+    for (int i=0; i<QUEUE_PRODUCERS; i++)
+        ck_assert(pthread_join(producers[i], NULL) == 0);
+    ck_assert_int_eq(q.stats.committed, QUEUE_PRODUCERS * QUEUE_OBJECTS);
+}
+END_TEST
+
+START_TEST(test_ringfs_pack)
+{
+    printf("# test_ringfs_pack\n");
+
+    struct reading { uint32_t time; uint16_t temp; uint16_t seq; } in, out;
+    struct ringfs fs;
+    struct ringfs_pack p;
+    uint32_t buffer[RINGFS_PACK_BUFFER_SIZE(20, sizeof(struct reading)) / 4];
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, 20);
+    ck_assert(ringfs_pack_init(&p, &fs, sizeof(in), buffer) != 0);
+    ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, 8, RINGFS_VARIABLE);
+    ck_assert(ringfs_pack_init(&p, &fs, sizeof(in), buffer) != 0);
+    ringfs_init_ex(&fs, &flash, DEFAULT_VERSION, 20, RINGFS_VARIABLE);
+    ringfs_format(&fs);
+    ck_assert(ringfs_pack_init(&p, &fs, sizeof(in), buffer) == 0);
+
+    printf("## objects come back as they went in\n");
+    for (int i=0; i<12; i++) {
+        in = (struct reading) { 1000 + 10 * i, 200 - i % 3, i };
+        ck_assert(ringfs_pack_append(&p, &in) == 0);
+    }
+    /* Full blocks were written out, the last one is still staged. */
+    ck_assert_int_gt(p.stats.objects, 0);
+    ck_assert_int_lt(p.stats.objects, 12);
+    ck_assert(ringfs_pack_flush(&p) == 0);
+    ck_assert(ringfs_pack_flush(&p) == 0);
+    ck_assert_int_eq(p.stats.objects, 12);
+    ck_assert_int_eq(p.stats.blocks, 3);
+    ck_assert_int_lt(p.stats.packed_bytes * 3, p.stats.raw_bytes * 2);
+    for (int i=0; i<12; i++) {
+        ck_assert(ringfs_pack_fetch(&p, &out) == 0);
+        ck_assert_int_eq(out.time, 1000 + 10 * i);
+        ck_assert_int_eq(out.temp, 200 - i % 3);
+        ck_assert_int_eq(out.seq, i);
+    }
+    ck_assert(ringfs_pack_fetch(&p, &out) != 0);
+
+    printf("## a block read partly isn't discarded\n");
+    ck_assert(ringfs_pack_rewind(&p) == 0);
+    for (int i=0; i<7; i++)
+        ck_assert(ringfs_pack_fetch(&p, &out) == 0);
+    ck_assert(ringfs_pack_discard(&p) == 0);
+    ck_assert(ringfs_pack_fetch(&p, &out) == 0);
+    ck_assert_int_eq(out.seq, 7);
+    ck_assert(ringfs_pack_rewind(&p) == 0);
+    ck_assert(ringfs_pack_fetch(&p, &out) == 0);
+    const int kept = out.seq;
+    ck_assert_int_gt(kept, 0);
+    ck_assert_int_le(kept, 6);
+
+    printf("## remount\n");
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert(ringfs_pack_init(&p, &fs, sizeof(in), buffer) == 0);
+    ck_assert(ringfs_pack_fetch(&p, &out) == 0);
+    ck_assert_int_eq(out.seq, kept);
+
+    printf("## large differences\n");
+    ck_assert(ringfs_pack_rewind(&p) == 0);
+    const uint32_t times[] = { 0, UINT32_MAX, 0x80000000, 1, 0x7FFFFFFF };
+    for (int i=0; i<5; i++) {
+        in = (struct reading) { times[i], 0xFFFF * (i & 1), 0 };
+        ck_assert(ringfs_pack_append(&p, &in) == 0);
+    }
+    ck_assert(ringfs_pack_flush(&p) == 0);
+    for (int i=kept; i<12; i++)
+        ck_assert(ringfs_pack_fetch(&p, &out) == 0);
+    for (int i=0; i<5; i++) {
+        ck_assert(ringfs_pack_fetch(&p, &out) == 0);
+        ck_assert_int_eq(out.time, times[i]);
+        ck_assert_int_eq(out.temp, 0xFFFF * (i & 1));
+    }
+    ck_assert(ringfs_pack_fetch(&p, &out) != 0);
+}
+END_TEST
+
+START_TEST(test_ringfs_erase_ahead)
+{
+    printf("# test_ringfs_erase_ahead\n");
+
+    struct ringfs fs;
+    int obj;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_erase_ahead(&fs, 0, NULL) != 0);
+    ck_assert(ringfs_set_erase_ahead(&fs, flash.sector_count, NULL) != 0);
+    ck_assert(ringfs_set_erase_ahead(&fs, 2, erase_callback) == 0);
+    ringfs_format(&fs);
+    ck_assert_int_eq(ringfs_capacity(&fs), fs.slots_per_sector * (flash.sector_count - 2));
+
+    printf("## serviced pool: appends never erase\n");
+    pending_count = 0;
+    int total = 0;
+    for (int round=0; round<4*flash.sector_count; round++) {
+        erase_count = 0;
+        erase_requests = 0;
+        for (int i=0; i<fs.slots_per_sector; i++)
+            ck_assert(ringfs_append(&fs, (int[]) { total++ }) == 0);
+        ck_assert_int_eq(erase_count, 0);
+        /* one request per sector entered, once past the ones erased by the format */
+        ck_assert_int_eq(erase_requests, round >= flash.sector_count - 2);
+
+        /* a low priority task erases whatever was handed over */
+        while (pending_count > 0)
+            ringfs_erase_sector(&fs, pending_erases[--pending_count]);
+        ck_assert(ringfs_service(&fs) == 0);
+        assert_scan_integrity(&fs);
+    }
+    ck_assert_int_eq(ringfs_count_exact(&fs), ringfs_capacity(&fs));
+    for (int i=total-ringfs_capacity(&fs); i<total; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+
+    printf("## unserviced pool: appends erase inline\n");
+    erase_requests = 0;
+    for (int i=0; i<3*ringfs_capacity(&fs); i++)
+        ck_assert(ringfs_append(&fs, (int[]) { total++ }) == 0);
+    ck_assert_int_eq(erase_requests, 3 * (flash.sector_count - 2));
+    ck_assert_int_eq(pending_count, (int) (sizeof(pending_erases) / sizeof(pending_erases[0])));
+    assert_scan_integrity(&fs);
+    ck_assert(ringfs_rewind(&fs) == 0);
+    int count = ringfs_count_exact(&fs);
+    ck_assert_int_le(count, ringfs_capacity(&fs));
+    ck_assert_int_gt(count, ringfs_capacity(&fs) - fs.slots_per_sector);
+    for (int i=total-count; i<total; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+
+    printf("## stale erase requests are ignored\n");
+    erase_count = 0;
+    while (pending_count > 0)
+        ringfs_erase_sector(&fs, pending_erases[--pending_count]);
+    while (ringfs_service(&fs))
+        ;
+    ck_assert(ringfs_rewind(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), count);
+}
+END_TEST
+
+/* DMA simulation: a transfer is carried out after a few polls. */
+static struct {
+    ringfs_addr_t address;
+    const void *source;
+    void *dest;
+    int size;
+    int polls;
+    int started;
+    int fail_on;    /* program_start to fail after writing half, counting from 1 */
+} dma = { .address = -1 };
+
+static int op_program_start(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    (void) flash;
+    ck_assert_int_eq(dma.address, -1);
+    if (++dma.started == dma.fail_on) {
+        op_program(flash, address, data, size / 2);
+        return -1;
+    }
+    dma.address = address;
+    dma.source = data;
+    dma.dest = NULL;
+    dma.size = size;
+    dma.polls = 2;
+    return 0;
+}
+
+static int op_read_start(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int size)
+{
+    (void) flash;
+    ck_assert_int_eq(dma.address, -1);
+    dma.address = address;
+    dma.source = NULL;
+    dma.dest = data;
+    dma.size = size;
+    dma.polls = 2;
+    dma.started++;
+    return 0;
+}
+
+static int op_transfer_busy(struct ringfs_flash_partition *flash)
+{
+    if (dma.address < 0)
+        return 0;
+    if (--dma.polls > 0)
+        return 1;
+    if (dma.source)
+        op_program(flash, dma.address, dma.source, dma.size);
+    else
+        op_read(flash, dma.address, dma.dest, dma.size);
+    dma.address = -1;
+    return 0;
+}
+
+static int async_results[4];
+static int async_completions;
+
+static void async_done(struct ringfs *fs, int32_t result, void *context)
+{
+    (void) fs;
+    ck_assert(context == async_results);
+    async_results[async_completions++ % 4] = result;
+}
+
+START_TEST(test_ringfs_async)
+{
+    printf("# test_ringfs_async\n");
+
+    struct ringfs_flash_partition dma_flash = flash;
+    dma_flash.program_start = op_program_start;
+    dma_flash.read_start = op_read_start;
+    dma_flash.transfer_busy = op_transfer_busy;
+    dma.address = -1;
+    async_completions = 0;
+
+    struct ringfs fs;
+    int obj;
+    ringfs_init_ex(&fs, &dma_flash, DEFAULT_VERSION, sizeof(object_t), RINGFS_SLOT_BITMAP);
+    ck_assert(ringfs_append_async(&fs, (int[]) { 0 }, async_done, async_results) != 0);
+    ringfs_init(&fs, &dma_flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    ck_assert(ringfs_fetch_async(&fs, &obj, async_done, async_results) != 0);
+
+    printf("## append: reserve, write, commit, one transfer at a time\n");
+    const int value = 42;
+    dma.started = 0;
+    ck_assert(ringfs_append_async(&fs, &value, async_done, async_results) == 0);
+    ck_assert(ringfs_append_async(&fs, &value, async_done, async_results) != 0);
+    int polls = 0;
+    while (ringfs_async_poll(&fs)) {
+        /* Nothing is committed before the last transfer is through. */
+        ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+        polls++;
+    }
+    ck_assert_int_eq(dma.started, 3);
+    ck_assert_int_ge(polls, 3);
+    ck_assert_int_eq(async_completions, 1);
+    ck_assert_int_eq(async_results[0], 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 1);
+    ck_assert_int_eq(ringfs_async_poll(&fs), 0);
+
+    printf("## a power cut before the commit loses only that object\n");
+    const int torn = 7;
+    dma.started = 0;
+    ck_assert(ringfs_append_async(&fs, &torn, async_done, async_results) == 0);
+    while (dma.started < 3)
+        ck_assert_int_eq(ringfs_async_poll(&fs), 1);
+    dma.address = -1;
+    ringfs_init(&fs, &dma_flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 1);
+
+    printf("## fetch skips the torn slot\n");
+    for (int i=1; i<3; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    const int expected[] = { 42, 1, 2 };
+    for (int i=0; i<3; i++) {
+        ck_assert(ringfs_fetch_async(&fs, &obj, async_done, async_results) == 0);
+        while (ringfs_async_poll(&fs))
+            ;
+        ck_assert_int_eq(async_results[(async_completions - 1) % 4], 0);
+        ck_assert_int_eq(obj, expected[i]);
+    }
+    ck_assert(ringfs_fetch_async(&fs, &obj, async_done, async_results) != 0);
+    ck_assert_int_eq(async_completions, 4);
+
+    printf("## a failed write isn't programmed over\n");
+    const int failing = 0x0F0F0F0F;
+    ringfs_format(&fs);
+    dma.started = 0;
+    dma.fail_on = 2;
+    ck_assert(ringfs_append_async(&fs, &failing, async_done, async_results) == 0);
+    while (ringfs_async_poll(&fs))
+        ;
+    dma.fail_on = 0;
+    ck_assert_int_eq(async_results[(async_completions - 1) % 4], -1);
+    ck_assert(ringfs_append(&fs, (int[]) { 0x70707070 }) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 0x70707070);
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    assert_scan_integrity(&fs);
+
+    printf("## synchronous flash\n");
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    for (int i=0; i<2*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_append_async(&fs, &i, NULL, NULL) == 0);
+        ck_assert_int_eq(ringfs_async_poll(&fs), 0);
+    }
+    for (int i=ringfs_capacity(&fs); i<2*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_fetch_async(&fs, &obj, NULL, NULL) == 0);
+        ck_assert_int_eq(ringfs_async_poll(&fs), 0);
+        ck_assert_int_eq(obj, i);
+    }
+    assert_scan_integrity(&fs);
+}
+END_TEST
+
+/* Background erase simulation: the erase completes after a few polls. */
+static int async_erase_address = -1;
+static int async_erase_polls;
+static bool async_suspended;
+static int async_violations;
+
+static int op_erase_start(struct ringfs_flash_partition *flash, ringfs_addr_t address)
+{
+    (void) flash;
+    ck_assert_int_eq(async_erase_address, -1);
+    async_erase_address = address;
+    async_erase_polls = 3;
+    return 0;
+}
+
+static int op_erase_busy(struct ringfs_flash_partition *flash)
+{
+    (void) flash;
+    ck_assert(!async_suspended);
+    if (async_erase_address < 0)
+        return 0;
+    if (--async_erase_polls > 0)
+        return 1;
+    op_sector_erase(flash, async_erase_address);
+    async_erase_address = -1;
+    return 0;
+}
+
+static int op_erase_suspend(struct ringfs_flash_partition *flash)
+{
+    (void) flash;
+    ck_assert(!async_suspended);
+    async_suspended = true;
+    return 0;
+}
+
+static int op_erase_resume(struct ringfs_flash_partition *flash)
+{
+    (void) flash;
+    ck_assert(async_suspended);
+    async_suspended = false;
+    return 0;
+}
+
+static int op_async_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    if (async_erase_address >= 0 && !async_suspended)
+        async_violations++;
+    return op_program(flash, address, data, size);
+}
+
+static int op_async_read(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int size)
+{
+    if (async_erase_address >= 0 && !async_suspended)
+        async_violations++;
+    return op_read(flash, address, data, size);
+}
+
+START_TEST(test_ringfs_erase_async)
+{
+    printf("# test_ringfs_erase_async\n");
+
+    struct ringfs_flash_partition async_flash = flash;
+    async_flash.program = op_async_program;
+    async_flash.read = op_async_read;
+    async_flash.erase_start = op_erase_start;
+    async_flash.erase_busy = op_erase_busy;
+    async_flash.erase_suspend = op_erase_suspend;
+    async_flash.erase_resume = op_erase_resume;
+    async_erase_address = -1;
+    async_suspended = false;
+    async_violations = 0;
+
+    struct ringfs fs;
+    int obj;
+    ringfs_init(&fs, &async_flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_erase_ahead(&fs, 2, NULL) == 0);
+    ringfs_format(&fs);
+#ifdef RINGFS_STATS
+    struct ringfs_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    ck_assert(ringfs_set_stats(&fs, &stats) == 0);
+#endif
+
+    printf("## begin/poll\n");
+    for (int i=0; i<fs.slots_per_sector; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    ck_assert_int_eq(ringfs_erase_begin(&fs, 0), 1);
+    ck_assert_int_eq(ringfs_erase_begin(&fs, 1), -1);
+    ck_assert_int_eq(fs.read.sector, 1);
+    ck_assert_int_eq(ringfs_erase_poll(&fs), 1);
+    ck_assert(ringfs_append(&fs, (int[]) { 42 }) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 42);
+#ifdef RINGFS_STATS
+    const uint32_t erase_programs = stats.ops[RINGFS_CALL_ERASE][RINGFS_OP_PROGRAM];
+#endif
+    ck_assert_int_eq(ringfs_erase_poll(&fs), 1);
+    ck_assert_int_eq(ringfs_erase_poll(&fs), 0);
+    ck_assert_int_eq(ringfs_erase_poll(&fs), 0);
+#ifdef RINGFS_STATS
+    /* Freeing the erased sector is charged to the poll, not the fetch before it. */
+    ck_assert_int_eq(stats.ops[RINGFS_CALL_FETCH][RINGFS_OP_PROGRAM], 0);
+    ck_assert_int_gt(stats.ops[RINGFS_CALL_ERASE][RINGFS_OP_PROGRAM], erase_programs);
+#endif
+    ck_assert_int_eq(async_erase_address, -1);
+    ck_assert_int_eq(ringfs_erase_begin(&fs, 0), 0);
+
+    printf("## background pool erases\n");
+    ringfs_format(&fs);
+    int total = 0;
+    for (int round=0; round<4*flash.sector_count; round++) {
+        erase_count = 0;
+        for (int i=0; i<fs.slots_per_sector; i++)
+            ck_assert(ringfs_append(&fs, (int[]) { total++ }) == 0);
+        ck_assert_int_eq(erase_count, 0);
+        while (ringfs_service(&fs))
+            ;
+        ck_assert_int_eq(async_erase_address, -1);
+        assert_scan_integrity(&fs);
+    }
+    for (int i=total-ringfs_capacity(&fs); i<total; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+
+    printf("## appends wait for an erase they need\n");
+    for (int i=0; i<2*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_append(&fs, (int[]) { total++ }) == 0);
+        if (fs.erase.sector < 0)
+            ringfs_service(&fs);
+    }
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert_int_eq(fs.erase.sector, -1);
+    assert_scan_integrity(&fs);
+
+    printf("## interrupted erase is repaired by scan\n");
+    ringfs_format(&fs);
+    for (int i=0; i<fs.slots_per_sector; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    ck_assert_int_eq(ringfs_erase_begin(&fs, 0), 1);
+    async_erase_address = -1; /* power cut: nothing erased */
+    struct ringfs newfs;
+    ringfs_init(&newfs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&newfs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&newfs), 0);
+
+    ck_assert_int_eq(async_violations, 0);
+}
+END_TEST
+
+/* Striping: two chips on one simulator, each with its own background erase. */
+struct stripe_chip {
+    int erase_address;
+    int erase_polls;
+    bool suspended;
+    int suspends;
+};
+
+static int stripe_erasing; /* chips running an erase */
+static int stripe_busy; /* accesses to a chip while it erases */
+static int stripe_parallel; /* accesses to a chip while the other erases */
+static int stripe_violations;
+
+static int op_chip_erase_start(struct ringfs_flash_partition *flash, ringfs_addr_t address)
+{
+    struct stripe_chip *chip = flash->user_data;
+    ck_assert_int_eq(chip->erase_address, -1);
+    chip->erase_address = address;
+    chip->erase_polls = 3;
+    stripe_erasing++;
+    return 0;
+}
+
+static int op_chip_erase_busy(struct ringfs_flash_partition *flash)
+{
+    struct stripe_chip *chip = flash->user_data;
+    ck_assert(!chip->suspended);
+    if (chip->erase_address < 0)
+        return 0;
+    if (--chip->erase_polls > 0)
+        return 1;
+    op_sector_erase(flash, chip->erase_address);
+    chip->erase_address = -1;
+    stripe_erasing--;
+    return 0;
+}
+
+static int op_chip_erase_suspend(struct ringfs_flash_partition *flash)
+{
+    struct stripe_chip *chip = flash->user_data;
+    ck_assert(chip->erase_address >= 0);
+    ck_assert(!chip->suspended);
+    chip->suspended = true;
+    chip->suspends++;
+    return 0;
+}
+
+static int op_chip_erase_resume(struct ringfs_flash_partition *flash)
+{
+    struct stripe_chip *chip = flash->user_data;
+    ck_assert(chip->suspended);
+    chip->suspended = false;
+    return 0;
+}
+
+static void chip_access(struct ringfs_flash_partition *flash, ringfs_addr_t address)
+{
+    struct stripe_chip *chip = flash->user_data;
+    int sector = address / flash->sector_size;
+    ck_assert(sector >= flash->sector_offset);
+    ck_assert(sector < flash->sector_offset + flash->sector_count);
+    if (chip->erase_address >= 0) {
+        stripe_busy++;
+        if (!chip->suspended)
+            stripe_violations++;
+    } else if (stripe_erasing > 0) {
+        stripe_parallel++;
+    }
+}
+
+static int op_chip_program(struct ringfs_flash_partition *flash, ringfs_addr_t address, const void *data, int size)
+{
+    chip_access(flash, address);
+    return op_program(flash, address, data, size);
+}
+
+static int op_chip_read(struct ringfs_flash_partition *flash, ringfs_addr_t address, void *data, int size)
+{
+    chip_access(flash, address);
+    return op_read(flash, address, data, size);
+}
+
+START_TEST(test_ringfs_stripe)
+{
+    printf("# test_ringfs_stripe\n");
+
+    struct stripe_chip chips[2] = { { .erase_address = -1 }, { .erase_address = -1 } };
+    struct ringfs_flash_partition chip_a = {
+        .sector_size = 32,
+        .sector_offset = 4,
+        .sector_count = 3,
+        .user_data = &chips[0],
+
+        .sector_erase = op_sector_erase,
+        .program = op_chip_program,
+        .read = op_chip_read,
+        .erase_start = op_chip_erase_start,
+        .erase_busy = op_chip_erase_busy,
+        .erase_suspend = op_chip_erase_suspend,
+        .erase_resume = op_chip_erase_resume,
+    };
+    struct ringfs_flash_partition chip_b = chip_a;
+    chip_b.sector_offset = 7;
+    chip_b.user_data = &chips[1];
+    struct ringfs_flash_partition * const devices[] = { &chip_a, &chip_b };
+    ringfs_stripe_t stripe;
+
+    printf("## geometry must match\n");
+    chip_b.sector_count = 2;
+    ck_assert(ringfs_stripe_init(&stripe, devices, 2) != 0);
+    chip_b.sector_count = 3;
+    ck_assert(ringfs_stripe_init(&stripe, devices, 0) != 0);
+    ck_assert(ringfs_stripe_init(&stripe, devices, 2) == 0);
+    ck_assert_int_eq(stripe.flash.sector_count, 6);
+    ck_assert(stripe.flash.erase_start != NULL);
+    ck_assert(stripe.flash.map == NULL);
+
+    printf("## sectors alternate between chips\n");
+    struct ringfs fs;
+    int obj;
+    ringfs_init(&fs, &stripe.flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    for (int i=0; i<fs.slots_per_sector+1; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    uint32_t status[3];
+    op_read(&flash, (4+0)*32 + 32-8, &status[0], sizeof(uint32_t));
+    op_read(&flash, (7+0)*32 + 32-8, &status[1], sizeof(uint32_t));
+    op_read(&flash, (4+1)*32 + 32-8, &status[2], sizeof(uint32_t));
+    ck_assert_int_eq(status[0], status[1]);
+    ck_assert(status[1] != status[2]);
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), fs.slots_per_sector+1);
+
+    printf("## wrap around both chips\n");
+    ringfs_format(&fs);
+    for (int i=0; i<3*ringfs_capacity(&fs); i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    for (int i=2*ringfs_capacity(&fs); i<3*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    assert_scan_integrity(&fs);
+
+    printf("## erase on one chip, append to the other\n");
+    ck_assert(ringfs_set_erase_ahead(&fs, 2, NULL) == 0);
+    ringfs_format(&fs);
+    stripe_busy = 0;
+    stripe_parallel = 0;
+    stripe_violations = 0;
+    int total = 0;
+    for (int round=0; round<4*stripe.flash.sector_count; round++) {
+        for (int i=0; i<fs.slots_per_sector; i++) {
+            ck_assert(ringfs_append(&fs, (int[]) { total++ }) == 0);
+            ringfs_service(&fs);
+        }
+        while (ringfs_service(&fs))
+            ;
+        assert_scan_integrity(&fs);
+    }
+    for (int i=total-ringfs_capacity(&fs); i<total; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert_int_eq(stripe_violations, 0);
+    ck_assert(stripe_parallel > 0);
+    ck_assert_int_eq(chips[0].suspends + chips[1].suspends, stripe_busy);
+}
+END_TEST
+
 Suite *ringfs_suite(void)
 {
     Suite *s = suite_create ("ringfs");
@@ -430,6 +2732,34 @@ Suite *ringfs_suite(void)
     tcase_add_test(tc, test_ringfs_capacity);
     tcase_add_test(tc, test_ringfs_count);
     tcase_add_test(tc, test_ringfs_overflow);
+    tcase_add_test(tc, test_ringfs_sector_table);
+    tcase_add_test(tc, test_ringfs_count_table);
+    tcase_add_test(tc, test_ringfs_append_batch);
+    tcase_add_test(tc, test_ringfs_read_buffer);
+    tcase_add_test(tc, test_ringfs_scan_bisect);
+    tcase_add_test(tc, test_ringfs_checkpoint);
+    tcase_add_test(tc, test_ringfs_discard_sectors);
+    tcase_add_test(tc, test_ringfs_slot_bitmap);
+    tcase_add_test(tc, test_ringfs_variable);
+    tcase_add_test(tc, test_ringfs_write_buffer);
+    tcase_add_test(tc, test_ringfs_peek);
+    tcase_add_test(tc, test_ringfs_export);
+    tcase_add_test(tc, test_ringfs_page_align);
+    tcase_add_test(tc, test_ringfs_vectored);
+#ifdef RINGFS_STATS
+    tcase_add_test(tc, test_ringfs_stats);
+#endif
+    tcase_add_test(tc, test_ringfs_cursors);
+    tcase_add_test(tc, test_ringfs_sequence);
+    tcase_add_test(tc, test_ringfs_key_range);
+    tcase_add_test(tc, test_ringfs_sector_groups);
+    tcase_add_test(tc, test_ringfs_spsc);
+    tcase_add_test(tc, test_ringfs_queue);
+    tcase_add_test(tc, test_ringfs_pack);
+    tcase_add_test(tc, test_ringfs_erase_ahead);
+    tcase_add_test(tc, test_ringfs_erase_async);
+    tcase_add_test(tc, test_ringfs_async);
+    tcase_add_test(tc, test_ringfs_stripe);
     suite_add_tcase(s, tc);
 
     return s;